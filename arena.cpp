@@ -0,0 +1,54 @@
+#include "arena.h"
+#include <algorithm>
+
+FrameArena::FrameArena() {
+    chunks.push_back({std::make_unique<Value[]>(chunkSize), chunkSize, nullptr});
+    top = chunks[0].values.get();
+    limit = top + chunkSize;
+}
+
+// Moves on to the next chunk, adding one where there is none big enough
+void FrameArena::grow(size_t count) {
+    chunks[current].used = top;
+    size_t next = current + 1;
+    if (next == chunks.size() || chunks[next].size < count) {
+        size_t size = std::max(chunkSize, count);
+        chunks.insert(chunks.begin() + next, {std::make_unique<Value[]>(size), size, nullptr});
+    }
+    current = next;
+    top = chunks[current].values.get();
+    limit = top + chunks[current].size;
+}
+
+// Values given back are reset to 0, dropping the lists they held, so the
+// next frames taken from the arena start out as 0 too
+void FrameArena::clear(Value* from, Value* to) {
+    for (Value* value = from; value != to; ++value) {
+        *value = Value();
+    }
+}
+
+void FrameArena::release(Mark mark) {
+    while (current > mark.chunk) {
+        clear(chunks[current].values.get(), top);
+        --current;
+        top = chunks[current].used;
+        limit = chunks[current].values.get() + chunks[current].size;
+    }
+    clear(mark.top, top);
+    top = mark.top;
+}
+
+Value* FrameArena::replace(Value* older, Value* frame, size_t count) {
+    Value* start = chunks[current].values.get();
+    if (older < start || older >= frame) return frame; // In an earlier chunk
+    std::move(frame, frame + count, older);
+    clear(older + count, top);
+    top = older + count;
+    return older;
+}
+
+void FrameArena::reset() {
+    if (current != 0 || top != chunks[0].values.get()) return; // Still in use, by an outer evaluation
+    chunks.resize(1);
+}
@@ -0,0 +1,75 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include "value.h"
+
+// Bump allocator for the argument frames of the tree walker's calls, one per
+// evaluating thread. Frames are taken from the top and given back in the
+// reverse order, as calls return, and the memory stays with the arena, so a
+// call does not allocate once the arena has grown as deep as the evaluation.
+class FrameArena {
+public:
+    FrameArena();
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    // Top of the arena, to give back every frame taken after it at once
+    struct Mark {
+        size_t chunk;
+        Value* top;
+    };
+    Mark mark() const { return {current, top}; }
+    void release(Mark mark);
+
+    // Gives back every frame taken while it exists, also when a call throws
+    class Scope {
+    public:
+        explicit Scope(FrameArena& arena) : arena(arena), start(arena.mark()) {}
+        ~Scope() { arena.release(start); }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        FrameArena& arena;
+        Mark start;
+    };
+
+    // count values, all 0, on top of the arena
+    Value* allocate(size_t count) {
+        if (static_cast<size_t>(limit - top) < count) grow(count);
+        Value* frame = top;
+        top += count;
+        return frame;
+    }
+
+    // For a tail call: moves the count values of frame, the top of the arena,
+    // down into older, the frame of the call it replaces, and gives back the
+    // rest. Returns where the values are; they stay in frame when they do not
+    // fit at older, which is then given back with its scope.
+    Value* replace(Value* older, Value* frame, size_t count);
+
+    // Frees the memory beyond the first chunk once every frame was given back;
+    // done after each top-level statement
+    void reset();
+
+private:
+    struct Chunk {
+        std::unique_ptr<Value[]> values;
+        size_t size;
+        Value* used; // Top of the chunk while later chunks are in use
+    };
+    static constexpr size_t chunkSize = 4096;
+
+    void grow(size_t count);
+    static void clear(Value* from, Value* to);
+
+    std::vector<Chunk> chunks;
+    size_t current = 0;
+    Value* top = nullptr;
+    Value* limit = nullptr;
+};
+
+#endif // ARENA_H
@@ -0,0 +1,331 @@
+// Benchmark driver for `make bench`. Runs a fixed set of ThisFunc workloads
+// through the interpreter and prints the results as one JSON object, so runs
+// of different builds can be diffed.
+//
+// Usage: thisFuncBench [--engine=vm|tree] [--threads=N] [workload...]
+// Without an engine both are measured; without workload names all run.
+
+#include "interpreter.h"
+#include "shared.h"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The counting operator new below pairs malloc with free
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+namespace {
+
+// Counted by the replacement operator new below
+std::atomic<uint64_t> allocations{0};
+std::atomic<uint64_t> allocatedBytes{0};
+
+} // namespace
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* memory = std::malloc(size ? size : 1)) return memory;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+namespace {
+
+struct Workload {
+    std::string name;
+    std::function<void(ThisFuncInterpreter&)> setup; // Not timed
+    std::function<void(ThisFuncInterpreter&)> run;   // Timed, once per run
+    size_t runs;
+    uint64_t callsPerRun; // ThisFunc calls (or declarations) made by one run
+};
+
+struct Settings {
+    Engine engine = Engine::VM;
+    size_t threads = 1;
+};
+
+std::vector<double> iota(size_t count) {
+    std::vector<double> elements(count);
+    for (size_t i = 0; i < count; ++i) {
+        elements[i] = static_cast<double>(i);
+    }
+    return elements;
+}
+
+void declare(ThisFuncInterpreter& interpreter, const std::vector<std::string>& declarations) {
+    for (const auto& declaration : declarations) {
+        interpreter.declareFunction(declaration);
+    }
+}
+
+std::string power(size_t count) {
+    size_t exponent = 0;
+    while (count >= 10) {
+        count /= 10;
+        ++exponent;
+    }
+    return "1e" + std::to_string(exponent);
+}
+
+void configure(ThisFuncInterpreter& interpreter, const Settings& settings) {
+    interpreter.setEngine(settings.engine);
+    interpreter.setThreads(settings.threads);
+}
+
+std::vector<Workload> workloads(const Settings& settings) {
+    std::vector<Workload> result;
+
+    // Deep recursion
+    result.push_back({"factorial_2000", [](ThisFuncInterpreter& interpreter) {
+        declare(interpreter, {"factorial <- if(eq(#0, 0), 1, mul(#0, factorial(sub(#0, 1))))"});
+    }, [](ThisFuncInterpreter& interpreter) {
+        interpreter.evaluate("factorial(2000)");
+    }, 200, 2001});
+
+    result.push_back({"fib_20", [](ThisFuncInterpreter& interpreter) {
+        declare(interpreter, {"fib <- if(le(#0, 1), #0, add(fib(sub(#0, 1)), fib(sub(#0, 2))))"});
+    }, [](ThisFuncInterpreter& interpreter) {
+        interpreter.evaluate("fib(20)");
+    }, 20, 21891});
+
+    result.push_back({"fib_20_jit", [](ThisFuncInterpreter& interpreter) {
+        interpreter.setJit(true);
+        declare(interpreter, {"fib <- if(le(#0, 1), #0, add(fib(sub(#0, 1)), fib(sub(#0, 2))))"});
+    }, [](ThisFuncInterpreter& interpreter) {
+        interpreter.evaluate("fib(20)");
+    }, 20, 21891});
+
+    // The same recursion with both calls forked near the root (--fork-depth);
+    // with a single thread there is no pool and it runs in order
+    result.push_back({"fib_24_fork", [](ThisFuncInterpreter& interpreter) {
+        interpreter.setForkDepth(8);
+        declare(interpreter, {"fib <- if(le(#0, 1), #0, add(fib(sub(#0, 1)), fib(sub(#0, 2))))"});
+    }, [](ThisFuncInterpreter& interpreter) {
+        interpreter.evaluate("fib(24)");
+    }, 5, 150049});
+
+    // map/filter over host-built lists, summed so every element is produced;
+    // the bodies qualify for SIMD kernels
+    const std::vector<std::pair<size_t, size_t>> sizes = {{1000, 2000}, {100000, 50}, {10000000, 3}};
+    for (const auto& size : sizes) {
+        size_t count = size.first;
+        auto setup = [count](ThisFuncInterpreter& interpreter) {
+            interpreter.declareList("xs", iota(count));
+            declare(interpreter, {"double <- mul(#0, 2)",
+                                  "lowHalf <- le(#0, " + std::to_string(count / 2) + ")"});
+        };
+        result.push_back({"map_" + power(count), setup, [](ThisFuncInterpreter& interpreter) {
+            interpreter.evaluate("sum(map(double, xs))");
+        }, size.second, count});
+        result.push_back({"filter_" + power(count), setup, [](ThisFuncInterpreter& interpreter) {
+            interpreter.evaluate("sum(filter(lowHalf, xs))");
+        }, size.second, count});
+    }
+
+    // Walking a list element by element with tail
+    result.push_back({"tail_walk_1e5", [](ThisFuncInterpreter& interpreter) {
+        std::vector<double> elements = iota(100000);
+        elements.push_back(-1);
+        interpreter.declareList("walked", std::move(elements));
+        declare(interpreter, {"walk <- if(eq(head(#0), -1), #1, walk(tail(#0), add(#1, head(#0))))"});
+    }, [](ThisFuncInterpreter& interpreter) {
+        interpreter.evaluate("walk(walked, 0)");
+    }, 10, 100001});
+
+    // Lazy pipelines over ranges: a fused map/filter chain folded in blocks,
+    // a reduce calling a user function, and a head that stops early
+    result.push_back({"range_pipeline_1e7", [](ThisFuncInterpreter& interpreter) {
+        declare(interpreter, {"double <- mul(#0, 2)", "odd <- nand(eq(#0, mul(2, div(#0, 2))), 1)"});
+    }, [](ThisFuncInterpreter& interpreter) {
+        interpreter.evaluate("sum(filter(odd, map(double, range(0, 10000000, 0.5))))");
+    }, 3, 20000000});
+    result.push_back({"range_reduce_1e5", [](ThisFuncInterpreter& interpreter) {
+        declare(interpreter, {"plus <- add(#0, #1)"});
+    }, [](ThisFuncInterpreter& interpreter) {
+        interpreter.evaluate("reduce(plus, 0, range(0, 100000))");
+    }, 20, 100000});
+    result.push_back({"range_head_1e9", [](ThisFuncInterpreter& interpreter) {
+        declare(interpreter, {"late <- nand(le(#0, 1000), 1)"});
+    }, [](ThisFuncInterpreter& interpreter) {
+        interpreter.evaluate("head(filter(late, range(0, 1000000000)))");
+    }, 200, 1001});
+
+    // A REPL session: a fresh interpreter taking 1000 small declarations
+    result.push_back({"declarations_1000", nullptr, [settings](ThisFuncInterpreter&) {
+        ThisFuncInterpreter session;
+        configure(session, settings);
+        session.declareFunction("f0 <- add(#0, 1)");
+        for (int i = 1; i < 1000; ++i) {
+            session.declareFunction("f" + std::to_string(i) + " <- add(f" + std::to_string(i - 1) + "(#0), " +
+                                    std::to_string(i) + ")");
+        }
+        session.evaluate("f999(1)");
+    }, 20, 1000});
+
+    // Four threads evaluating against the published table of a shared
+    // interpreter while another thread publishes a version per redeclaration
+    auto shared = std::make_shared<SharedInterpreter>();
+    result.push_back({"shared_readers_4", [shared, settings](ThisFuncInterpreter&) {
+        shared->update([settings](ThisFuncInterpreter& interpreter) { configure(interpreter, settings); });
+        shared->declare({"fib <- if(le(#0, 1), #0, add(fib(sub(#0, 1)), fib(sub(#0, 2))))", "offset <- 0"});
+    }, [shared](ThisFuncInterpreter&) {
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 4; ++t) {
+            readers.emplace_back([shared] {
+                for (int i = 0; i < 10; ++i) {
+                    shared->evaluate("add(fib(15), offset())");
+                }
+            });
+        }
+        for (int i = 1; i <= 10; ++i) {
+            shared->declare({"offset <- " + std::to_string(i)});
+        }
+        for (auto& reader : readers) {
+            reader.join();
+        }
+    }, 20, 4 * 10 * 1973 + 10});
+
+    // Parsing and compiling long expressions
+    std::string nested;
+    for (int i = 0; i < 1000; ++i) nested += "add(" + std::to_string(i) + ", ";
+    nested += "0";
+    nested += std::string(1000, ')');
+    result.push_back({"parse_nested_1000", nullptr, [nested](ThisFuncInterpreter& interpreter) {
+        interpreter.evaluate(nested);
+    }, 200, 1000});
+
+    std::string wide = "head(list(";
+    for (int i = 0; i < 100000; ++i) {
+        if (i > 0) wide += ", ";
+        wide += std::to_string(i) + ".5";
+    }
+    wide += "))";
+    result.push_back({"parse_list_1e5", nullptr, [wide](ThisFuncInterpreter& interpreter) {
+        interpreter.evaluate(wide);
+    }, 20, 2});
+
+    return result;
+}
+
+// Peak resident set size since the last reset, in kB (Linux only, else 0)
+void resetPeakRss() {
+    std::ofstream clearRefs("/proc/self/clear_refs");
+    if (clearRefs.is_open()) clearRefs << "5";
+}
+
+size_t peakRssKb() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmHWM:", 0) == 0) {
+            return std::strtoull(line.c_str() + 6, nullptr, 10);
+        }
+    }
+    return 0;
+}
+
+const char* engineName(Engine engine) {
+    return engine == Engine::VM ? "vm" : "tree";
+}
+
+bool selected(const std::string& name, const std::vector<std::string>& names) {
+    if (names.empty()) return true;
+    for (const auto& selectedName : names) {
+        if (name == selectedName) return true;
+    }
+    return false;
+}
+
+void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [--engine=vm|tree] [--threads=N] [workload...]\n";
+}
+
+bool parseCount(const std::string& text, size_t& count) {
+    try {
+        size_t consumed = 0;
+        count = std::stoul(text, &consumed);
+        return consumed == text.size();
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::vector<Engine> engines = {Engine::VM, Engine::Tree};
+    size_t threads = 1;
+    std::vector<std::string> names;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--engine=vm") {
+            engines = {Engine::VM};
+        } else if (arg == "--engine=tree") {
+            engines = {Engine::Tree};
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            if (!parseCount(arg.substr(10), threads)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg.rfind("--", 0) == 0) {
+            printUsage(argv[0]);
+            return 1;
+        } else {
+            names.push_back(arg);
+        }
+    }
+
+    std::cout << "{\n  \"compiler\": \"" << __VERSION__ << "\",\n  \"threads\": " << threads
+              << ",\n  \"workloads\": [";
+    bool first = true;
+    for (Engine engine : engines) {
+        Settings settings{engine, threads};
+        for (const auto& workload : workloads(settings)) {
+            if (!selected(workload.name, names)) continue;
+
+            ThisFuncInterpreter interpreter;
+            configure(interpreter, settings);
+            if (workload.setup) workload.setup(interpreter);
+            workload.run(interpreter); // Warm-up
+
+            resetPeakRss();
+            uint64_t allocationsBefore = allocations.load();
+            uint64_t bytesBefore = allocatedBytes.load();
+            auto start = std::chrono::steady_clock::now();
+            for (size_t run = 0; run < workload.runs; ++run) {
+                workload.run(interpreter);
+            }
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            double ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+            double runs = static_cast<double>(workload.runs);
+
+            std::cout << (first ? "\n" : ",\n") << "    {\"name\": \"" << workload.name << "\", \"engine\": \""
+                      << engineName(engine) << "\", \"runs\": " << workload.runs
+                      << ", \"calls_per_run\": " << workload.callsPerRun
+                      << ", \"ns_per_run\": " << static_cast<uint64_t>(ns / runs)
+                      << ", \"ns_per_call\": " << ns / runs / static_cast<double>(workload.callsPerRun)
+                      << ", \"allocations_per_run\": " << static_cast<uint64_t>((allocations.load() - allocationsBefore) / runs)
+                      << ", \"allocated_bytes_per_run\": " << static_cast<uint64_t>((allocatedBytes.load() - bytesBefore) / runs)
+                      << ", \"peak_rss_kb\": " << peakRssKb() << "}";
+            std::cout.flush();
+            first = false;
+        }
+    }
+    std::cout << "\n  ]\n}\n";
+    return 0;
+}
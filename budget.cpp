@@ -0,0 +1,76 @@
+#include "budget.h"
+#include <stdexcept>
+#include <string>
+
+thread_local Budget* Budget::active = nullptr;
+thread_local uint64_t Budget::countdown = UINT64_MAX;
+thread_local uint64_t Budget::granted = UINT64_MAX;
+
+Budget::Budget(const Limits& limits, const std::atomic<uint64_t>& cancellations)
+    : limits(limits), deadline(Clock::now() + std::chrono::milliseconds(limits.milliseconds)),
+      cancellations(cancellations), cancellationsAtStart(cancellations.load()) {}
+
+Budget::Scope::Scope(Budget* budget) : saved(active), savedCountdown(countdown), savedGranted(granted) {
+    settle();
+    active = budget;
+    // Checks right away, so a statement cancelled before it got here stops
+    countdown = granted = 1;
+}
+
+Budget::Scope::~Scope() {
+    settle();
+    active = saved;
+    countdown = savedCountdown;
+    granted = savedGranted;
+}
+
+void Budget::settle() {
+    if (active) active->steps.fetch_add(granted - countdown, std::memory_order_relaxed);
+    granted = countdown;
+}
+
+void Budget::checkpoint(uint64_t count) {
+    Budget* budget = active;
+    if (!budget) {
+        countdown = granted = UINT64_MAX;
+        return;
+    }
+    uint64_t counted = granted - countdown + count;
+    countdown = granted = 0; // Until refilled below, every step checks again
+    uint64_t used = budget->steps.fetch_add(counted, std::memory_order_relaxed) + counted;
+
+    if (budget->cancellations.load(std::memory_order_relaxed) != budget->cancellationsAtStart) {
+        throw std::runtime_error("Evaluation cancelled");
+    }
+    const Limits& limits = budget->limits;
+    if (limits.steps > 0 && used > limits.steps) {
+        throw std::runtime_error("Step limit exceeded: more than " + std::to_string(limits.steps) + " steps");
+    }
+    if (limits.milliseconds > 0 && Clock::now() > budget->deadline) {
+        throw std::runtime_error("Time limit exceeded: more than " + std::to_string(limits.milliseconds) + " ms");
+    }
+
+    // The step past the limit is the one that checks next
+    uint64_t refill = checkInterval;
+    if (limits.steps > 0 && limits.steps - used < refill) refill = limits.steps - used + 1;
+    countdown = granted = refill;
+}
+
+bool Budget::resume() noexcept {
+    try {
+        checkpoint(0);
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+void Budget::allocate(size_t bytes) {
+    Budget* budget = active;
+    if (!budget || budget->limits.listBytes == 0) return;
+    uint64_t total = budget->listBytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    if (total > budget->limits.listBytes) {
+        throw std::runtime_error("List memory limit exceeded: more than " + std::to_string(budget->limits.listBytes) +
+                                 " bytes");
+    }
+}
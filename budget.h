@@ -0,0 +1,87 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Limits on what one statement may use (--max-steps, --time-limit,
+// --max-list-bytes); zero means no limit. Call depth has its own limit,
+// the stack size.
+struct Limits {
+    uint64_t steps = 0;        // User calls, tail calls included, and list elements run through pipelines
+    uint64_t milliseconds = 0; // Wall time
+    uint64_t listBytes = 0;    // Bytes of list elements created
+};
+
+// What is left of the limits of the statement being evaluated, shared by
+// every thread working on it. The engines count steps down in a counter of
+// their thread and only look at the shared totals, the clock and whether
+// the statement was cancelled when it runs out, at most every checkInterval
+// steps. Running out of anything throws from there, which unwinds the
+// statement like any other error.
+class Budget {
+public:
+    // cancellations is the interpreter's count of cancel() calls; a later
+    // one than when the statement started stops it
+    Budget(const Limits& limits, const std::atomic<uint64_t>& cancellations);
+    Budget(const Budget&) = delete;
+    Budget& operator=(const Budget&) = delete;
+
+    // Makes budget the current thread's while it exists (none if null),
+    // e.g. on a pool worker helping with the statement
+    class Scope {
+    public:
+        explicit Scope(Budget* budget);
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        Budget* saved;
+        uint64_t savedCountdown;
+        uint64_t savedGranted;
+    };
+
+    static Budget* current() { return active; }
+
+    // Counts count steps on the current thread
+    static void step(uint64_t count = 1) {
+        if (count < countdown) {
+            countdown -= count;
+        } else {
+            checkpoint(count);
+        }
+    }
+
+    // Counts bytes of list elements the statement creates
+    static void allocate(size_t bytes);
+
+    // Steps left before the next check, for native code to count down
+    // itself. When it reaches zero, resume checks and refills it, returning
+    // false instead of throwing when the statement has to stop; step(0) then
+    // throws why.
+    static uint64_t& stepsLeft() { return countdown; }
+    static bool resume() noexcept;
+
+private:
+    static constexpr uint64_t checkInterval = 1 << 14;
+    using Clock = std::chrono::steady_clock;
+
+    static thread_local Budget* active;
+    static thread_local uint64_t countdown; // Steps before the next check
+    static thread_local uint64_t granted;   // What countdown was refilled to
+
+    Limits limits;
+    Clock::time_point deadline;
+    const std::atomic<uint64_t>& cancellations;
+    uint64_t cancellationsAtStart;
+    std::atomic<uint64_t> steps{0};
+    std::atomic<uint64_t> listBytes{0};
+
+    static void checkpoint(uint64_t count);
+    static void settle(); // Adds the steps counted down since the last check
+};
+
+#endif // BUDGET_H
@@ -0,0 +1,180 @@
+#include "bytecode.h"
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+
+namespace {
+
+struct ScalarBuiltin {
+    OpCode op;
+    size_t argc;
+};
+
+// Builtins with a dedicated opcode; only used when the call has the right arity
+const std::unordered_map<std::string, ScalarBuiltin> scalarBuiltins = {
+    {"add", {OpCode::Add, 2}}, {"sub", {OpCode::Sub, 2}}, {"mul", {OpCode::Mul, 2}},
+    {"div", {OpCode::Div, 2}}, {"pow", {OpCode::Pow, 2}}, {"sqrt", {OpCode::Sqrt, 1}},
+    {"sin", {OpCode::Sin, 1}}, {"cos", {OpCode::Cos, 1}}, {"eq", {OpCode::Eq, 2}},
+    {"le", {OpCode::Le, 2}}
+};
+
+// A forked argument is compiled without forks and without tail calls, so its
+// calls push frames at the depth they would have inline
+ChunkPtr compileBody(const Node& body, size_t builtinCount, bool scalarOpcodes, bool forkedArgument);
+
+class Compiler {
+public:
+    Compiler(Chunk& chunk, size_t builtinCount, bool scalarOpcodes, bool forks)
+        : chunk(chunk), builtinCount(builtinCount), scalarOpcodes(scalarOpcodes), forks(forks) {}
+
+    // A node is in tail position when its value is returned directly from
+    // the chunk; calls there become TailCall and if branches return directly
+    void compile(const Node& node, bool tail = false) {
+        switch (node.kind) {
+        case Node::Kind::Number:
+            emit(OpCode::PushConst, addConstant(node.number));
+            return;
+
+        case Node::Kind::Placeholder:
+            emit(OpCode::LoadArg, static_cast<uint32_t>(node.index));
+            return;
+
+        case Node::Kind::Name:
+            emit(OpCode::LoadName, static_cast<uint32_t>(node.symbol));
+            return;
+
+        case Node::Kind::Call:
+            compileCall(node, tail);
+            return;
+        }
+    }
+
+    void emit(OpCode op, uint32_t operand = 0, uint32_t argc = 0) {
+        chunk.code.push_back({op, operand, argc});
+    }
+
+private:
+    Chunk& chunk;
+    size_t builtinCount;
+    bool scalarOpcodes;
+    bool forks; // Fork points may be emitted; off inside forked arguments, so code grows at most twofold
+    std::unordered_map<uint64_t, uint32_t> constantSlots; // Bit pattern to constant index
+
+    void compileCall(const Node& node, bool tail) {
+        const std::string& name = node.name;
+
+        if (name == "if") {
+            if (node.args.size() != 3) {
+                emit(OpCode::Throw, addMessage("if requires exactly three arguments"));
+                return;
+            }
+            compile(*node.args[0]);
+            size_t jumpToElse = emitJump(OpCode::JumpIfFalse);
+            compile(*node.args[1], tail);
+            if (tail) {
+                emit(OpCode::Return);
+                patch(jumpToElse);
+                compile(*node.args[2], tail);
+                return;
+            }
+            size_t jumpToEnd = emitJump(OpCode::Jump);
+            patch(jumpToElse);
+            compile(*node.args[2]);
+            patch(jumpToEnd);
+            return;
+        }
+
+        if (name == "nand") {
+            if (node.args.size() != 2) {
+                emit(OpCode::Throw, addMessage("nand requires exactly two arguments"));
+                return;
+            }
+            // nand(a, b) is 1 when a is false, otherwise !b
+            compile(*node.args[0]);
+            size_t jumpToTrue = emitJump(OpCode::JumpIfFalse);
+            compile(*node.args[1]);
+            emit(OpCode::Not);
+            size_t jumpToEnd = emitJump(OpCode::Jump);
+            patch(jumpToTrue);
+            emit(OpCode::PushConst, addConstant(1.0));
+            patch(jumpToEnd);
+            return;
+        }
+
+        if (node.parallelArgs && forks) {
+            // The arguments are also compiled on their own; Fork either runs
+            // those in parallel and skips the inline code, or falls through
+            ForkPoint fork;
+            for (const auto& arg : node.args) {
+                fork.args.push_back(compileBody(*arg, builtinCount, scalarOpcodes, true));
+            }
+            emit(OpCode::Fork, static_cast<uint32_t>(chunk.forks.size()), static_cast<uint32_t>(node.args.size()));
+            forks = false;
+            for (const auto& arg : node.args) {
+                compile(*arg);
+            }
+            forks = true;
+            fork.end = static_cast<uint32_t>(chunk.code.size());
+            chunk.forks.push_back(std::move(fork));
+        } else {
+            for (const auto& arg : node.args) {
+                compile(*arg);
+            }
+        }
+
+        auto scalar = scalarBuiltins.find(name);
+        if (scalarOpcodes && scalar != scalarBuiltins.end() && scalar->second.argc == node.args.size()) {
+            emit(scalar->second.op);
+            return;
+        }
+
+        OpCode op = node.symbol < builtinCount ? OpCode::CallBuiltin : (tail ? OpCode::TailCall : OpCode::CallUser);
+        emit(op, static_cast<uint32_t>(node.symbol), static_cast<uint32_t>(node.args.size()));
+    }
+
+    size_t emitJump(OpCode op) {
+        emit(op);
+        return chunk.code.size() - 1;
+    }
+
+    void patch(size_t jump) {
+        chunk.code[jump].operand = static_cast<uint32_t>(chunk.code.size());
+    }
+
+    // Equal constants share a slot; they are compared bitwise, so 0 and -0 stay apart
+    uint32_t addConstant(double value) {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        auto found = constantSlots.find(bits);
+        if (found != constantSlots.end()) return found->second;
+
+        uint32_t slot = static_cast<uint32_t>(chunk.constants.size());
+        chunk.constants.push_back(value);
+        constantSlots.emplace(bits, slot);
+        return slot;
+    }
+
+    uint32_t addMessage(const std::string& message) {
+        chunk.messages.push_back(message);
+        return static_cast<uint32_t>(chunk.messages.size() - 1);
+    }
+};
+
+ChunkPtr compileBody(const Node& body, size_t builtinCount, bool scalarOpcodes, bool forkedArgument) {
+    auto chunk = std::make_shared<Chunk>();
+    Compiler compiler(*chunk, builtinCount, scalarOpcodes, !forkedArgument);
+    compiler.compile(body, !forkedArgument);
+    compiler.emit(OpCode::Return);
+    return chunk;
+}
+
+} // namespace
+
+ChunkPtr compileChunk(const Node& body, size_t builtinCount, bool scalarOpcodes) {
+    return compileBody(body, builtinCount, scalarOpcodes, false);
+}
+
+OpCode scalarOpcode(const std::string& name, size_t argc) {
+    auto scalar = scalarBuiltins.find(name);
+    return scalar != scalarBuiltins.end() && scalar->second.argc == argc ? scalar->second.op : OpCode::Return;
+}
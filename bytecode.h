@@ -0,0 +1,62 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "parser.h"
+
+// Instruction set of the stack-based virtual machine
+enum class OpCode : uint8_t {
+    PushConst,   // push constants[operand]
+    LoadArg,     // push argument slot #operand of the current frame
+    LoadName,    // push the list or function reference bound to symbol operand
+    Add, Sub, Mul, Div, Pow, Sqrt, Sin, Cos, Eq, Le, // scalar builtins
+    Not,         // pop x, push x == 0
+    Jump,        // continue at operand
+    JumpIfFalse, // pop x, continue at operand if x == 0
+    CallBuiltin, // call builtin symbol operand with argc values from the stack
+    CallUser,    // call user function symbol operand with argc values from the stack
+    TailCall,    // CallUser in tail position: reuses the current frame
+    Fork,        // push the values of forks[operand] computed in parallel and continue at its end,
+                 // or fall through to the inline code of the same arguments
+    Throw,       // raise messages[operand] as a runtime error
+    Return       // pop the result and leave the current frame
+};
+
+struct Instruction {
+    OpCode op;
+    uint32_t operand = 0;
+    uint32_t argc = 0;
+};
+
+struct Chunk;
+using ChunkPtr = std::shared_ptr<const Chunk>;
+
+// Arguments of a call that may be evaluated in parallel, each compiled as a
+// chunk of its own that runs with the arguments of the forking frame
+struct ForkPoint {
+    std::vector<ChunkPtr> args;
+    uint32_t end = 0; // Instruction after the inline code of the arguments
+};
+
+// Compiled form of a single expression or function body
+struct Chunk {
+    std::vector<Instruction> code;
+    std::vector<double> constants;
+    std::vector<std::string> messages; // errors detected at compile time
+    std::vector<ForkPoint> forks;
+};
+
+// Compiles an expression tree whose symbols have been resolved; symbols
+// below builtinCount are builtins. Without scalarOpcodes every builtin is
+// called through CallBuiltin, so each call can be observed (--profile).
+// Calls marked with parallelArgs get a Fork point.
+ChunkPtr compileChunk(const Node& body, size_t builtinCount, bool scalarOpcodes = true);
+
+// Dedicated opcode of the builtin name when called with argc arguments, or
+// Return when calls of it go through CallBuiltin
+OpCode scalarOpcode(const std::string& name, size_t argc);
+
+#endif // BYTECODE_H
@@ -0,0 +1,463 @@
+#include "interpreter.h"
+
+// Static checker, run when a function is declared and before an expression
+// is evaluated. It infers what each argument of a user function is used as
+// and what the function returns, and reports the calls that can only fail:
+// wrong argument counts, lists where numbers are needed and the like. Calls
+// of names that are not declared yet, or of functions that stopped checking
+// when one of their callees was redeclared, are left to the engines.
+//
+// Parameters start as Any and narrow to what the body uses them as where it
+// always evaluates them, so a branch that is not taken rejects no call;
+// results start as Unknown and widen to what the body can return. Parameters
+// only depend on the parameters of the callees, so functions that call each
+// other settle their parameters first and their results after.
+
+namespace {
+
+struct BuiltinType {
+    std::vector<ValueKind> parameters;
+    ValueKind result;
+    bool variadic = false; // Any number of arguments of the first parameter's kind
+    size_t optional = 0;   // Trailing parameters that may be left out
+};
+
+const std::unordered_map<std::string, BuiltinType> builtinTypes = {
+    {"add", {{ValueKind::Scalar, ValueKind::Scalar}, ValueKind::Scalar}},
+    {"sub", {{ValueKind::Scalar, ValueKind::Scalar}, ValueKind::Scalar}},
+    {"mul", {{ValueKind::Scalar, ValueKind::Scalar}, ValueKind::Scalar}},
+    {"div", {{ValueKind::Scalar, ValueKind::Scalar}, ValueKind::Scalar}},
+    {"pow", {{ValueKind::Scalar, ValueKind::Scalar}, ValueKind::Scalar}},
+    {"sqrt", {{ValueKind::Scalar}, ValueKind::Scalar}},
+    {"sin", {{ValueKind::Scalar}, ValueKind::Scalar}},
+    {"cos", {{ValueKind::Scalar}, ValueKind::Scalar}},
+    {"nand", {{ValueKind::Scalar, ValueKind::Scalar}, ValueKind::Scalar}},
+    {"le", {{ValueKind::Scalar, ValueKind::Scalar}, ValueKind::Scalar}},
+    {"eq", {{ValueKind::Scalar, ValueKind::Scalar}, ValueKind::Scalar}},
+    {"if", {{ValueKind::Scalar, ValueKind::Any, ValueKind::Any}, ValueKind::Any}},
+    {"list", {{ValueKind::Scalar}, ValueKind::List, true}},
+    {"head", {{ValueKind::List}, ValueKind::Scalar}},
+    {"tail", {{ValueKind::List}, ValueKind::List}},
+    {"map", {{ValueKind::Function, ValueKind::List}, ValueKind::List}},
+    {"filter", {{ValueKind::Function, ValueKind::List}, ValueKind::List}},
+    {"range", {{ValueKind::Scalar, ValueKind::Scalar, ValueKind::Scalar}, ValueKind::List, false, 1}},
+    {"reduce", {{ValueKind::Function, ValueKind::Scalar, ValueKind::List}, ValueKind::Scalar}},
+    {"sum", {{ValueKind::List}, ValueKind::Scalar}}
+};
+
+ValueKind join(ValueKind a, ValueKind b) {
+    if (a == ValueKind::Unknown) return b;
+    if (b == ValueKind::Unknown || a == b) return a;
+    return ValueKind::Any;
+}
+
+bool fits(ValueKind actual, ValueKind expected) {
+    return actual == expected || expected == ValueKind::Any || actual == ValueKind::Any
+        || actual == ValueKind::Unknown;
+}
+
+// The value node evaluates to, for error messages
+std::string describe(ValueKind kind, const Node* node = nullptr) {
+    switch (kind) {
+    case ValueKind::Scalar:
+        return "a scalar value";
+    case ValueKind::List:
+        return "a list";
+    case ValueKind::Function:
+        return node && node->kind == Node::Kind::Name ? "the function " + node->name : "a function";
+    default:
+        return "a value";
+    }
+}
+
+std::string mismatch(ValueKind expected, const std::string& actual) {
+    switch (expected) {
+    case ValueKind::Scalar:
+        return "Expected a scalar value, but got " + actual;
+    case ValueKind::List:
+        return "Expected a list, but got " + actual;
+    default:
+        return "Expected the name of a function, but got " + actual;
+    }
+}
+
+// Same wording as the runtime checks of the builtins
+std::string arityError(const std::string& name, size_t argc) {
+    static const char* const words[] = {"no", "one", "two", "three"};
+    if (argc == 0) return name + " takes no arguments";
+    std::string count = argc < 4 ? std::string(words[argc]) : std::to_string(argc);
+    return name + " requires exactly " + count + (argc == 1 ? " argument" : " arguments");
+}
+
+std::string arityError(const std::string& name, const BuiltinType& type) {
+    static const char* const words[] = {"no", "one", "two", "three"};
+    size_t most = type.parameters.size();
+    if (type.optional == 0) return arityError(name, most);
+    return name + " requires " + words[most - type.optional] + " or " + words[most] + " arguments";
+}
+
+bool takes(const BuiltinType& type, size_t argc) {
+    return type.variadic || (argc <= type.parameters.size() && argc + type.optional >= type.parameters.size());
+}
+
+const char* kindName(ValueKind kind) {
+    switch (kind) {
+    case ValueKind::Unknown: return "none";
+    case ValueKind::Scalar: return "scalar";
+    case ValueKind::List: return "list";
+    case ValueKind::Function: return "function";
+    case ValueKind::Any: return "any";
+    }
+    return "any";
+}
+
+std::string formatSignature(const std::vector<ValueKind>& parameters, ValueKind result, bool variadic,
+                            size_t optional = 0) {
+    std::string text = "(";
+    for (size_t i = 0; i < parameters.size(); ++i) {
+        if (i > 0) text += ", ";
+        text += kindName(parameters[i]);
+        if (i + optional >= parameters.size()) text += "?";
+    }
+    if (variadic) text += "...";
+    return text + ") -> " + kindName(result);
+}
+
+} // namespace
+
+struct ThisFuncInterpreter::Inference {
+    Function* function; // Whose body is inferred; null for an expression, which has no arguments
+    bool report;        // Throw on the first mismatch instead of noting it
+    bool failed = false;
+    bool narrowed = false; // A parameter of function got narrower
+
+    ValueKind fail(const std::string& message) {
+        if (report) throw std::runtime_error(message);
+        failed = true;
+        return ValueKind::Any;
+    }
+
+    ValueKind expect(ValueKind actual, ValueKind expected, const Node& node) {
+        return fits(actual, expected) ? actual : fail(mismatch(expected, describe(actual, &node)));
+    }
+};
+
+// What node evaluates to where a value of kind expected is needed. Calls of
+// the function being inferred see its signature so far.
+ValueKind ThisFuncInterpreter::infer(const Node& node, ValueKind expected, Inference& inference) const {
+    switch (node.kind) {
+    case Node::Kind::Number:
+        return inference.expect(ValueKind::Scalar, expected, node);
+
+    case Node::Kind::Placeholder: {
+        if (!inference.function || node.index >= inference.function->parameters.size()) {
+            return inference.fail("Missing argument #" + std::to_string(node.index));
+        }
+        ValueKind& parameter = inference.function->parameters[node.index];
+        if (parameter == ValueKind::Any && expected != ValueKind::Any) {
+            parameter = expected;
+            inference.narrowed = true;
+        } else if (!fits(parameter, expected)) {
+            return inference.fail("Argument #" + std::to_string(node.index) + " is used both as "
+                                  + describe(parameter) + " and as " + describe(expected));
+        }
+        return parameter;
+    }
+
+    case Node::Kind::Name: {
+        const Function& target = inference.function && node.symbol == inference.function->symbol
+            ? *inference.function : functions[node.symbol];
+        if (target.isList) return inference.expect(ValueKind::List, expected, node);
+        if (!target.defined()) {
+            // Function bodies may name functions declared after them
+            return inference.function ? ValueKind::Any : inference.fail("Unknown function: " + node.name);
+        }
+        return inference.expect(ValueKind::Function, expected, node);
+    }
+
+    case Node::Kind::Call:
+        break;
+    }
+    return inferCall(node, expected, inference);
+}
+
+// Checks the calls the same way the engines would, in the same order:
+// if and nand check their arity before evaluating anything, the other
+// builtins after evaluating their arguments
+ValueKind ThisFuncInterpreter::inferCall(const Node& node, ValueKind expected, Inference& inference) const {
+    const std::string& name = node.name;
+
+    // Parameters only narrow where they are always evaluated: to what both
+    // branches of if use them as, and not at all in the second operand of
+    // nand, which only runs when the first is not 0
+    std::vector<ValueKind>* parameters = inference.function ? &inference.function->parameters : nullptr;
+    if (node.symbol == ifSymbol) {
+        if (node.args.size() != 3) return inference.fail(arityError(name, 3));
+        infer(*node.args[0], ValueKind::Scalar, inference);
+        if (!parameters) {
+            ValueKind chosen = infer(*node.args[1], expected, inference);
+            return join(chosen, infer(*node.args[2], expected, inference));
+        }
+        std::vector<ValueKind> before = *parameters;
+        bool narrowed = inference.narrowed;
+        ValueKind chosen = infer(*node.args[1], expected, inference);
+        std::vector<ValueKind> first = *parameters;
+        *parameters = before;
+        ValueKind other = infer(*node.args[2], expected, inference);
+        for (size_t i = 0; i < parameters->size(); ++i) {
+            if ((*parameters)[i] != first[i]) (*parameters)[i] = before[i];
+        }
+        inference.narrowed = narrowed || *parameters != before;
+        return join(chosen, other);
+    }
+    if (node.symbol == nandSymbol) {
+        if (node.args.size() != 2) return inference.fail(arityError(name, 2));
+        infer(*node.args[0], ValueKind::Scalar, inference);
+        if (!parameters) {
+            infer(*node.args[1], ValueKind::Scalar, inference);
+        } else {
+            std::vector<ValueKind> before = *parameters;
+            bool narrowed = inference.narrowed;
+            infer(*node.args[1], ValueKind::Scalar, inference);
+            *parameters = before;
+            inference.narrowed = narrowed;
+        }
+        return inference.expect(ValueKind::Scalar, expected, node);
+    }
+    if (node.symbol < builtinCount) {
+        const BuiltinType& type = builtinTypes.at(name);
+        if (type.parameters[0] == ValueKind::Function) {
+            // map, filter and reduce: placeholders learn what they are used
+            // as; anything else is checked after all the arguments, where the
+            // builtin looks at them
+            std::vector<ValueKind> kinds;
+            for (size_t i = 0; i < node.args.size(); ++i) {
+                bool placeholder = node.args[i]->kind == Node::Kind::Placeholder && i < type.parameters.size();
+                kinds.push_back(infer(*node.args[i], placeholder ? type.parameters[i] : ValueKind::Any, inference));
+            }
+            if (!takes(type, node.args.size())) return inference.fail(arityError(name, type));
+            checkFunctionArgument(node, kinds[0], inference, node.symbol == reduceSymbol ? 2 : 1);
+            for (size_t i = 1; i < kinds.size(); ++i) {
+                inference.expect(kinds[i], type.parameters[i], *node.args[i]);
+            }
+            return inference.expect(type.result, expected, node);
+        }
+        for (size_t i = 0; i < node.args.size(); ++i) {
+            ValueKind parameter = type.variadic ? type.parameters[0]
+                : i < type.parameters.size() ? type.parameters[i] : ValueKind::Any;
+            infer(*node.args[i], parameter, inference);
+        }
+        if (!takes(type, node.args.size())) return inference.fail(arityError(name, type));
+        return inference.expect(type.result, expected, node);
+    }
+
+    const Function& callee = inference.function && node.symbol == inference.function->symbol
+        ? *inference.function : functions[node.symbol];
+    if (!callee.defined()) {
+        if (!inference.function) return inference.fail("Unknown function: " + name);
+        for (const auto& arg : node.args) {
+            infer(*arg, ValueKind::Any, inference);
+        }
+        return ValueKind::Any;
+    }
+    bool known = callee.checked && !callee.isList;
+    for (size_t i = 0; i < node.args.size(); ++i) {
+        infer(*node.args[i], known && i < callee.argCount ? callee.parameters[i] : ValueKind::Any, inference);
+    }
+    if (node.args.size() != callee.argCount) return inference.fail(arityError(name, callee.argCount));
+    if (callee.isList) return inference.expect(ValueKind::List, expected, node);
+    return known ? inference.expect(callee.result, expected, node) : ValueKind::Any;
+}
+
+// The first argument of map/filter is called with each element, that of
+// reduce with the result so far and an element; the result is used as a number
+void ThisFuncInterpreter::checkFunctionArgument(const Node& call, ValueKind kind, Inference& inference,
+                                                size_t arity) const {
+    const std::string wanted = arity == 1 ? "single-argument" : "two-argument";
+    if (kind == ValueKind::Scalar || kind == ValueKind::List) {
+        inference.fail("The first argument of " + call.name + " must be the name of a " + wanted + " function");
+        return;
+    }
+    const Node& argument = *call.args[0];
+    if (argument.kind != Node::Kind::Name) return; // Only known when it runs
+    const Function& target = inference.function && argument.symbol == inference.function->symbol
+        ? *inference.function : functions[argument.symbol];
+    if (!target.defined()) return;
+    if (arity == 1 ? !target.singleArgument : target.argCount != 2) {
+        inference.fail("The first argument of " + call.name + " must be a " + wanted + " function");
+        return;
+    }
+
+    std::vector<ValueKind> parameters(arity, ValueKind::Any);
+    ValueKind result = ValueKind::Any;
+    if (argument.symbol < builtinCount) {
+        const BuiltinType& type = builtinTypes.at(target.name);
+        if (!takes(type, arity)) {
+            inference.fail(arityError(target.name, type));
+            return;
+        }
+        for (size_t i = 0; i < arity; ++i) {
+            parameters[i] = type.parameters[type.variadic ? 0 : i];
+        }
+        result = type.result;
+    } else if (target.checked) {
+        if (target.argCount == arity) parameters = target.parameters;
+        result = target.result;
+    }
+    for (ValueKind parameter : parameters) {
+        if (!fits(ValueKind::Scalar, parameter)) {
+            inference.fail(mismatch(parameter, describe(ValueKind::Scalar)));
+            return;
+        }
+    }
+    if (!fits(result, ValueKind::Scalar)) {
+        inference.fail(mismatch(ValueKind::Scalar, describe(result)));
+    }
+}
+
+// Infers the signatures of functions that may call each other. Those that
+// still mismatch their callees once the group settled are marked unchecked,
+// or with report, the first mismatch is thrown.
+void ThisFuncInterpreter::inferSignatures(const std::vector<Function*>& group, bool report) {
+    for (Function* function : group) {
+        function->checked = true;
+        function->parameters.assign(function->argCount, ValueKind::Any);
+        function->result = ValueKind::Unknown;
+    }
+
+    while (true) {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (Function* function : group) {
+                if (!function->checked) continue;
+                Inference inference{function, false};
+                infer(*function->source, ValueKind::Any, inference);
+                changed = changed || inference.narrowed;
+            }
+        }
+
+        changed = true;
+        while (changed) {
+            changed = false;
+            for (Function* function : group) {
+                if (!function->checked) continue;
+                Inference inference{function, false};
+                ValueKind result = join(function->result, infer(*function->source, ValueKind::Any, inference));
+                if (result != function->result) {
+                    function->result = result;
+                    changed = true;
+                }
+            }
+        }
+
+        // Unchecked functions answer Any to their callers, which can only
+        // widen results, so this ends once no more functions fail
+        bool failed = false;
+        for (Function* function : group) {
+            if (!function->checked) continue;
+            Inference inference{function, report};
+            infer(*function->source, ValueKind::Any, inference);
+            if (inference.failed) {
+                function->checked = false;
+                function->parameters.assign(function->argCount, ValueKind::Any);
+                function->result = ValueKind::Any;
+                failed = true;
+            }
+        }
+        if (!failed) return;
+    }
+}
+
+void ThisFuncInterpreter::inferSignatures(const std::vector<size_t>& symbols) {
+    std::vector<Function*> group;
+    for (size_t symbol : symbols) {
+        if (functions[symbol].source) group.push_back(&functions.edit(symbol));
+    }
+    inferSignatures(group, false);
+}
+
+// Throws the first mismatch of an expression about to be evaluated
+void ThisFuncInterpreter::checkExpression(const Node& node) const {
+    Inference inference{nullptr, true};
+    infer(node, ValueKind::Any, inference);
+}
+
+// Whether node has the shape of every tree that got past the checker when
+// it was declared: names without arguments, builtins called with as many
+// arguments as they take. Trees decoded from a compiled image are held to
+// it before the optimizer and the compilers see them.
+bool ThisFuncInterpreter::wellFormed(const Node& node) const {
+    if (node.kind == Node::Kind::Name) return node.args.empty();
+    if (node.kind != Node::Kind::Call) return true;
+    for (const auto& arg : node.args) {
+        if (!wellFormed(*arg)) return false;
+    }
+    return node.symbol >= builtinCount || takes(builtinTypes.at(node.name), node.args.size());
+}
+
+// Whether node only computes with numbers: the scalar builtins, if, nand and
+// scalar functions, each called with exactly the arguments it takes
+bool ThisFuncInterpreter::scalarBody(const Node& node, const Function& function) const {
+    switch (node.kind) {
+    case Node::Kind::Number:
+        return true;
+    case Node::Kind::Placeholder:
+        return node.index < function.argCount;
+    case Node::Kind::Name:
+        return false;
+    case Node::Kind::Call:
+        break;
+    }
+
+    for (const auto& arg : node.args) {
+        if (!scalarBody(*arg, function)) return false;
+    }
+    if (node.symbol == ifSymbol) return node.args.size() == 3;
+    if (node.symbol == nandSymbol) return node.args.size() == 2;
+    const Function& callee = functions[node.symbol];
+    if (node.symbol < builtinCount) {
+        return callee.opcode != OpCode::Return && takes(builtinTypes.at(node.name), node.args.size());
+    }
+    return callee.scalar && node.args.size() == callee.argCount;
+}
+
+// Marks the checked functions returning numbers whose bodies only compute
+// with numbers, assuming it of each other first and dropping those that
+// call a function that turned out not to be
+void ThisFuncInterpreter::settleScalar(const std::vector<size_t>& symbols) {
+    for (size_t symbol : symbols) {
+        Function& function = functions.edit(symbol);
+        // Any: the function returns a parameter as is, which is a number
+        // whenever the arguments are
+        function.scalar = function.checked && function.body && !function.memo
+            && (function.result == ValueKind::Scalar || function.result == ValueKind::Any);
+    }
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t symbol : symbols) {
+            Function& function = functions.edit(symbol);
+            if (function.scalar && !scalarBody(*function.body, function)) {
+                function.scalar = false;
+                changed = true;
+            }
+        }
+    }
+}
+
+// Inferred signature of a function, e.g. "(scalar, list) -> scalar"
+std::string ThisFuncInterpreter::signature(const std::string& name) {
+    const Function* function = findFunction(name);
+    if (!function) {
+        throw std::runtime_error("Unknown function: " + name);
+    }
+    if (function->isList) return "list";
+    if (function->symbol < builtinCount) {
+        const BuiltinType& type = builtinTypes.at(name);
+        return formatSignature(type.parameters, type.result, type.variadic, type.optional);
+    }
+    size_t symbol = function->symbol;
+    materialize(symbol); // Decoding rebuilds the entry
+    return formatSignature(functions[symbol].parameters, functions[symbol].result, false);
+}
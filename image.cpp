@@ -0,0 +1,371 @@
+#include "interpreter.h"
+#include <cstring>
+
+// Binary image of the declared functions, written to and read back from the
+// compiled script cache (--cache). It holds the symbol table, the parsed
+// bodies and the elements of declared lists, so loading it skips parsing the
+// script and evaluating its lists. Everything the table derives from a
+// parsed body (signature, optimized body, bytecode, native code) is rebuilt
+// from it when the function is decoded rather than trusted from the image.
+// Numbers are stored in host byte order; the cache is not meant to move
+// between machines.
+//
+// Loading only reads what the function table needs up front (names, callees
+// and lists). The text and tree of each function stay in the image until
+// something reaches the function: evaluate, declarations and the optimizer
+// decode what they can reach first (materialize), so a large library costs
+// little more to load than the functions a run actually uses.
+
+namespace {
+
+// Bump whenever the layout below or the parser's trees change, so older
+// images are rebuilt
+constexpr uint32_t imageVersion = 4;
+
+enum class SlotKind : uint8_t {
+    Undefined, // Name only referenced so far
+    Function,
+    List
+};
+
+class ImageWriter {
+public:
+    std::string bytes;
+
+    template <typename T>
+    void put(T value) {
+        bytes.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void putString(const std::string& text) {
+        put(static_cast<uint32_t>(text.size()));
+        bytes.append(text);
+    }
+
+    void putNode(const Node& node) {
+        put(static_cast<uint8_t>(node.kind));
+        switch (node.kind) {
+        case Node::Kind::Number:
+            put(node.number);
+            break;
+        case Node::Kind::Placeholder:
+            put(static_cast<uint32_t>(node.index));
+            break;
+        case Node::Kind::Call:
+        case Node::Kind::Name:
+            put(static_cast<uint32_t>(node.symbol));
+            put(static_cast<uint32_t>(node.args.size()));
+            for (const auto& arg : node.args) {
+                putNode(*arg);
+            }
+            break;
+        }
+    }
+
+};
+
+// Reads an image back. Every read is bounds-checked and symbols are checked
+// against the table, so a truncated image or one with bad offsets fails with
+// an error instead of reading past its end; what the bytes decode to is
+// checked by the loader. The script cache also checksums the image, since a
+// damaged number or symbol can still decode to a valid tree.
+class ImageReader {
+public:
+    explicit ImageReader(std::string_view bytes) : bytes(bytes) {}
+
+    bool atEnd() const { return position == bytes.size(); }
+    size_t remaining() const { return bytes.size() - position; }
+
+    template <typename T>
+    T get() {
+        T value;
+        std::memcpy(&value, take(sizeof(value)), sizeof(value));
+        return value;
+    }
+
+    std::string_view getBytes(size_t count) {
+        return std::string_view(take(count), count);
+    }
+
+    std::string getString() {
+        return std::string(getBytes(get<uint32_t>()));
+    }
+
+    size_t getSymbol(size_t symbolCount) {
+        uint32_t symbol = get<uint32_t>();
+        if (symbol >= symbolCount) fail();
+        return symbol;
+    }
+
+    // nameOf(symbol) gives the name of each of the symbolCount symbols
+    template <typename NameOf>
+    NodePtr getNode(const NameOf& nameOf, size_t symbolCount) {
+        auto node = std::make_shared<Node>();
+        uint8_t kind = get<uint8_t>();
+        if (kind > static_cast<uint8_t>(Node::Kind::Name)) fail();
+        node->kind = static_cast<Node::Kind>(kind);
+        switch (node->kind) {
+        case Node::Kind::Number:
+            node->number = get<double>();
+            break;
+        case Node::Kind::Placeholder:
+            node->index = get<uint32_t>();
+            break;
+        case Node::Kind::Call:
+        case Node::Kind::Name: {
+            node->symbol = getSymbol(symbolCount);
+            node->name = nameOf(node->symbol);
+            uint32_t argCount = get<uint32_t>();
+            if (node->kind == Node::Kind::Name && argCount != 0) fail();
+            node->args.reserve(std::min<size_t>(argCount, remaining()));
+            for (uint32_t i = 0; i < argCount; ++i) {
+                node->args.push_back(getNode(nameOf, symbolCount));
+            }
+            break;
+        }
+        }
+        return node;
+    }
+
+
+    [[noreturn]] static void fail() {
+        throw std::runtime_error("Corrupt compiled image");
+    }
+
+private:
+    std::string_view bytes;
+    size_t position = 0;
+
+    const char* take(size_t count) {
+        if (count > remaining()) fail();
+        const char* data = bytes.data() + position;
+        position += count;
+        return data;
+    }
+};
+
+} // namespace
+
+// Layout: version, builtin count, symbol count, the names of the user
+// symbols, a record per user symbol, then the details of every function
+// (text and parsed tree), which the records point into.
+// Keeping the records together means loading touches little of a large image.
+std::string ThisFuncInterpreter::saveImage() const {
+    ImageWriter writer;
+    writer.put(imageVersion);
+    writer.put(static_cast<uint32_t>(builtinCount));
+    writer.put(static_cast<uint32_t>(functions.size()));
+    for (size_t symbol = builtinCount; symbol < functions.size(); ++symbol) {
+        writer.putString(functions[symbol].name);
+    }
+
+    ImageWriter details;
+    for (size_t symbol = builtinCount; symbol < functions.size(); ++symbol) {
+        const Function& function = functions[symbol];
+        if (function.isList) {
+            writer.put(SlotKind::List);
+            writer.putString(function.expression);
+            const List& elements = function.value.list();
+            writer.put(static_cast<uint64_t>(elements.size()));
+            for (double element : elements) {
+                writer.put(element);
+            }
+        } else if (function.source || !function.details.empty()) {
+            writer.put(SlotKind::Function);
+            writer.put(static_cast<uint32_t>(function.argCount));
+            writer.put(static_cast<uint8_t>(function.memo != nullptr));
+            writer.put(static_cast<uint32_t>(function.callees.size()));
+            for (size_t callee : function.callees) {
+                writer.put(static_cast<uint32_t>(callee));
+            }
+
+            writer.put(static_cast<uint64_t>(details.bytes.size()));
+            if (!function.details.empty()) {
+                details.bytes.append(function.details); // Still undecoded, copied as is
+            } else {
+                details.putString(function.expression);
+                details.putNode(*function.source);
+            }
+            writer.put(static_cast<uint64_t>(details.bytes.size()));
+        } else {
+            writer.put(SlotKind::Undefined);
+        }
+    }
+
+    writer.bytes.append(details.bytes);
+    return std::move(writer.bytes);
+}
+
+void ThisFuncInterpreter::loadImage(std::string_view image, std::shared_ptr<const void> owner) {
+    if (functions.size() != builtinCount) {
+        throw std::logic_error("A compiled image can only be loaded before any declaration");
+    }
+    if (!owner) {
+        auto copy = std::make_shared<const std::string>(image);
+        image = *copy;
+        owner = std::move(copy);
+    }
+
+    // The image is read and checked before the table changes, so a bad image
+    // leaves the interpreter as it was
+    ImageReader reader(image);
+    if (reader.get<uint32_t>() != imageVersion || reader.get<uint32_t>() != builtinCount) {
+        throw std::runtime_error("Compiled image is from another version of the interpreter");
+    }
+    uint32_t symbolCount = reader.get<uint32_t>();
+    if (symbolCount < builtinCount) ImageReader::fail();
+
+    struct Slot {
+        std::string_view name;
+        SlotKind kind;
+        uint32_t argCount;
+        bool memoized;
+        std::string_view callees;    // uint32_t symbols
+        std::string_view expression; // List
+        std::string_view elements;   // List, doubles
+        uint64_t detailsBegin;       // Function, offsets into the details
+        uint64_t detailsEnd;
+    };
+    std::vector<Slot> slots(symbolCount - builtinCount);
+    std::unordered_set<std::string_view> seen;
+    seen.reserve(slots.size());
+    for (auto& slot : slots) {
+        slot.name = reader.getBytes(reader.get<uint32_t>());
+        if (symbols.count(std::string(slot.name)) || !seen.insert(slot.name).second) ImageReader::fail();
+    }
+
+    for (auto& slot : slots) {
+        slot.kind = reader.get<SlotKind>();
+        if (slot.kind == SlotKind::List) {
+            slot.expression = reader.getBytes(reader.get<uint32_t>());
+            uint64_t length = reader.get<uint64_t>();
+            if (length > image.size() / sizeof(double)) ImageReader::fail();
+            slot.elements = reader.getBytes(length * sizeof(double));
+        } else if (slot.kind == SlotKind::Function) {
+            slot.argCount = reader.get<uint32_t>();
+            slot.memoized = reader.get<uint8_t>() != 0;
+            // Each argument needs a placeholder in the tree
+            if (slot.argCount > image.size()) ImageReader::fail();
+            uint32_t calleeCount = reader.get<uint32_t>();
+            if (calleeCount > image.size() / sizeof(uint32_t)) ImageReader::fail();
+            slot.callees = reader.getBytes(calleeCount * sizeof(uint32_t));
+            for (uint32_t i = 0; i < calleeCount; ++i) {
+                uint32_t callee;
+                std::memcpy(&callee, slot.callees.data() + i * sizeof(callee), sizeof(callee));
+                if (callee >= symbolCount) ImageReader::fail();
+            }
+            slot.detailsBegin = reader.get<uint64_t>();
+            slot.detailsEnd = reader.get<uint64_t>();
+            if (slot.detailsBegin >= slot.detailsEnd) ImageReader::fail();
+        } else if (slot.kind != SlotKind::Undefined) {
+            ImageReader::fail();
+        }
+    }
+    std::string_view details = reader.getBytes(reader.remaining());
+    for (const auto& slot : slots) {
+        if (slot.kind == SlotKind::Function && slot.detailsEnd > details.size()) ImageReader::fail();
+    }
+
+    symbols.reserve(symbolCount);
+    for (const auto& slot : slots) {
+        size_t symbol = intern(std::string(slot.name));
+        Function& function = functions.edit(symbol);
+        if (slot.kind == SlotKind::List) {
+            function.isList = true;
+            function.argCount = 0;
+            function.expression = std::string(slot.expression);
+            std::vector<double> elements(slot.elements.size() / sizeof(double));
+            std::memcpy(elements.data(), slot.elements.data(), slot.elements.size());
+            function.value = Value(List(std::move(elements)));
+            function.implementation = [symbol](ThisFuncInterpreter& self, Arguments) {
+                return self.functions[symbol].value;
+            };
+        } else if (slot.kind == SlotKind::Function) {
+            // Saved again as is while the function is undecoded; decoding
+            // checks it against the tree
+            function.argCount = slot.argCount;
+            function.singleArgument = slot.argCount <= 1;
+            if (slot.memoized) {
+                function.memo = std::make_shared<MemoCache>(memoCapacity);
+            }
+            function.callees.resize(slot.callees.size() / sizeof(uint32_t));
+            for (size_t i = 0; i < function.callees.size(); ++i) {
+                uint32_t callee;
+                std::memcpy(&callee, slot.callees.data() + i * sizeof(callee), sizeof(callee));
+                function.callees[i] = callee;
+            }
+            function.details = details.substr(slot.detailsBegin, slot.detailsEnd - slot.detailsBegin);
+        }
+    }
+    for (size_t caller = builtinCount; caller < functions.size(); ++caller) {
+        for (size_t callee : functions[caller].callees) {
+            if (callee >= builtinCount) functions.edit(callee).callers.push_back(caller);
+        }
+    }
+    imageOwner = std::move(owner);
+}
+
+// Decodes the functions reachable from symbol that are still in the image
+// and rebuilds them as declaring them would have. All of them are decoded
+// and checked before any is updated, so a damaged image fails without
+// leaving a decoded function with undecoded callees.
+void ThisFuncInterpreter::materialize(size_t symbol) {
+    if (functions[symbol].details.empty()) return;
+
+    struct Decoded {
+        size_t symbol;
+        std::string expression;
+        NodePtr source;
+    };
+    std::vector<Decoded> decoded;
+    std::unordered_set<size_t> visited = {symbol};
+    std::vector<size_t> pending = {symbol};
+    auto nameOf = [this](size_t callee) -> const std::string& { return functions[callee].name; };
+
+    while (!pending.empty()) {
+        const Function& function = functions[pending.back()];
+        pending.pop_back();
+        for (size_t callee : function.callees) {
+            if (!functions[callee].details.empty() && visited.insert(callee).second) {
+                pending.push_back(callee);
+            }
+        }
+
+        ImageReader reader(function.details);
+        Decoded result{function.symbol, reader.getString(), reader.getNode(nameOf, functions.size())};
+        if (!reader.atEnd() || !wellFormed(*result.source)) ImageReader::fail();
+
+        // The argument count and callees were loaded from the record; they
+        // have to be the ones the tree has
+        std::vector<size_t> placeholders;
+        collectPlaceholders(*result.source, placeholders);
+        size_t argCount = placeholders.empty() ? 0 : *std::max_element(placeholders.begin(), placeholders.end()) + 1;
+        std::vector<size_t> callees;
+        collectSymbols(*result.source, callees);
+        std::sort(callees.begin(), callees.end());
+        callees.erase(std::unique(callees.begin(), callees.end()), callees.end());
+        if (argCount != function.argCount || callees != function.callees) ImageReader::fail();
+        decoded.push_back(std::move(result));
+    }
+
+    std::vector<size_t> symbols;
+    for (auto& result : decoded) {
+        Function& function = functions.edit(result.symbol);
+        function.expression = std::move(result.expression);
+        function.source = std::move(result.source);
+        function.body = function.source;
+        function.details = {};
+        symbols.push_back(result.symbol);
+    }
+    rebuildFunctions(symbols);
+}
+
+// Decodes everything a tree refers to, before it is evaluated or optimized
+void ThisFuncInterpreter::materialize(const Node& node) {
+    if (imageOwner == nullptr) return;
+    std::vector<size_t> referenced;
+    collectSymbols(node, referenced);
+    for (size_t symbol : referenced) {
+        materialize(symbol);
+    }
+}
@@ -1,352 +1,1385 @@
 #include "interpreter.h"
+#include <atomic>
+
+thread_local size_t ThisFuncInterpreter::callDepth = 0;
+thread_local const char* ThisFuncInterpreter::nativeStackBase = nullptr;
+thread_local size_t ThisFuncInterpreter::nativeGaveUpAt = SIZE_MAX;
+thread_local FrameArena ThisFuncInterpreter::frameArena;
+
+namespace {
+
+// Arguments copied out of their values, for the unboxed paths
+class Unboxed {
+public:
+    // False when one of the first count values is not a number
+    bool assign(const Value* values, size_t count) {
+        if (count > 8) {
+            more.resize(count);
+            numbers = more.data();
+        }
+        for (size_t i = 0; i < count; ++i) {
+            if (!values[i].isNumber()) return false;
+            numbers[i] = values[i].number();
+        }
+        return true;
+    }
+    const double* data() const { return numbers; }
+
+private:
+    double fixed[8];
+    std::vector<double> more;
+    double* numbers = fixed;
+};
+
+// What the tree walker would have recursed for: the evaluation of a node, and
+// of the user functions that its tail calls enter in its place
+struct Activation {
+    const Node* node;
+    Arguments frame;
+    FrameArena::Mark mark;     // Top of the arena when the activation started
+    Value* ownFrame = nullptr; // Arguments of the user function entered by a tail call
+    Value* args = nullptr;     // Arguments of node, a call, as they are evaluated
+    MemoCache* memo = nullptr; // Receives the result when the activation is a memoized call
+    size_t next = 0;           // Operands of node evaluated so far
+    bool entered = false;      // Counted as a user call, which is left when it returns
+    bool calling = false;      // Waits for what the call of node, run above it, returns
+};
+
+// Activations of the tree walkers on this thread. A builtin calling back into
+// evaluateNode starts above those of the evaluation that called it.
+thread_local std::vector<Activation> activations;
+
+// Drops the activations an evaluation leaves when it throws
+class Unwind {
+public:
+    explicit Unwind(std::vector<Activation>& stack) : stack(stack), base(stack.size()) {}
+    ~Unwind() { stack.erase(stack.begin() + base, stack.end()); }
+    Unwind(const Unwind&) = delete;
+    Unwind& operator=(const Unwind&) = delete;
+
+private:
+    std::vector<Activation>& stack;
+    size_t base;
+};
+
+// Activation of evaluateScalar, whose operands wait on its number stack
+struct ScalarActivation {
+    const Node* node;
+    size_t args;   // Index of the first argument of the running function on the number stack
+    size_t base;   // Size of the number stack when the activation started
+    size_t own;    // Index of the arguments of the function it entered, once it replaces
+    size_t next;   // Operands of node evaluated so far
+    bool entered;  // Counted as a user call, which is left when it returns
+    bool replaces; // A user call reached here replaces the running function
+};
+
+// The builtins of scalar code; b is 0 for those that take one argument
+inline double applyScalar(OpCode opcode, double a, double b) {
+    switch (opcode) {
+    case OpCode::Add: return a + b;
+    case OpCode::Sub: return a - b;
+    case OpCode::Mul: return a * b;
+    case OpCode::Div:
+        if (b == 0) throw std::runtime_error("Division by zero");
+        return a / b;
+    case OpCode::Pow: return std::pow(a, b);
+    case OpCode::Sqrt:
+        if (a < 0) throw std::runtime_error("sqrt requires a non-negative argument");
+        return std::sqrt(a);
+    case OpCode::Sin: return std::sin(a);
+    case OpCode::Cos: return std::cos(a);
+    case OpCode::Eq: return a == b ? 1.0 : 0.0;
+    default: return a <= b ? 1.0 : 0.0; // Le
+    }
+}
+
+// Number of a leaf of scalar code, whose arguments are at frame; false for calls
+inline bool leafNumber(const Node& node, const double* frame, double& number) {
+    if (node.kind == Node::Kind::Number) {
+        number = node.number;
+        return true;
+    }
+    if (node.kind == Node::Kind::Placeholder) {
+        number = frame[node.index];
+        return true;
+    }
+    return false;
+}
+
+// Stacks of evaluateScalar, kept like those of runScalar (vm.cpp); scalar
+// code never calls back into the engines, so only one evaluation uses them
+thread_local std::vector<double> scalarNumbers;
+thread_local std::vector<ScalarActivation> scalarActivations;
+
+} // namespace
+
+size_t ThisFuncInterpreter::intern(const std::string& name) {
+        auto it = symbols.find(name);
+        if (it != symbols.end()) return it->second;
+
+        size_t symbol = functions.size();
+        Function function;
+        function.name = name;
+        function.symbol = symbol;
+        functions.push_back(std::move(function));
+        symbols.emplace(name, symbol);
+        return symbol;
+    }
 
-ThisFuncInterpreter::Function* ThisFuncInterpreter::findFunction(const std::string& name) {
-        auto it = functions.find(name);
-        return it != functions.end() ? &it->second : nullptr;
+    void ThisFuncInterpreter::resolveSymbols(Node& node) {
+        if (node.kind == Node::Kind::Call || node.kind == Node::Kind::Name) {
+            node.symbol = intern(node.name);
+        }
+        for (auto& arg : node.args) {
+            resolveSymbols(*arg);
+        }
     }
 
-    bool ThisFuncInterpreter::isSingleArgumentFunction(const std::string& functionName) {
-        Function* function = findFunction(functionName);
-        if (!function) {
-            throw std::runtime_error("Unknown function: " + functionName);
+    // Binds names without interning new ones, for a table that must not
+    // change; a name it has never seen cannot be declared in it
+    void ThisFuncInterpreter::lookupSymbols(Node& node) const {
+        if (node.kind == Node::Kind::Call || node.kind == Node::Kind::Name) {
+            auto it = symbols.find(node.name);
+            if (it == symbols.end()) throw std::runtime_error("Unknown function: " + node.name);
+            node.symbol = it->second;
+        }
+        for (auto& arg : node.args) {
+            lookupSymbols(*arg);
         }
+    }
 
-        // Extract placeholders from the function's expression
-        std::vector<int> placeholders = extractPlaceholders(function->expression);
+    // Sets parallelArgs on the calls with at least two arguments that call a
+    // user function or a fold over a list, except the lazy if and nand. Returns
+    // whether node makes such a call itself. Memoized functions do not count:
+    // siblings running at once would miss each other's cached results.
+    bool ThisFuncInterpreter::markParallelCalls(Node& node) const {
+        if (node.kind != Node::Kind::Call) return false;
+        size_t expensiveArgs = 0;
+        for (auto& arg : node.args) {
+            if (markParallelCalls(*arg)) ++expensiveArgs;
+        }
+        node.parallelArgs = expensiveArgs >= 2 && node.symbol != ifSymbol && node.symbol != nandSymbol;
 
-        // Ensure all placeholders refer to the same index
-        if (!placeholders.empty()) {
-            int firstPlaceholder = placeholders[0];
-            for (int placeholder : placeholders) {
-                if (placeholder != firstPlaceholder) {
-                    return false; // Mixed placeholders (e.g., #0 and #1) found
+        const Function& function = functions[node.symbol];
+        bool expensive = node.symbol >= builtinCount ? !function.memo && !function.isList
+                                                     : node.symbol == reduceSymbol || node.symbol == sumSymbol;
+        return expensive || expensiveArgs > 0;
+    }
+
+    const ThisFuncInterpreter::Function* ThisFuncInterpreter::findFunction(const std::string& name) const {
+        auto it = symbols.find(name);
+        if (it == symbols.end() || !functions[it->second].defined()) return nullptr;
+        return &functions[it->second];
+    }
+
+    // Resolves the function reference passed to map/filter, or to reduce,
+    // which calls it with two arguments
+    const ThisFuncInterpreter::Function& ThisFuncInterpreter::functionArgument(const Value& value, const std::string& builtin,
+                                                                         size_t arity) {
+        const char* kind = arity == 1 ? "single-argument" : "two-argument";
+        if (!value.isFunction()) {
+            throw std::runtime_error("The first argument of " + builtin + " must be the name of a " + kind + " function");
+        }
+        const Function& function = functions[value.symbol()];
+        if (!function.defined()) {
+            throw std::runtime_error("Unknown function: " + function.name);
+        }
+        if (arity == 1 ? !function.singleArgument : function.argCount != 2) {
+            throw std::runtime_error("The first argument of " + builtin + " must be a " + kind + " function");
+        }
+        return function;
+    }
+
+    // Builds the bytecode and the map/filter kernel of a function when it is
+    // declared, so evaluation only ever reads the function table
+    void ThisFuncInterpreter::compileFunction(Function& function) {
+        if (function.body) {
+            function.code = compileChunk(*function.body, builtinCount, !profiler);
+            function.kernel = Kernel::compile(*function.body);
+            compileNative(function);
+        } else if (function.implementation && function.argCount == 1 && !function.isList) {
+            // Single-argument builtins, e.g. map(sqrt, ...)
+            Node call;
+            call.kind = Node::Kind::Call;
+            call.name = function.name;
+            call.args.push_back(std::make_shared<Node>());
+            call.args[0]->kind = Node::Kind::Placeholder;
+            function.kernel = Kernel::compile(call);
+        }
+    }
+
+    // Native code calls other functions through their slots, so callees
+    // only need native code by the time it runs; settleNative checks that.
+    // Memoized functions keep going through their cache instead.
+    void ThisFuncInterpreter::compileNative(Function& function) {
+        function.jit = nullptr;
+        if (!function.jitSlot || profiler || function.memo || !function.body) return;
+        function.jitArguments = jitArguments(*function.body);
+        function.jit = compileJit(*function.body, function.symbol, builtinCount,
+            [this](size_t callee, size_t argc) -> const JitEntry* {
+                const Function& target = functions[callee];
+                if (!target.body || target.memo || argc < jitArguments(*target.body)) return nullptr;
+                return target.jitSlot;
+            }, *jitArena);
+        *function.jitSlot = function.jit;
+    }
+
+    // Gives each of symbols a new slot before they are compiled, so they
+    // call each other's new code, while code compiled before, which other
+    // versions of a shared table may be running, keeps the slots it calls
+    void ThisFuncInterpreter::renewSlots(const std::vector<size_t>& symbols) {
+        for (size_t symbol : symbols) {
+            Function& function = functions.edit(symbol);
+            function.jit = nullptr;
+            function.jitSlot = jitArena ? jitArena->slot() : nullptr;
+        }
+    }
+
+    // Whether every user function that node calls, other than symbol itself,
+    // has native code that can take the arguments given
+    bool ThisFuncInterpreter::callsNativeOnly(const Node& node, size_t symbol) const {
+        if (node.kind == Node::Kind::Call && node.symbol >= builtinCount && node.symbol != symbol) {
+            const Function& callee = functions[node.symbol];
+            if (!callee.jit || node.args.size() < callee.jitArguments) return false;
+        }
+        for (const auto& arg : node.args) {
+            if (!callsNativeOnly(*arg, symbol)) return false;
+        }
+        return true;
+    }
+
+    // Functions compiled together may call each other before all of them
+    // were compiled; drops native code whose callees ended up without it
+    void ThisFuncInterpreter::settleNative(const std::vector<size_t>& symbols) {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t symbol : symbols) {
+                if (functions[symbol].jit && !callsNativeOnly(*functions[symbol].body, symbol)) {
+                    Function& function = functions.edit(symbol);
+                    function.jit = nullptr;
+                    *function.jitSlot = nullptr;
+                    changed = true;
                 }
             }
         }
-
-        return true; // All placeholders are consistent
     }
 
+    // Memoized functions keep going through their cache so its counters stay
+    // exact, and so do profiled calls
+    const Kernel* ThisFuncInterpreter::kernelFor(const Function& function) const {
+        return function.memo || profiler ? nullptr : function.kernel.get();
+    }
 
     double ThisFuncInterpreter::toDouble(const Value& value) const {
-        if (std::holds_alternative<double>(value)) {
-            return std::get<double>(value);
+        if (value.isNumber()) {
+            return value.number();
+        }
+        if (value.isFunction()) {
+            throw std::runtime_error("Expected a scalar value, but got the function " + functions[value.symbol()].name);
         }
         throw std::runtime_error("Expected a scalar value, but got a list");
     }
 
-    const std::vector<double>& ThisFuncInterpreter::toList(const Value& value) const {
-        if (std::holds_alternative<std::vector<double>>(value)) {
-            return std::get<std::vector<double>>(value);
+    // Elements of a list that is not lazy; lazy ones are read through pipeline.cpp
+    const List& ThisFuncInterpreter::toList(const Value& value) const {
+        if (value.isList()) {
+            return value.list();
         }
         throw std::runtime_error("Expected a list, but got a scalar value");
     }
 
     ThisFuncInterpreter::ThisFuncInterpreter() {
-        functions["add"] = {[](const std::vector<Value>& args) {
+        functions.edit(intern("add")) = {[](ThisFuncInterpreter& self, Arguments args) {
             if (args.size() != 2) throw std::runtime_error("add requires exactly two arguments");
-            return Value(std::get<double>(args[0]) + std::get<double>(args[1]));
+            return Value(self.toDouble(args[0]) + self.toDouble(args[1]));
         }, 2, ""};
 
-        functions["sub"] = {[](const std::vector<Value>& args) {
+        functions.edit(intern("sub")) = {[](ThisFuncInterpreter& self, Arguments args) {
             if (args.size() != 2) throw std::runtime_error("sub requires exactly two arguments");
-            return Value(std::get<double>(args[0]) - std::get<double>(args[1]));
+            return Value(self.toDouble(args[0]) - self.toDouble(args[1]));
         }, 2, ""};
 
-        functions["mul"] = {[](const std::vector<Value>& args) {
+        functions.edit(intern("mul")) = {[](ThisFuncInterpreter& self, Arguments args) {
             if (args.size() != 2) throw std::runtime_error("mul requires exactly two arguments");
-            return Value(std::get<double>(args[0]) * std::get<double>(args[1]));
+            return Value(self.toDouble(args[0]) * self.toDouble(args[1]));
         }, 2, ""};
 
-        functions["div"] = {[](const std::vector<Value>& args) {
+        functions.edit(intern("div")) = {[](ThisFuncInterpreter& self, Arguments args) {
             if (args.size() != 2) throw std::runtime_error("div requires exactly two arguments");
-            if (std::get<double>(args[1]) == 0) throw std::runtime_error("Division by zero");
-            return Value(std::get<double>(args[0]) / std::get<double>(args[1]));
+            if (self.toDouble(args[1]) == 0) throw std::runtime_error("Division by zero");
+            return Value(self.toDouble(args[0]) / self.toDouble(args[1]));
         }, 2, ""};
 
         // pow function: Exponentiation
-        functions["pow"] = {[](const std::vector<Value>& args) {
+        functions.edit(intern("pow")) = {[](ThisFuncInterpreter& self, Arguments args) {
             if (args.size() != 2) throw std::runtime_error("pow requires exactly two arguments");
-            return Value(std::pow(std::get<double>(args[0]), std::get<double>(args[1])));
+            return Value(std::pow(self.toDouble(args[0]), self.toDouble(args[1])));
         }, 2, ""};
 
         // sqrt function: Square root
-        functions["sqrt"] = {[](const std::vector<Value>& args) {
+        functions.edit(intern("sqrt")) = {[](ThisFuncInterpreter& self, Arguments args) {
             if (args.size() != 1) throw std::runtime_error("sqrt requires exactly one argument");
-            double value = std::get<double>(args[0]);
+            double value = self.toDouble(args[0]);
             if (value < 0) throw std::runtime_error("sqrt requires a non-negative argument");
             return Value(std::sqrt(value));
         }, 1, ""};
 
         // Trigonometric functions
-        functions["sin"] = {[](const std::vector<Value>& args) {
+        functions.edit(intern("sin")) = {[](ThisFuncInterpreter& self, Arguments args) {
             if (args.size() != 1) throw std::runtime_error("sin requires exactly one argument");
-            return Value(std::sin(std::get<double>(args[0])));
+            return Value(std::sin(self.toDouble(args[0])));
         }, 1, ""};
 
-        functions["cos"] = {[](const std::vector<Value>& args) {
+        functions.edit(intern("cos")) = {[](ThisFuncInterpreter& self, Arguments args) {
             if (args.size() != 1) throw std::runtime_error("cos requires exactly one argument");
-            return Value(std::cos(std::get<double>(args[0])));
+            return Value(std::cos(self.toDouble(args[0])));
         }, 1, ""};
 
         // Logical operations
-        functions["nand"] = {[this](const std::vector<Value>& args) {
+        // nand and if are evaluated lazily by evaluateNode; these implementations
+        // are only reached with already evaluated arguments (e.g. from map/filter)
+        functions.edit(intern("nand")) = {[](ThisFuncInterpreter& self, Arguments args) {
             if (args.size() != 2) throw std::runtime_error("nand requires exactly two arguments");
-
-            // Resolve both arguments
-            double first = toDouble(std::holds_alternative<std::string>(args[0]) ? evaluate(std::get<std::string>(args[0])) : args[0]);
-            double second = toDouble(std::holds_alternative<std::string>(args[1]) ? evaluate(std::get<std::string>(args[1])) : args[1]);
-
+            double first = self.toDouble(args[0]);
+            double second = self.toDouble(args[1]);
             return Value(static_cast<double>(!(first && second))); // Non-zero is treated as true
         }, 2, ""};
 
-        functions["le"] = {[this](const std::vector<Value>& args) {
+        functions.edit(intern("le")) = {[](ThisFuncInterpreter& self, Arguments args) {
             if (args.size() != 2) throw std::runtime_error("le requires exactly two arguments");
-
-            // Resolve both arguments
-            double first = toDouble(std::holds_alternative<std::string>(args[0]) ? std::get<std::string>(args[0]) : args[0]);
-            double second = toDouble(std::holds_alternative<std::string>(args[1]) ? std::get<std::string>(args[1]) : args[1]);
-
+            double first = self.toDouble(args[0]);
+            double second = self.toDouble(args[1]);
             return Value(first <= second ? 1.0 : 0.0); // Return 1.0 for true, 0.0 for false
         }, 2, ""};
 
-        functions["eq"] = {[this](const std::vector<Value>& args) {
+        functions.edit(intern("eq")) = {[](ThisFuncInterpreter& self, Arguments args) {
             if (args.size() != 2) throw std::runtime_error("eq requires exactly two arguments");
-
-            // Resolve both arguments
-            double first = toDouble(std::holds_alternative<std::string>(args[0]) ? std::get<std::string>(args[0]) : args[0]);
-            double second = toDouble(std::holds_alternative<std::string>(args[1]) ? std::get<std::string>(args[1]) : args[1]);
-
+            double first = self.toDouble(args[0]);
+            double second = self.toDouble(args[1]);
             return Value(first == second ? 1.0 : 0.0); // Return 1.0 for true, 0.0 for false
         }, 2, ""};
 
-
         // Conditional operation (if)
-        functions["if"] = {[this](const std::vector<Value>& args) {
+        functions.edit(intern("if")) = {[](ThisFuncInterpreter& self, Arguments args) {
             if (args.size() != 3) throw std::runtime_error("if requires exactly three arguments");
-
-            // Evaluate the condition
-            double condition = toDouble(evaluate(std::get<std::string>(args[0])));
-
-            // Depending on the condition, evaluate only the relevant branch
-            if (condition != 0) {
-                // Evaluate the `then` branch
-                return evaluate(std::get<std::string>(args[1]));
-            } else {
-                // Evaluate the `else` branch
-                return evaluate(std::get<std::string>(args[2]));
-            }
+            return self.toDouble(args[0]) != 0 ? args[1] : args[2];
         }, 3, ""};
 
         // List functions
-        functions["list"] = {[this](const std::vector<Value>& args) {
+        functions.edit(intern("list")) = {[](ThisFuncInterpreter& self, Arguments args) {
             std::vector<double> list;
+            list.reserve(args.size());
             for (const auto& arg : args) {
-                list.push_back(toDouble(arg));
+                list.push_back(self.toDouble(arg));
             }
-            return Value(list); // Return the list directly
+            Budget::allocate(list.size() * sizeof(double));
+            if (self.profiler) self.profiler->allocate(list.size() * sizeof(double));
+            return Value(List(std::move(list))); // Return the list directly
         }, 0, ""};
 
-        functions["head"] = {[this](const std::vector<Value>& args) {
+        functions.edit(intern("head")) = {[](ThisFuncInterpreter& self, Arguments args) {
             if (args.size() != 1) throw std::runtime_error("head requires exactly one argument");
-            const auto& list = toList(args[0]);
+            if (args[0].isLazy()) {
+                double element;
+                if (!self.lazyElement(args[0], 0, element)) throw std::runtime_error("Cannot get head of an empty list");
+                return Value(element);
+            }
+            const auto& list = self.toList(args[0]);
             if (list.empty()) throw std::runtime_error("Cannot get head of an empty list");
             return Value(list[0]); // Return the first element as a scalar
         }, 1, ""};
 
-        functions["tail"] = {[this](const std::vector<Value>& args) {
+        functions.edit(intern("tail")) = {[](ThisFuncInterpreter& self, Arguments args) {
             if (args.size() != 1) throw std::runtime_error("tail requires exactly one argument");
 
-            const auto& list = toList(args[0]); // Ensure the argument is a list
+            // A lazy list moves on by one, once it is known to have an element
+            if (args[0].isLazy()) {
+                double element;
+                if (!self.lazyElement(args[0], 0, element)) throw std::runtime_error("Cannot get tail of an empty list");
+                return Value(args[0].pipeline(), args[0].offset() + 1);
+            }
+
+            const auto& list = self.toList(args[0]); // Ensure the argument is a list
             if (list.empty()) throw std::runtime_error("Cannot get tail of an empty list");
 
-            // Return a new list excluding the first element
-            return Value(std::vector<double>(list.begin() + 1, list.end()));
+            // Return a view of the list excluding the first element
+            return Value(list.tail());
         }, 1, ""};
 
-        functions["map"] = {[this](const std::vector<Value>& args) {
+        // map and filter return lazy lists; their function runs when elements
+        // are read (see pipeline.cpp)
+        functions.edit(intern("map")) = {[](ThisFuncInterpreter& self, Arguments args) {
             if (args.size() != 2) throw std::runtime_error("map requires exactly two arguments");
 
-            // First argument: function reference
-            if (!std::holds_alternative<std::string>(args[0])) {
-                throw std::runtime_error("The first argument of map must be the name of a single-argument function");
-            }
-            std::string functionName = std::get<std::string>(args[0]);
-
-            // Use helper to check if the function is single-argument
-            if (!isSingleArgumentFunction(functionName)) {
-                throw std::runtime_error("The first argument of map must be a single-argument function");
-            }
+            // First argument: function reference, resolved once for the whole list
+            const Function& function = self.functionArgument(args[0], "map");
 
             // Second argument: list
-            const auto& list = toList(args[1]);
-
-            // Apply the function to each element of the list
-            std::vector<double> result;
-            for (double elem : list) {
-                std::vector<Value> singleArg = {Value(elem)};
-                Value transformedValue = functions[functionName].implementation(singleArg);
-                result.push_back(toDouble(transformedValue));
-            }
-
-            // Return the transformed list
-            return Value(result); 
+            if (!args[1].isList()) self.toList(args[1]);
+            return self.pipe(args[1], {Pipeline::Stage::Kind::Map, function.symbol});
         }, 2, ""};
 
-        functions["filter"] = {[this](const std::vector<Value>& args) {
+        functions.edit(intern("filter")) = {[](ThisFuncInterpreter& self, Arguments args) {
             if (args.size() != 2) throw std::runtime_error("filter requires exactly two arguments");
 
-            // First argument: predicate function
-            if (!std::holds_alternative<std::string>(args[0])) {
-                throw std::runtime_error("The first argument of filter must be the name of a single-argument predicate function");
-            }
-            std::string functionName = std::get<std::string>(args[0]);
-
-            // Use helper to check if the function is single-argument
-            if (!isSingleArgumentFunction(functionName)) {
-                throw std::runtime_error("The first argument of filter must be a single-argument predicate function");
-            }
+            // First argument: predicate function, resolved once for the whole list
+            const Function& function = self.functionArgument(args[0], "filter");
 
             // Second argument: list
-            const auto& list = toList(args[1]);
+            if (!args[1].isList()) self.toList(args[1]);
+            return self.pipe(args[1], {Pipeline::Stage::Kind::Filter, function.symbol});
+        }, 2, ""};
 
-            // Apply the predicate function to filter the list
-            std::vector<double> result;
-            for (double elem : list) {
-                std::vector<Value> singleArg = {Value(elem)};
-                Value predicateResult = functions[functionName].implementation(singleArg);
+        // range(start, end[, step]): start, start + step, ... up to but not
+        // including end, as a lazy list that holds no elements until read
+        functions.edit(intern("range")) = {[](ThisFuncInterpreter& self, Arguments args) {
+            if (args.size() != 2 && args.size() != 3) {
+                throw std::runtime_error("range requires two or three arguments");
+            }
+            Pipeline::Definition definition;
+            definition.range = true;
+            definition.start = self.toDouble(args[0]);
+            double end = self.toDouble(args[1]);
+            definition.step = args.size() == 3 ? self.toDouble(args[2]) : 1;
+            if (definition.step == 0) throw std::runtime_error("range requires a non-zero step");
+
+            double count = std::ceil((end - definition.start) / definition.step);
+            if (!(count < 9007199254740992.0)) throw std::runtime_error("range has too many elements"); // 2^53, or NaN
+            if (count < 0) count = 0;
+            // Rounding may put the last element on end or past it
+            auto last = [&](double n) { return definition.start + (n - 1) * definition.step; };
+            while (count > 0 && (definition.step > 0 ? last(count) >= end : last(count) <= end)) --count;
+            definition.count = static_cast<size_t>(count);
+            return Value(std::make_shared<Pipeline>(std::move(definition)), 0);
+        }, 3, ""};
 
-                // Include the element if the predicate evaluates to true
-                if (toDouble(predicateResult) != 0) { // Non-zero is treated as true
-                    result.push_back(elem);
+        // Folds read their list a block at a time, so a lazy one is never held
+        // in memory as a whole
+        functions.edit(intern("reduce")) = {[](ThisFuncInterpreter& self, Arguments args) {
+            if (args.size() != 3) throw std::runtime_error("reduce requires exactly three arguments");
+            const Function& function = self.functionArgument(args[0], "reduce", 2);
+            double accumulator = self.toDouble(args[1]);
+            if (!args[2].isList()) self.toList(args[2]);
+            self.forEachBlock(args[2], [&](const double* elements, size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    Value pair[] = {Value(accumulator), Value(elements[i])};
+                    accumulator = self.toDouble(self.callFunction(function, Arguments(pair, 2)));
                 }
-            }
+                return true;
+            });
+            return Value(accumulator);
+        }, 3, ""};
 
-            //Returns the filtered list
-            return result;
-        }, 2, ""};
+        functions.edit(intern("sum")) = {[](ThisFuncInterpreter& self, Arguments args) {
+            if (args.size() != 1) throw std::runtime_error("sum requires exactly one argument");
+            double total = 0;
+            if (!args[0].isList()) self.toList(args[0]);
+            self.forEachBlock(args[0], [&](const double* elements, size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    total += elements[i];
+                }
+                return true;
+            });
+            return Value(total);
+        }, 1, ""};
+
+        for (const auto& symbol : symbols) {
+            functions.edit(symbol.second).name = symbol.first;
+            functions.edit(symbol.second).symbol = symbol.second;
+        }
+        builtinCount = functions.size();
+        for (size_t symbol = 0; symbol < builtinCount; ++symbol) {
+            Function& function = functions.edit(symbol);
+            function.opcode = scalarOpcode(function.name, function.argCount);
+            compileFunction(function);
+        }
+        ifSymbol = intern("if");
+        nandSymbol = intern("nand");
+        mapSymbol = intern("map");
+        filterSymbol = intern("filter");
+        reduceSymbol = intern("reduce");
+        sumSymbol = intern("sum");
+    }
+
+// The next version of a shared table (shared.h), to declare into while the
+// current one is evaluated. It shares every entry of the table until the
+// change edits it, and with the entries what is never changed in place:
+// trees, bytecode, kernels, lists and the memo caches, which are replaced
+// rather than cleared once stale. It also shares the thread pool and the
+// arena of native code, which only grows. Profiling is not carried over.
+ThisFuncInterpreter::ThisFuncInterpreter(const ThisFuncInterpreter& other)
+    : functions(other.functions), versioned(true), symbols(other.symbols), builtinCount(other.builtinCount),
+      ifSymbol(other.ifSymbol), nandSymbol(other.nandSymbol), mapSymbol(other.mapSymbol),
+      filterSymbol(other.filterSymbol), reduceSymbol(other.reduceSymbol), sumSymbol(other.sumSymbol),
+      engine(other.engine), maxStackDepth(other.maxStackDepth), limits(other.limits),
+      cancellations(other.cancellations), parallelThreshold(other.parallelThreshold),
+      pool(other.pool), forkDepth(other.forkDepth), jitArena(other.jitArena), memoizeAll(other.memoizeAll),
+      memoCapacity(other.memoCapacity), memoizedNames(other.memoizedNames), imageOwner(other.imageOwner) {}
+
+void ThisFuncInterpreter::declareFunction(std::string_view declaration) {
+    Statement statement = parseDeclaration(declaration);
+    const std::string& functionName = statement.name;
+    size_t symbol = intern(functionName);
+
+    if (symbol < builtinCount) {
+        throw std::runtime_error("Cannot redeclare builtin function: " + functionName);
+    }
+
+    resolveSymbols(*statement.expression);
+    materialize(*statement.expression);
+    std::vector<size_t> placeholders;
+    collectPlaceholders(*statement.expression, placeholders);
+
+    Function function;
+    function.name = functionName;
+    function.symbol = symbol;
+    function.expression = trim(declaration.substr(declaration.find("<-") + 2));
+
+    // Handle list declarations: a list without placeholders is evaluated once
+    if (placeholders.empty() && statement.expression->kind == Node::Kind::Call && statement.expression->name == "list") {
+        checkExpression(*statement.expression);
+        invalidateDependents(symbol);
+        markParallelCalls(*statement.expression);
+        char marker;
+        nativeStackBase = &marker;
+        callDepth = 0;
+        nativeGaveUpAt = SIZE_MAX;
+        Budget budget(limits, *cancellations);
+        Budget::Scope budgetScope(&budget);
+        ProfileScope profileScope(profiler.get());
+        Value list = evaluateNode(*statement.expression, {});
+        frameArena.reset();
+        storeList(std::move(function), list.list());
+        return;
     }
 
-    void ThisFuncInterpreter::declareFunction(const std::string& declaration) {
-    size_t arrowPos = declaration.find("<-");
-    if (arrowPos == std::string::npos) {
-        throw std::runtime_error("Invalid function declaration syntax");
+    // Parameterized and constant functions keep their parsed body; calls
+    // inside it are bound to symbols, so recursion and later redeclarations
+    // of the callees are picked up when the body is evaluated. The body is
+    // checked against the callees before it replaces anything.
+    function.argCount = placeholders.empty() ? 0 : *std::max_element(placeholders.begin(), placeholders.end()) + 1;
+    function.singleArgument = function.argCount <= 1;
+    function.source = statement.expression;
+    function.body = statement.expression;
+    inferSignatures({&function}, true);
+
+    // Cached results of anything that calls the old definition are stale now
+    invalidateDependents(symbol);
+
+    collectSymbols(*function.source, function.callees);
+    std::sort(function.callees.begin(), function.callees.end());
+    function.callees.erase(std::unique(function.callees.begin(), function.callees.end()), function.callees.end());
+    if (memoizeAll || memoizedNames.count(functionName)) {
+        function.memo = std::make_shared<MemoCache>(memoCapacity);
     }
+    bindFunction(std::move(function));
 
-    std::string functionName = trim(declaration.substr(0, arrowPos));
-    std::string expression = trim(declaration.substr(arrowPos + 2));
+    // The body is optimized once the new definition is in the table, and so
+    // is every function that could inline it
+    optimizeDependents(symbol);
+}
+
+// Declares a list built by the host, as if by name <- list(elements...)
+void ThisFuncInterpreter::declareList(const std::string& name, std::vector<double> elements) {
+    if (!isValidName(name)) {
+        throw std::runtime_error("Invalid function name: " + name);
+    }
+    size_t symbol = intern(name);
+    if (symbol < builtinCount) {
+        throw std::runtime_error("Cannot redeclare builtin function: " + name);
+    }
+    invalidateDependents(symbol);
 
-    // Handle list declarations
-    if (expression.find("list(") == 0) {
-        size_t openParen = expression.find('(');
-        size_t closeParen = expression.rfind(')');
-        if (openParen == std::string::npos || closeParen == std::string::npos || closeParen <= openParen) {
-            throw std::runtime_error("Invalid list declaration syntax");
+    Function function;
+    function.name = name;
+    function.symbol = symbol;
+    function.expression = "list(...)";
+    storeList(std::move(function), List(std::move(elements)));
+}
+
+void ThisFuncInterpreter::storeList(Function function, List list) {
+    size_t symbol = function.symbol;
+    function.isList = true;
+    function.value = Value(std::move(list));
+    function.implementation = [symbol](ThisFuncInterpreter& self, Arguments) {
+        return self.functions[symbol].value; // Return the list
+    };
+    function.argCount = 0;
+    bindFunction(std::move(function));
+    optimizeDependents(symbol);
+}
+
+// Puts function in the slot of its symbol and moves the slot's edges in the
+// reverse call graph from the old definition's callees to the new one's
+void ThisFuncInterpreter::bindFunction(Function function) {
+    size_t symbol = function.symbol;
+    Function& slot = functions.edit(symbol);
+    for (size_t callee : slot.callees) {
+        auto& callers = functions.edit(callee).callers;
+        callers.erase(std::remove(callers.begin(), callers.end(), symbol), callers.end());
+    }
+    for (size_t callee : function.callees) {
+        if (callee >= builtinCount) functions.edit(callee).callers.push_back(symbol);
+    }
+    function.callers = std::move(slot.callers);
+    slot = std::move(function);
+}
+
+// Functions that reach symbol through their calls, symbol included
+std::vector<size_t> ThisFuncInterpreter::dependentsOf(size_t symbol) const {
+    std::vector<bool> affected(functions.size(), false);
+    std::vector<size_t> dependents = {symbol};
+    affected[symbol] = true;
+
+    for (size_t next = 0; next < dependents.size(); ++next) {
+        for (size_t caller : functions[dependents[next]].callers) {
+            if (affected[caller]) continue;
+            affected[caller] = true;
+            dependents.push_back(caller);
         }
-        std::string arguments = expression.substr(openParen + 1, closeParen - openParen - 1);
-        std::vector<std::string> argStrings = splitArguments(arguments);
-        std::vector<double> evaluatedArgs;
-        for (const std::string &arg : argStrings) {
-            evaluatedArgs.push_back(std::stod(arg));
+    }
+
+    std::sort(dependents.begin(), dependents.end());
+    return dependents;
+}
+
+// Empties the memo caches of every function that reaches symbol through its calls
+void ThisFuncInterpreter::invalidateDependents(size_t symbol) {
+    for (size_t dependent : dependentsOf(symbol)) {
+        if (functions[dependent].memo) {
+            Function& function = functions.edit(dependent);
+            function.memo = function.memo->emptied();
         }
-        declaredLists[functionName] = evaluatedArgs;
-        functions[functionName] = {[functionName, this](const std::vector<Value>&) {
-            const auto& list = declaredLists[functionName];
-            return Value(list); // Return the list
-        }, 0, ""};
     }
+}
 
-    // Handle parameterized functions (with recursion support)
-    else if (expression.find("#") != std::string::npos) {
-        // Temporarily register the function with a placeholder implementation
-        functions[functionName] = {
-            {},  // Placeholder implementation to allow self-references
-            static_cast<size_t>(std::count(expression.begin(), expression.end(), '#')),
-            expression // Store the original expression for debugging or validation
-        };
+void ThisFuncInterpreter::memoize(const std::string& name) {
+    if (!findFunction(name)) {
+        throw std::runtime_error("Unknown function: " + name);
+    }
+    size_t symbol = symbols.at(name);
+    materialize(symbol);
+    if (!functions[symbol].body) {
+        throw std::runtime_error("Only user-defined functions can be memoized: " + name);
+    }
+    memoizedNames.insert(name);
+    if (!functions[symbol].memo) {
+        functions.edit(symbol).memo = std::make_shared<MemoCache>(memoCapacity);
+        // Callers that inlined it go back to calling it through its cache
+        optimizeDependents(symbol);
+    }
+}
+
+std::vector<ThisFuncInterpreter::MemoStats> ThisFuncInterpreter::memoStatistics() const {
+    std::vector<MemoStats> statistics;
+    for (size_t symbol = 0; symbol < functions.size(); ++symbol) {
+        const Function& function = functions[symbol];
+        const auto& memo = function.memo;
+        if (memo) {
+            statistics.push_back({function.name, memo->hits(), memo->misses(), memo->evictions(), memo->size()});
+        }
+    }
+    std::sort(statistics.begin(), statistics.end(), [](const MemoStats& a, const MemoStats& b) {
+        return a.name < b.name;
+    });
+    return statistics;
+}
+
+void ThisFuncInterpreter::setProfiling(bool enabled) {
+    profiler = enabled ? std::make_unique<Profiler>() : nullptr;
+    // Bytecode depends on whether builtin calls are observed
+    std::vector<size_t> compiled;
+    for (size_t symbol = builtinCount; symbol < functions.size(); ++symbol) {
+        if (functions[symbol].body) compiled.push_back(symbol);
+    }
+    renewSlots(compiled);
+    for (size_t symbol : compiled) {
+        compileFunction(functions.edit(symbol));
+    }
+    settleNative(compiled);
+}
+
+std::vector<ThisFuncInterpreter::ProfileStats> ThisFuncInterpreter::profileStatistics() const {
+    std::vector<ProfileStats> statistics;
+    if (!profiler) return statistics;
+    for (const auto& stats : profiler->functionStats()) {
+        statistics.push_back({functions[stats.symbol].name, stats.calls, stats.inclusiveNs, stats.exclusiveNs,
+                              stats.maxDepth, stats.listBytes});
+    }
+    return statistics;
+}
+
+void ThisFuncInterpreter::writeCollapsedStacks(std::ostream& out) const {
+    if (!profiler) return;
+    std::vector<std::string> names;
+    names.reserve(functions.size());
+    for (size_t symbol = 0; symbol < functions.size(); ++symbol) {
+        names.push_back(functions[symbol].name);
+    }
+    profiler->writeCollapsedStacks(out, names);
+}
 
-        // Define the actual implementation
-        functions[functionName].implementation = [this, functionName, expression](const std::vector<Value>& args) {
-            // Substitute placeholders (#0, #1, etc.) with actual arguments
-            std::string substitutedExpression = expression;
-            for (size_t i = 0; i < args.size(); ++i) {
-                std::string placeholder = "#" + std::to_string(i);
-                size_t pos;
-                while ((pos = substitutedExpression.find(placeholder)) != std::string::npos) {
-                    substitutedExpression.replace(
-                        pos, placeholder.size(), std::to_string(toDouble(args[i])));
+// Value of a bare name: the elements of a declared list, otherwise a
+// reference to the function (e.g. the first argument of map)
+Value ThisFuncInterpreter::loadName(size_t symbol) {
+    const Function& function = functions[symbol];
+    if (function.isList) {
+        return function.value;
+    }
+    if (!function.defined()) {
+        throw std::runtime_error("Unknown function: " + function.name);
+    }
+    return Value::function(symbol);
+}
+
+Value ThisFuncInterpreter::evaluate(std::string_view expression) {
+    NodePtr node = parseExpression(expression);
+    resolveSymbols(*node);
+    materialize(*node);
+    return evaluateResolved(*node);
+}
+
+// Evaluates against a published table (shared.h). Names are looked up and
+// nothing in the table changes, so any number of threads can do this at once.
+Value ThisFuncInterpreter::evaluatePublished(std::string_view expression) {
+    NodePtr node = parseExpression(expression);
+    lookupSymbols(*node);
+    return evaluateResolved(*node);
+}
+
+Value ThisFuncInterpreter::evaluateResolved(Node& node) {
+    checkExpression(node);
+    markParallelCalls(node);
+    char marker;
+    nativeStackBase = &marker;
+    callDepth = 0;
+    nativeGaveUpAt = SIZE_MAX;
+    Budget budget(limits, *cancellations);
+    Budget::Scope budgetScope(&budget);
+    ProfileScope profileScope(profiler.get());
+    Value result = force(engine == Engine::VM ? runChunk(*compileChunk(node, builtinCount, !profiler), {})
+                                              : evaluateNode(node, {}));
+    frameArena.reset();
+    return result;
+}
+
+// Evaluates expressions that do not depend on each other, concurrently on
+// the thread pool when there is one. Parsing, checking and compiling only
+// read the table and run in parallel too; binding names interns new ones and
+// may decode functions from a loaded image, so it happens in between, in order.
+std::vector<ThisFuncInterpreter::Evaluation> ThisFuncInterpreter::evaluateAll(
+    const std::vector<std::string_view>& expressions) {
+    size_t count = expressions.size();
+    std::vector<Evaluation> results(count);
+    std::vector<NodePtr> nodes(count);
+
+    // Consecutive expressions share a task, a few tasks per thread, so
+    // stealing evens out uneven costs without paying for a task per line.
+    // The profiler follows a single call stack, so it runs them in order.
+    size_t tasks = pool && !profiler ? std::min(count, pool->size() * 8) : 1;
+    auto forEach = [&](const std::function<void(size_t)>& step) {
+        auto runTask = [&](size_t task) {
+            for (size_t i = count * task / tasks; i < count * (task + 1) / tasks; ++i) {
+                if (results[i].error) continue;
+                try {
+                    step(i);
+                } catch (...) {
+                    results[i].error = std::current_exception();
                 }
             }
-
-            // Evaluate the substituted expression (supports recursion via functions map)
-            return this->evaluate(substitutedExpression);
         };
+        if (tasks > 1) {
+            pool->parallelFor(tasks, runTask);
+        } else {
+            runTask(0);
+        }
+    };
+
+    forEach([&](size_t i) {
+        nodes[i] = parseExpression(expressions[i]);
+    });
+    for (size_t i = 0; i < count; ++i) {
+        if (results[i].error) continue;
+        try {
+            resolveSymbols(*nodes[i]);
+            materialize(*nodes[i]);
+            markParallelCalls(*nodes[i]);
+        } catch (...) {
+            results[i].error = std::current_exception();
+        }
     }
+    forEach([&](size_t i) {
+        // A thread that picks this up while waiting inside another evaluation
+        // keeps that evaluation's stack base and gets its depth back afterwards
+        char marker;
+        const char* savedBase = nativeStackBase;
+        size_t savedDepth = callDepth;
+        size_t savedGaveUpAt = nativeGaveUpAt;
+        if (savedDepth == 0) nativeStackBase = &marker;
+        callDepth = 0;
+        nativeGaveUpAt = SIZE_MAX;
+        try {
+            checkExpression(*nodes[i]);
+            Budget budget(limits, *cancellations); // Each expression is a statement of its own
+            Budget::Scope budgetScope(&budget);
+            ProfileScope profileScope(profiler.get());
+            results[i].value = force(engine == Engine::VM
+                ? runChunk(*compileChunk(*nodes[i], builtinCount, !profiler), {})
+                : evaluateNode(*nodes[i], {}));
+        } catch (...) {
+            results[i].error = std::current_exception();
+        }
+        frameArena.reset();
+        nativeStackBase = savedBase;
+        callDepth = savedDepth;
+        nativeGaveUpAt = savedGaveUpAt;
+    });
+    return results;
+}
 
-    // Handle constant functions
-    else {
-        double constantValue = std::stod(expression);
-        functions[functionName] = {
-            [constantValue](const std::vector<Value>&) {
-                return Value(constantValue); // Return the scalar constant
-            },
-        0, ""};
+void ThisFuncInterpreter::setJit(bool enabled) {
+    jitArena = enabled ? std::make_shared<JitArena>() : nullptr;
+    std::vector<size_t> compiled;
+    for (size_t symbol = builtinCount; symbol < functions.size(); ++symbol) {
+        if (functions[symbol].body) compiled.push_back(symbol);
     }
+    renewSlots(compiled);
+    for (size_t symbol : compiled) {
+        compileNative(functions.edit(symbol));
+    }
+    settleNative(compiled);
 }
 
+void ThisFuncInterpreter::setThreads(size_t threads) {
+    pool = threads > 1 ? std::make_shared<ThreadPool>(threads) : nullptr;
+}
 
-    Value ThisFuncInterpreter::evaluate(const std::string &expression) {
-    std::string trimmedExpr = trim(expression);
+size_t ThisFuncInterpreter::chunkCount(size_t elements) const {
+    if (!pool || profiler || elements < parallelThreshold) return 1;
+    // Several chunks per thread so stealing can even out uneven costs
+    return std::min(elements, pool->size() * 8);
+}
 
-    // Check if the expression is a number
-    if (std::isdigit(trimmedExpr[0]) || (trimmedExpr[0] == '-' && std::isdigit(trimmedExpr[1]))) {
-        return Value(std::stod(trimmedExpr));
+// Runs body over [begin, end) split into chunks. Errors are rethrown in chunk
+// order, so the caller sees the same error as a sequential loop would.
+void ThisFuncInterpreter::runChunks(size_t begin, size_t end, size_t chunks,
+                                    const std::function<void(size_t chunk, size_t from, size_t to)>& body) {
+    if (chunks <= 1) {
+        body(0, begin, end);
+        return;
     }
 
-    // Check if the expression is a declared list
-    auto it = declaredLists.find(trimmedExpr);
-    if (it != declaredLists.end()) {
-        return Value(it->second); // Return the list directly
+    std::vector<std::exception_ptr> errors(chunks);
+    std::atomic<size_t> firstFailed(chunks);
+    size_t total = end - begin;
+    Budget* budget = Budget::current();
+    pool->parallelFor(chunks, [&](size_t chunk) {
+        // Chunks after a failed one cannot change which error is reported
+        if (chunk > firstFailed.load(std::memory_order_relaxed)) return;
+
+        // Workers start their own evaluation state; a thread helping out while
+        // it waits keeps its own and gets its depth back afterwards
+        char marker;
+        if (!nativeStackBase) nativeStackBase = &marker;
+        size_t savedDepth = callDepth;
+        try {
+            Budget::Scope budgetScope(budget);
+            body(chunk, begin + total * chunk / chunks, begin + total * (chunk + 1) / chunks);
+        } catch (...) {
+            errors[chunk] = std::current_exception();
+            size_t failed = firstFailed.load();
+            while (chunk < failed && !firstFailed.compare_exchange_weak(failed, chunk)) {}
+        }
+        callDepth = savedDepth;
+    });
+
+    for (const auto& error : errors) {
+        if (error) std::rethrow_exception(error);
     }
+}
 
-    // Check if the expression is a declared function
-    Function* function = findFunction(trimmedExpr);
-    if (function && trimmedExpr.find('(') == std::string::npos) {
-        return Value(trimmedExpr); // Return the function name as a string if it's not a function call
+// Evaluates the count arguments of a call made depth calls deep at once,
+// argument(i) giving the i-th, and rethrows the error of the first failed
+// one, as evaluating them in order would
+std::vector<Value> ThisFuncInterpreter::forkArguments(size_t count, size_t depth,
+                                                      const std::function<Value(size_t)>& argument) {
+    std::vector<Value> values(count);
+    std::vector<std::exception_ptr> errors(count);
+    Budget* budget = Budget::current();
+    pool->parallelFor(count, [&](size_t i) {
+        // Each argument continues at the depth of the call, so the depth
+        // limit and the cutoff for nested forks hold as if run in order
+        char marker;
+        if (!nativeStackBase) nativeStackBase = &marker;
+        size_t savedDepth = callDepth;
+        size_t savedGaveUpAt = nativeGaveUpAt;
+        callDepth = depth;
+        nativeGaveUpAt = SIZE_MAX;
+        try {
+            Budget::Scope budgetScope(budget);
+            values[i] = argument(i);
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+        callDepth = savedDepth;
+        nativeGaveUpAt = savedGaveUpAt;
+    });
+
+    for (const auto& error : errors) {
+        if (error) std::rethrow_exception(error);
     }
+    return values;
+}
 
-    // Parse function call syntax
-    size_t openParen = trimmedExpr.find('(');
-    size_t closeParen = trimmedExpr.rfind(')');
+// Runs a call on the function's native code when the arguments it reads are
+// scalars. depth is the call depth of the caller; native calls stop where the
+// engines would, and the native stack they may use is bounded as under builtins.
+// Returns false when the engine has to make the call instead, including when
+// native code ran out of calls or stack before finishing.
+bool ThisFuncInterpreter::runNative(const Function& function, const Value* args, size_t count, size_t depth,
+                                    Value& result) {
+    // At and below the depth where native code gave up, it would only give
+    // up again; that lasts until the engine gets back above it
+    if (depth >= nativeGaveUpAt || count < function.jitArguments) return false;
+    nativeGaveUpAt = SIZE_MAX;
+
+    Unboxed numbers;
+    if (!numbers.assign(args, function.jitArguments)) return false;
+
+    char marker;
+    const char* base = nativeStackBase ? nativeStackBase : &marker;
+    JitContext context;
+    context.callsLeft = depth < maxStackDepth ? maxStackDepth - depth : 0;
+    context.stackLimit = reinterpret_cast<uintptr_t>(base) - nativeStackBudget;
+    context.stepsLeft = Budget::stepsLeft();
+    context.resume = [](JitContext* context) noexcept {
+        Budget::stepsLeft() = context->stepsLeft;
+        bool resumed = Budget::resume();
+        context->stepsLeft = Budget::stepsLeft();
+        return resumed;
+    };
+    double value = function.jit(numbers.data(), &context);
+    Budget::stepsLeft() = context.stepsLeft;
+    switch (context.error) {
+    case JitError::None:
+        result = Value(value);
+        return true;
+    case JitError::DivisionByZero:
+        throw std::runtime_error("Division by zero");
+    case JitError::NegativeSqrt:
+        throw std::runtime_error("sqrt requires a non-negative argument");
+    case JitError::Fallback:
+        nativeGaveUpAt = depth;
+        break;
+    case JitError::Stopped:
+        Budget::step(0); // Throws why the budget ran out
+        break;
+    }
+    return false;
+}
+
+// Runs a call of a scalar function on unboxed numbers, at depth, when its
+// arguments are numbers. Returns false when the engine has to make the call,
+// e.g. because it would fork or the profiler observes it.
+bool ThisFuncInterpreter::callScalar(const Function& function, const Value* args, size_t count, size_t depth,
+                                    Value& result) {
+    if (profiler || forks(depth) || count != function.argCount) return false;
+    Unboxed numbers;
+    if (!numbers.assign(args, count)) return false;
+    result = Value(engine == Engine::VM ? runScalar(*function.code, numbers.data(), count, depth)
+                                        : evaluateScalar(*function.body, numbers.data(), count));
+    return true;
+}
+
+Value ThisFuncInterpreter::callFunction(const Function& function, Arguments args) {
+    if (profiler) {
+        ProfileScope profileScope(profiler.get());
+        profiler->enter(function.symbol);
+        return runFunction(function, args);
+    }
+    return runFunction(function, args);
+}
 
-    if (openParen == std::string::npos || closeParen == std::string::npos || closeParen <= openParen) {
-        throw std::runtime_error("Invalid function syntax");
+// Calls of user functions made by builtins (map, filter, reduce, ...). Both
+// engines run them on the native stack, under the frames of the builtin, so
+// they count as a nested call.
+Value ThisFuncInterpreter::runFunction(const Function& function, Arguments args) {
+    if (!function.body) {
+        return function.implementation(*this, args);
+    }
+    Value result;
+    bool memoized = function.memo && MemoCache::cacheable(args);
+    if (memoized && function.memo->find(args, result)) {
+        return result;
+    }
+    if (!memoized && function.jit && runNative(function, args.data(), args.size(), callDepth, result)) {
+        return result;
     }
+    nestCall();
+    if (memoized || !function.scalar || !callScalar(function, args.data(), args.size(), callDepth, result)) {
+        result = engine == Engine::VM ? runChunk(codeFor(function), args) : evaluateNode(*function.body, args);
+    }
+    --callDepth;
+    if (memoized) function.memo->insert(args, result);
+    return result;
+}
 
-    std::string functionName = trim(trimmedExpr.substr(0, openParen));
-    std::string arguments = trimmedExpr.substr(openParen + 1, closeParen - openParen - 1);
+// Counts a nested user call of the tree walker, failing before it runs out
+// of call depth or, under a builtin, of native stack
+void ThisFuncInterpreter::enterCall() {
+    Budget::step();
+    nestCall();
+}
 
-    function = findFunction(functionName);
-    if (!function) {
-        throw std::runtime_error("Unknown function: " + functionName);
+// enterCall without the step, for calls counted where they were made
+void ThisFuncInterpreter::nestCall() {
+    char marker;
+    if (++callDepth > maxStackDepth || static_cast<size_t>(nativeStackBase - &marker) > nativeStackBudget) {
+        throw std::runtime_error("Stack overflow: recursion deeper than " + std::to_string(callDepth - 1) + " calls");
     }
+}
 
-    // Parse arguments
-    std::vector<std::string> argStrings = splitArguments(arguments);
-    std::vector<Value> evaluatedArgs;
+// Leaves a user call entered with enterCall, once it has returned
+void ThisFuncInterpreter::leaveCall() {
+    --callDepth;
+    if (profiler) profiler->exit();
+}
 
-    if (functionName == "if") {
-        // Pass arguments as raw strings for lazy evaluation
-        for (const std::string &arg : argStrings) {
-            evaluatedArgs.push_back(Value(arg)); // Store unevaluated expressions as strings
+// Tree walker. What it would recurse for, an operand still to evaluate or a
+// call that is not in tail position, is an activation on a heap-allocated
+// stack instead, so nested calls are bounded by maxStackDepth as on the VM.
+// Calls in tail position (the body of a user function and the chosen branch
+// of if) replace the activation that makes them. Arguments are evaluated into
+// frames taken from the thread's arena, which get them back when their
+// activation returns.
+Value ThisFuncInterpreter::evaluateNode(const Node& root, Arguments rootFrame) {
+    FrameArena& arena = frameArena;
+    FrameArena::Scope scope(arena);
+    std::vector<Activation>& stack = activations;
+    Unwind unwind(stack);
+    size_t base = stack.size();
+    stack.push_back({&root, rootFrame, arena.mark()});
+    Value value;           // What the activation that finished last returned,
+    bool returned = false; // to the one now on top, which resumes with it
+
+    // Operands that need no activation of their own
+    auto leaf = [this](const Node& operand, Arguments frame) -> Value {
+        if (operand.kind == Node::Kind::Number) return Value(operand.number);
+        if (operand.kind == Node::Kind::Name) return loadName(operand.symbol);
+        if (operand.index >= frame.size()) {
+            throw std::runtime_error("Missing argument #" + std::to_string(operand.index));
+        }
+        return frame[operand.index];
+    };
+    // Operands that need no activation of their own, leaves and builtins
+    // applied to leaves, are evaluated into result; false for the others.
+    // A builtin calling back into evaluateNode may move the stack.
+    auto direct = [&](const Node& operand, Arguments frame, Value& result) {
+        if (operand.kind != Node::Kind::Call) {
+            result = leaf(operand, frame);
+            return true;
+        }
+        if (operand.symbol >= builtinCount || operand.symbol == ifSymbol || operand.symbol == nandSymbol) {
+            return false;
+        }
+        for (const auto& arg : operand.args) {
+            if (arg->kind == Node::Kind::Call) return false;
+        }
+        FrameArena::Mark mark = arena.mark();
+        Value* args = arena.allocate(operand.args.size());
+        for (size_t i = 0; i < operand.args.size(); ++i) {
+            args[i] = leaf(*operand.args[i], frame);
+        }
+        result = callFunction(functions[operand.symbol], Arguments(args, operand.args.size()));
+        arena.release(mark);
+        return true;
+    };
+
+    while (true) {
+        Activation* a = &stack.back();
+        const Node* node = a->node;
+        const Function* function;
+        size_t count;
+        if (returned) {
+            returned = false;
+            goto resume;
+        }
+
+        if (node->kind != Node::Kind::Call) {
+            value = leaf(*node, a->frame);
+            goto finish;
+        }
+        a->next = 0;
+        // Lazy builtins: only the operands needed for the result are evaluated
+        if (node->symbol == ifSymbol) {
+            if (node->args.size() != 3) throw std::runtime_error("if requires exactly three arguments");
+            goto operand;
+        }
+        if (node->symbol == nandSymbol) {
+            if (node->args.size() != 2) throw std::runtime_error("nand requires exactly two arguments");
+            goto operand;
+        }
+        function = &functions[node->symbol];
+        if (!function->defined()) {
+            throw std::runtime_error("Unknown function: " + node->name);
+        }
+        a->args = arena.allocate(node->args.size());
+        if (node->parallelArgs && forks(callDepth)) {
+            Arguments frame = a->frame;
+            Value* args = a->args;
+            std::vector<Value> values = forkArguments(node->args.size(), callDepth, [&](size_t i) {
+                return evaluateNode(*node->args[i], frame);
+            });
+            std::move(values.begin(), values.end(), args);
+            a = &stack.back(); // Evaluating on this thread may have moved the stack
+            a->next = node->args.size();
+        }
+        goto operand;
+
+    resume:
+        // value is operand a->next of node, or what its call returned
+        if (a->calling) goto finish;
+        if (node->symbol == ifSymbol) {
+            a->node = node->args[toDouble(value) != 0 ? 1 : 2].get();
+            continue;
+        }
+        if (node->symbol == nandSymbol) {
+            if (a->next == 0 && toDouble(value) != 0) {
+                a->next = 1;
+                goto operand;
+            }
+            value = Value(a->next == 0 || toDouble(value) == 0 ? 1.0 : 0.0);
+            goto finish;
+        }
+        a->args[a->next++] = std::move(value);
+
+    operand:
+        // The next operand is evaluated here when it is a leaf, else by an
+        // activation pushed above this one
+        if (node->symbol == ifSymbol || node->symbol == nandSymbol) {
+            const Node& operand = *node->args[a->next];
+            if (direct(operand, a->frame, value)) {
+                a = &stack.back();
+                goto resume;
+            }
+            stack.push_back({&operand, a->frame, arena.mark()});
+            continue;
+        }
+        count = node->args.size();
+        while (a->next < count && direct(*node->args[a->next], a->frame, value)) {
+            a = &stack.back();
+            a->args[a->next++] = std::move(value);
+        }
+        if (a->next < count) {
+            stack.push_back({node->args[a->next].get(), a->frame, arena.mark()});
+            continue;
+        }
+
+        function = &functions[node->symbol];
+        {
+            Arguments evaluatedArgs(a->args, count);
+            if (function->jit && !forks(callDepth) && runNative(*function, a->args, count, callDepth, value)) {
+                goto finish;
+            }
+            if (function->scalar) {
+                // A tail call runs at the depth of the call it replaces
+                if (!a->entered) enterCall();
+                bool ran = callScalar(*function, a->args, count, callDepth, value);
+                if (!a->entered) --callDepth;
+                if (ran) goto finish;
+            }
+            if (!function->body) {
+                value = callFunction(*function, evaluatedArgs);
+                a = &stack.back(); // Builtins calling back into the tree walker may have moved the stack
+                goto finish;
+            }
+            if (function->memo && MemoCache::cacheable(evaluatedArgs)) {
+                // Counted and profiled like any call, also when the result is cached
+                Budget::step();
+                if (profiler) profiler->enter(node->symbol);
+                if (function->memo->find(evaluatedArgs, value)) {
+                    if (profiler) profiler->exit();
+                    goto finish;
+                }
+                nestCall();
+                a->calling = true;
+                stack.push_back({function->body.get(), evaluatedArgs, arena.mark(), nullptr, nullptr,
+                                 function->memo.get(), 0, true});
+                continue;
+            }
+            if (a->memo) {
+                // A memoized call caches its result when it returns, so its
+                // tail calls run above it instead of replacing it
+                enterCall();
+                if (profiler) profiler->enter(node->symbol);
+                a->calling = true;
+                stack.push_back({function->body.get(), evaluatedArgs, arena.mark(), nullptr, nullptr, nullptr, 0, true});
+                continue;
+            }
         }
-    } else {
-        // Evaluate arguments normally for other functions
-        for (const std::string &arg : argStrings) {
-            evaluatedArgs.push_back(evaluate(arg)); // Recursively evaluate arguments
+
+        // Enter the user function in place of the current node
+        if (!a->entered) {
+            enterCall();
+            a->entered = true;
+        } else {
+            Budget::step();
+            if (profiler) profiler->exit(); // The tail call replaces the running function
         }
+        if (profiler) profiler->enter(node->symbol);
+        a->ownFrame = a->ownFrame ? arena.replace(a->ownFrame, a->args, count) : a->args;
+        a->frame = Arguments(a->ownFrame, count);
+        a->node = function->body.get();
+        continue;
+
+    finish:
+        // value is what a evaluated to
+        if (a->entered) leaveCall();
+        if (a->memo) a->memo->insert(a->frame, value);
+        arena.release(a->mark);
+        stack.pop_back();
+        if (stack.size() == base) return value;
+        returned = true;
     }
+}
 
-    // Call the function
-    return function->implementation(evaluatedArgs);
-}
\ No newline at end of file
+// Tree walker for the bodies of scalar functions. The checker made sure that
+// every value is a number and every call gets the arguments it takes, so
+// nothing is boxed and nothing is checked but the errors of the builtins.
+// Like evaluateNode, it keeps its activations on a heap-allocated stack and
+// tail calls replace the activation that makes them; body is that of a call
+// its caller already counted, so even the first of them replaces it.
+double ThisFuncInterpreter::evaluateScalar(const Node& body, const double* args, size_t count) {
+    // Operands that need no activation of their own, leaves and builtins
+    // applied to leaves, are evaluated into result; false for the others
+    auto direct = [this](const Node& operand, const double* frame, double& result) {
+        if (operand.kind != Node::Kind::Call) return leafNumber(operand, frame, result);
+        if (operand.symbol >= builtinCount || operand.symbol == ifSymbol || operand.symbol == nandSymbol) {
+            return false;
+        }
+        double x;
+        double b = 0;
+        if (!leafNumber(*operand.args[0], frame, x)) return false;
+        if (operand.args.size() > 1 && !leafNumber(*operand.args[1], frame, b)) return false;
+        result = applyScalar(functions[operand.symbol].opcode, x, b);
+        return true;
+    };
+
+    double value;
+    if (direct(body, args, value)) return value;
+
+    std::vector<double>& numbers = scalarNumbers;
+    std::vector<ScalarActivation>& stack = scalarActivations;
+    numbers.assign(args, args + count);
+    stack.clear();
+    stack.push_back({&body, 0, 0, 0, 0, false, true});
+    bool returned = false; // value was returned to the activation now on top, which resumes with it
+
+    while (true) {
+        ScalarActivation* a = &stack.back();
+        const Node* node = a->node;
+        size_t first;
+        if (returned) {
+            returned = false;
+            goto resume;
+        }
+
+        if (node->kind == Node::Kind::Number) {
+            value = node->number;
+            goto finish;
+        }
+        if (node->kind == Node::Kind::Placeholder) {
+            value = numbers[a->args + node->index];
+            goto finish;
+        }
+        a->next = 0;
+        goto operand;
+
+    resume:
+        // value is operand a->next of node
+        if (node->symbol == ifSymbol) {
+            a->node = node->args[value != 0 ? 1 : 2].get();
+            continue;
+        }
+        if (node->symbol == nandSymbol) {
+            if (a->next == 0 && value != 0) {
+                a->next = 1;
+                goto operand;
+            }
+            value = a->next == 0 || value == 0 ? 1.0 : 0.0;
+            goto finish;
+        }
+        numbers.push_back(value);
+        ++a->next;
+
+    operand:
+        // The next operand is evaluated here when it is a leaf, else by an
+        // activation pushed above this one; the operands of the other calls
+        // wait on top of the number stack
+        if (node->symbol == ifSymbol || node->symbol == nandSymbol) {
+            const Node& operand = *node->args[a->next];
+            if (direct(operand, numbers.data() + a->args, value)) goto resume;
+            stack.push_back({&operand, a->args, numbers.size(), 0, 0, false, false});
+            continue;
+        }
+        while (a->next < node->args.size() && direct(*node->args[a->next], numbers.data() + a->args, value)) {
+            numbers.push_back(value);
+            ++a->next;
+        }
+        if (a->next < node->args.size()) {
+            const Node& operand = *node->args[a->next];
+            size_t start = numbers.size();
+            if (operand.symbol >= builtinCount) {
+                // A user call on direct operands is entered right away
+                size_t i = 0;
+                while (i < operand.args.size() && direct(*operand.args[i], numbers.data() + a->args, value)) {
+                    numbers.push_back(value);
+                    ++i;
+                }
+                if (i == operand.args.size()) {
+                    enterCall();
+                    stack.push_back({functions[operand.symbol].body.get(), start, start, start, 0, true, true});
+                    continue;
+                }
+                numbers.resize(start);
+            }
+            stack.push_back({&operand, a->args, start, 0, 0, false, false});
+            continue;
+        }
+
+        if (node->symbol < builtinCount) {
+            double b = node->args.size() > 1 ? numbers.back() : 0;
+            if (node->args.size() > 1) numbers.pop_back();
+            double x = numbers.back();
+            numbers.pop_back();
+            value = applyScalar(functions[node->symbol].opcode, x, b);
+            goto finish;
+        }
+
+        // Enter the user function in place of the current node; its
+        // arguments are the operands on top of the number stack
+        first = numbers.size() - node->args.size();
+        if (!a->replaces) {
+            enterCall();
+            a->entered = true;
+            a->replaces = true;
+            a->own = first;
+        } else {
+            Budget::step();
+            std::copy(numbers.begin() + first, numbers.end(), numbers.begin() + a->own);
+            numbers.resize(a->own + node->args.size());
+        }
+        a->args = a->own;
+        a->node = functions[node->symbol].body.get();
+        continue;
+
+    finish:
+        // value is what a evaluated to
+        if (a->entered) --callDepth;
+        numbers.resize(a->base);
+        stack.pop_back();
+        if (stack.empty()) return value;
+        returned = true;
+    }
+}
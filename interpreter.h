@@ -2,37 +2,310 @@
 #define INTERPRETER_H
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <functional>
 #include <unordered_map>
-#include <variant>
+#include <deque>
 #include <stdexcept>
+#include <exception>
+#include <unordered_set>
 #include <cctype> // std::isdigit
+#include <cmath>
+#include <algorithm>
 #include "parser.h"
 #include "lexer.h"
+#include "bytecode.h"
+#include "memo.h"
+#include "kernel.h"
+#include "jit.h"
+#include "threadpool.h"
+#include "profiler.h"
+#include "value.h"
+#include "arena.h"
+#include "pipeline.h"
+#include "budget.h"
 
-using Value = std::variant<double, std::vector<double>, std::string>;
+// Execution engine used by evaluate
+enum class Engine {
+    Tree, // Walks the parsed tree directly
+    VM    // Compiles to bytecode and runs it on the stack machine
+};
+
+// What an expression evaluates to, as far as the checker can tell
+enum class ValueKind : uint8_t {
+    Unknown,  // Nothing yet: a call that has not been seen to return
+    Scalar,
+    List,
+    Function, // A function name, e.g. the first argument of map
+    Any       // Could be more than one of the above
+};
 
 class ThisFuncInterpreter {
 private:
+    friend class SharedInterpreter;
+
     struct Function {
-        std::function<Value(const std::vector<Value>&)> implementation;
-        size_t argCount;
+        // Builtins get the interpreter evaluating the call, so copies of the
+        // table (shared.h) can share them
+        std::function<Value(ThisFuncInterpreter& self, Arguments args)> implementation;
+        size_t argCount; // Highest placeholder plus one for user functions
         std::string expression;
+        NodePtr source = nullptr; // Parsed body of a user-defined function, null for builtins
+        NodePtr body = nullptr;   // source after optimization, what the engines run
+        ChunkPtr code = nullptr; // Bytecode for body
+        std::vector<size_t> callees = {}; // Symbols referenced by source, each once
+        std::vector<size_t> callers = {}; // User functions whose callees include this one
+        std::shared_ptr<MemoCache> memo = nullptr; // Set when the function is memoized
+        std::string name = "";
+        size_t symbol = 0;
+        bool singleArgument = true; // Can be called with one argument, e.g. by map
+        bool recursive = false;      // Can reach itself through its calls; never inlined
+        bool isList = false;         // Declared list, kept in value
+        Value value = {};
+        std::shared_ptr<const Kernel> kernel = nullptr; // SIMD form for map/filter, if any
+        std::vector<ValueKind> parameters = {}; // What each argument is used as, argCount of them
+        ValueKind result = ValueKind::Any;
+        bool checked = false;        // parameters and result hold for the current callees
+        bool scalar = false;         // Checked to compute with numbers only, so it runs unboxed
+        OpCode opcode = OpCode::Return; // Builtins with a scalar opcode, Return for the rest
+        JitEntry jit = nullptr;      // Native code for body, if compiled (--jit)
+        JitEntry* jitSlot = nullptr; // Where native callers find jit, in the arena
+        size_t jitArguments = 0;     // Arguments the native code reads
+        std::string_view details = {}; // expression and tree still in a loaded image
+
+        bool defined() const { return body || implementation || !details.empty(); }
     };
 
-    std::unordered_map<std::string, Function> functions;
-    std::unordered_map<std::string, std::vector<double>> declaredLists;
+    // Function table. Entries are shared with the other versions of a shared
+    // table (shared.h) until they change: operator[] only reads them, and
+    // edit() first copies an entry that another version still holds. A
+    // reference from operator[] is not used after edit() of the same symbol.
+    // A copy notes the symbols it copied or added, once each, in changed().
+    class FunctionTable {
+    public:
+        FunctionTable() = default;
+        FunctionTable(const FunctionTable& other) : entries(other.entries), copy(true) {}
+        FunctionTable& operator=(const FunctionTable&) = delete;
+
+        const Function& operator[](size_t symbol) const { return *entries[symbol]; }
+        Function& edit(size_t symbol) {
+            std::shared_ptr<Function>& entry = entries[symbol];
+            if (entry.use_count() > 1) {
+                entry = std::make_shared<Function>(*entry);
+                if (copy) changedSymbols.push_back(symbol);
+            }
+            return *entry;
+        }
+        size_t size() const { return entries.size(); }
+        void push_back(Function function) {
+            if (copy) changedSymbols.push_back(entries.size());
+            entries.push_back(std::make_shared<Function>(std::move(function)));
+        }
+        const std::vector<size_t>& changed() const { return changedSymbols; }
+
+    private:
+        std::deque<std::shared_ptr<Function>> entries;
+        bool copy = false;
+        std::vector<size_t> changedSymbols;
+    };
+
+    // Symbol table: every name seen in code is interned to a dense index into
+    // functions when it is parsed. Call sites keep the index, so redeclaring a
+    // name (or declaring it after its first use) rebinds them without lookups.
+    // Builtins occupy the first builtinCount slots; entries stay where they
+    // are while new names are interned.
+    FunctionTable functions;
+    bool versioned = false; // Made as the next version of a shared table
+    std::unordered_map<std::string, size_t> symbols;
+    size_t builtinCount = 0;
+    size_t ifSymbol = 0;
+    size_t nandSymbol = 0;
+    size_t mapSymbol = 0;
+    size_t filterSymbol = 0;
+    size_t reduceSymbol = 0;
+    size_t sumSymbol = 0;
+    Engine engine = Engine::VM;
+
+    // Recursion limits. Both engines keep their frames on the heap and allow
+    // maxStackDepth nested calls; calls through builtins and native code
+    // recurse natively and also stop before using nativeStackBudget bytes of
+    // the C++ stack.
+    static constexpr size_t nativeStackBudget = 6 * 1024 * 1024;
+    size_t maxStackDepth = 1000000;
+
+    // Limits on each statement, enforced through a Budget (budget.h), and
+    // the count of cancel() calls, shared by the versions of a shared table
+    Limits limits;
+    std::shared_ptr<std::atomic<uint64_t>> cancellations = std::make_shared<std::atomic<uint64_t>>(0);
+
+    // State of the evaluation running on the current thread. Evaluation only
+    // reads the function table, so several threads can evaluate at once.
+    static thread_local size_t callDepth;
+    static thread_local const char* nativeStackBase;
+    static thread_local size_t nativeGaveUpAt; // Depth of the last call native code could not finish
+    static thread_local FrameArena frameArena;  // Argument frames of the tree walker
+
+    // map/filter over at least parallelThreshold elements are split into
+    // chunks that run on the pool; there is no pool with a single thread
+    size_t parallelThreshold = 10000;
+    std::shared_ptr<ThreadPool> pool;
+
+    // Calls whose arguments make expensive calls (parallelArgs) evaluate them
+    // on the pool too, while fewer than forkDepth calls deep (--fork-depth);
+    // deeper calls are already spread over the threads by their callers
+    size_t forkDepth = 0;
+
+    // Native code for scalar functions (--jit); functions without it, or
+    // calls with other arguments, are run by the engines as before
+    std::shared_ptr<JitArena> jitArena;
 
-    Function* findFunction(const std::string& name);
-    bool isSingleArgumentFunction(const std::string& functionName);
+    // Set while profiling (--profile). Calls then go through the builtins and
+    // user functions one at a time, without kernels or the thread pool.
+    std::unique_ptr<Profiler> profiler;
+
+    // Memoization of user functions, opted into per name or for all of them
+    bool memoizeAll = false;
+    size_t memoCapacity = 10000;
+    std::unordered_set<std::string> memoizedNames;
+
+    ThisFuncInterpreter(const ThisFuncInterpreter& other);
+    ThisFuncInterpreter& operator=(const ThisFuncInterpreter&) = delete;
+
+    size_t intern(const std::string& name);
+    void resolveSymbols(Node& node);
+    void lookupSymbols(Node& node) const;
+    bool markParallelCalls(Node& node) const;
+    const Function* findFunction(const std::string& name) const;
+    const Function& functionArgument(const Value& value, const std::string& builtin, size_t arity = 1);
+    void compileFunction(Function& function);
+    void compileNative(Function& function);
+    void renewSlots(const std::vector<size_t>& symbols);
+    bool callsNativeOnly(const Node& node, size_t symbol) const;
+    void settleNative(const std::vector<size_t>& symbols);
+    bool runNative(const Function& function, const Value* args, size_t count, size_t depth, Value& result);
+    const Kernel* kernelFor(const Function& function) const;
     double toDouble(const Value& value) const;
-    const std::vector<double>& toList(const Value& value) const;
+    const List& toList(const Value& value) const;
+    Value callFunction(const Function& function, Arguments args);
+    Value runFunction(const Function& function, Arguments args);
+    size_t chunkCount(size_t elements) const;
+    void runChunks(size_t begin, size_t end, size_t chunks,
+                   const std::function<void(size_t chunk, size_t from, size_t to)>& body);
+    bool forks(size_t depth) const { return pool && !profiler && depth < forkDepth; }
+    std::vector<Value> forkArguments(size_t count, size_t depth, const std::function<Value(size_t)>& argument);
+    void bindFunction(Function function);
+    void storeList(Function function, List list);
+    std::vector<size_t> dependentsOf(size_t symbol) const;
+    void invalidateDependents(size_t symbol);
+    Value loadName(size_t symbol);
+    void enterCall();
+    void nestCall();
+    void leaveCall();
+    Value evaluateNode(const Node& node, Arguments frame);
+    double evaluateScalar(const Node& body, const double* args, size_t count);
+    bool callScalar(const Function& function, const Value* args, size_t count, size_t depth, Value& result);
+    Value evaluateResolved(Node& node);
+    Value evaluatePublished(std::string_view expression);
+
+    // Image of a compiled script cache, kept while functions are still in it
+    std::shared_ptr<const void> imageOwner;
+    void materialize(size_t symbol);
+    void materialize(const Node& node);
+
+    // Checker (checker.cpp)
+    struct Inference;
+    ValueKind infer(const Node& node, ValueKind expected, Inference& inference) const;
+    ValueKind inferCall(const Node& node, ValueKind expected, Inference& inference) const;
+    void checkFunctionArgument(const Node& call, ValueKind kind, Inference& inference, size_t arity) const;
+    void inferSignatures(const std::vector<Function*>& group, bool report);
+    void inferSignatures(const std::vector<size_t>& symbols);
+    void checkExpression(const Node& node) const;
+    bool scalarBody(const Node& node, const Function& function) const;
+    void settleScalar(const std::vector<size_t>& symbols);
+    bool wellFormed(const Node& node) const;
+
+    // Optimizer (optimizer.cpp)
+    static constexpr size_t inlineLimit = 32; // Largest body, in nodes, that is inlined
+    NodePtr optimize(const NodePtr& node);
+    NodePtr inlineCall(size_t symbol, const std::vector<NodePtr>& args);
+    bool reachesItself(size_t symbol) const;
+    void optimizeDependents(size_t symbol);
+    void rebuildFunctions(const std::vector<size_t>& symbols);
+
+    // Lazy lists (pipeline.cpp)
+    static constexpr size_t firstBlock = 64;       // Source elements of a pipeline's first block
+    static constexpr size_t largestBlock = 1 << 16; // Blocks double up to this size
+    Value pipe(const Value& list, Pipeline::Stage stage) const;
+    void runBlock(const Pipeline::Definition& definition, Pipeline::Progress& progress, std::vector<double>& block,
+                  size_t limit = largestBlock);
+    void mapElements(const Function& function, std::vector<double>& block);
+    void filterElements(const Function& function, std::vector<double>& block);
+    bool produce(Pipeline& pipeline, size_t position);
+    bool lazyElement(const Value& list, size_t index, double& element);
+    void forEachBlock(const Value& list, const std::function<bool(const double* elements, size_t count)>& visit);
+    Value force(Value value);
+
+    // Bytecode engine (vm.cpp)
+    const Chunk& codeFor(const Function& function) const;
+    double popDouble(std::vector<Value>& stack) const;
+    Value runChunk(const Chunk& chunk, Arguments args);
+    double runScalar(const Chunk& chunk, const double* args, size_t count, size_t depth);
 
 public:
+    struct ProfileStats {
+        std::string name;
+        uint64_t calls;
+        uint64_t inclusiveNs;
+        uint64_t exclusiveNs;
+        size_t maxDepth;
+        uint64_t listBytes;
+    };
+
+    // Outcome of one of the expressions passed to evaluateAll
+    struct Evaluation {
+        Value value;
+        std::exception_ptr error; // Set instead of value when evaluating failed
+    };
+
+    struct MemoStats {
+        std::string name;
+        size_t hits;
+        size_t misses;
+        size_t evictions;
+        size_t entries;
+    };
+
     ThisFuncInterpreter();
-    void declareFunction(const std::string& declaration);
-    Value evaluate(const std::string& expression);
+    void setEngine(Engine engine) { this->engine = engine; }
+    void setStackSize(size_t frames) { maxStackDepth = frames; }
+    void setLimits(const Limits& limits) { this->limits = limits; }
+    // Stops the evaluations running now with "Evaluation cancelled". Safe to
+    // call from any thread and from a signal handler.
+    void cancel() { cancellations->fetch_add(1); }
+    void setThreads(size_t threads);
+    void setParallelThreshold(size_t elements) { parallelThreshold = elements; }
+    void setForkDepth(size_t depth) { forkDepth = depth; }
+    void setJit(bool enabled);
+    void setMemoizeAll(bool enabled) { memoizeAll = enabled; }
+    void setMemoCapacity(size_t entries) { memoCapacity = entries; }
+    void memoize(const std::string& name);
+    std::vector<MemoStats> memoStatistics() const;
+    void setProfiling(bool enabled);
+    std::vector<ProfileStats> profileStatistics() const;
+    void writeCollapsedStacks(std::ostream& out) const;
+    void declareFunction(std::string_view declaration);
+    void declareList(const std::string& name, std::vector<double> elements);
+    std::string optimizedBody(const std::string& name);
+    std::string signature(const std::string& name);
+
+    // Compiled form of every declaration so far, for the script cache, and
+    // loading one before anything is declared (image.cpp). owner keeps the
+    // image's bytes alive, e.g. a mapped file; without one they are copied.
+    std::string saveImage() const;
+    void loadImage(std::string_view image, std::shared_ptr<const void> owner = nullptr);
+    Value evaluate(std::string_view expression);
+    std::vector<Evaluation> evaluateAll(const std::vector<std::string_view>& expressions);
 };
 
 #endif // INTERPRETER_H
\ No newline at end of file
@@ -0,0 +1,132 @@
+#include "io.h"
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::~MappedFile() {
+    if (mapped) munmap(const_cast<char*>(data), size);
+}
+
+bool MappedFile::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void* address = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address != MAP_FAILED) {
+            madvise(address, static_cast<size_t>(info.st_size), MADV_SEQUENTIAL);
+            data = static_cast<const char*>(address);
+            size = static_cast<size_t>(info.st_size);
+            mapped = true;
+            close(fd);
+            return true;
+        }
+    }
+
+    char chunk[1 << 16];
+    while (true) {
+        ssize_t count = read(fd, chunk, sizeof(chunk));
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0) {
+            close(fd);
+            return false;
+        }
+        if (count == 0) break;
+        buffer.append(chunk, static_cast<size_t>(count));
+    }
+    close(fd);
+    data = buffer.data();
+    size = buffer.size();
+    return true;
+}
+
+Output::Output(FlushMode mode, int fd) : buffer(capacity), mode(mode), fd(fd) {
+    if (mode == FlushMode::Auto) {
+        this->mode = isatty(fd) ? FlushMode::Line : FlushMode::Batch;
+    }
+}
+
+Output::Output(std::string& target) : buffer(capacity), mode(FlushMode::Batch), fd(-1), target(&target) {}
+
+Output::~Output() {
+    flush();
+}
+
+// Returns room for bytes more characters, writing the buffer out first if needed
+char* Output::reserve(size_t bytes) {
+    if (used + bytes > buffer.size()) {
+        flush();
+        if (bytes > buffer.size()) buffer.resize(bytes);
+    }
+    return buffer.data() + used;
+}
+
+Output& Output::operator<<(std::string_view text) {
+    std::memcpy(reserve(text.size()), text.data(), text.size());
+    used += text.size();
+    return *this;
+}
+
+Output& Output::operator<<(char c) {
+    *reserve(1) = c;
+    ++used;
+    return *this;
+}
+
+Output& Output::operator<<(double number) {
+    // Six significant digits in %g style, as std::cout prints by default
+    char* start = reserve(32);
+    auto result = std::to_chars(start, start + 32, number, std::chars_format::general, 6);
+    used += static_cast<size_t>(result.ptr - start);
+    return *this;
+}
+
+Output& Output::operator<<(size_t number) {
+    char* start = reserve(24);
+    auto result = std::to_chars(start, start + 24, number);
+    used += static_cast<size_t>(result.ptr - start);
+    return *this;
+}
+
+void Output::writeResult(const Value& value) {
+    if (value.isNumber()) {
+        *this << "> " << value.number() << '\n';
+        return;
+    }
+    if (!value.isList()) {
+        throw std::runtime_error("Expected a scalar or a list, but got a function"); // Before anything is written
+    }
+    const List& list = value.list();
+    *this << "> [";
+    for (size_t i = 0; i < list.size(); ++i) {
+        if (i > 0) *this << ", ";
+        *this << list[i];
+    }
+    *this << "]\n";
+}
+
+void Output::endStatement() {
+    if (mode == FlushMode::Line) flush();
+}
+
+void Output::flush() {
+    if (target) {
+        target->append(buffer.data(), used);
+        used = 0;
+        return;
+    }
+    size_t written = 0;
+    while (written < used) {
+        ssize_t count = write(fd, buffer.data() + written, used - written);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) break; // Output closed; drop the rest like std::cout would
+        written += static_cast<size_t>(count);
+    }
+    used = 0;
+}
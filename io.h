@@ -0,0 +1,67 @@
+#ifndef IO_H
+#define IO_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include "value.h"
+
+// Read-only contents of a whole file. Regular files are memory-mapped, so
+// statements can be parsed in place; anything else (pipes, devices) is read
+// into memory.
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& path); // False when the file cannot be read
+    std::string_view contents() const { return {data, size}; }
+
+private:
+    const char* data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    std::string buffer; // Contents when not mapped
+};
+
+// When buffered output is written out
+enum class FlushMode {
+    Auto,  // Line on a terminal, Batch otherwise
+    Line,  // After every statement, for interactive use and pipes read live
+    Batch  // Only when the buffer is full and at exit
+};
+
+// Buffered writer for results. Numbers are formatted with std::to_chars like
+// std::cout would print them, straight into the buffer.
+class Output {
+public:
+    explicit Output(FlushMode mode, int fd = 1);
+    explicit Output(std::string& target); // Collects the output in target instead
+    ~Output();
+    Output(const Output&) = delete;
+    Output& operator=(const Output&) = delete;
+
+    Output& operator<<(std::string_view text);
+    Output& operator<<(char c);
+    Output& operator<<(double number);
+    Output& operator<<(size_t number);
+
+    void writeResult(const Value& value); // "> number" or "> [list, elements]" and a newline
+    void endStatement();                 // Flushes in line mode
+    void flush();
+
+private:
+    static constexpr size_t capacity = 1 << 16;
+
+    std::vector<char> buffer;
+    size_t used = 0;
+    FlushMode mode;
+    int fd;
+    std::string* target = nullptr;
+
+    char* reserve(size_t bytes);
+};
+
+#endif // IO_H
@@ -0,0 +1,457 @@
+#include "jit.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <sys/mman.h>
+#include <unistd.h>
+
+JitArena::~JitArena() {
+    for (const auto& block : blocks) {
+        munmap(block.writable, block.size);
+        munmap(const_cast<uint8_t*>(block.executable), block.size);
+    }
+}
+
+// Each block is mapped twice, writable and executable, so code is never
+// both at one address and installing it needs no system calls
+JitEntry JitArena::install(const std::vector<uint8_t>& code) {
+    if (blocks.empty() || used + code.size() > blocks.back().size) {
+        size_t size = std::max(blockSize, (code.size() + 4095) / 4096 * 4096);
+        int fd = memfd_create("thisfunc-jit", MFD_CLOEXEC);
+        if (fd < 0) return nullptr;
+        void* writable = MAP_FAILED;
+        void* executable = MAP_FAILED;
+        if (ftruncate(fd, static_cast<off_t>(size)) == 0) {
+            writable = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            executable = mmap(nullptr, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (writable == MAP_FAILED || executable == MAP_FAILED) {
+            if (writable != MAP_FAILED) munmap(writable, size);
+            if (executable != MAP_FAILED) munmap(executable, size);
+            return nullptr;
+        }
+        blocks.push_back({static_cast<uint8_t*>(writable), static_cast<const uint8_t*>(executable), size});
+        used = 0;
+    }
+    Block& block = blocks.back();
+    std::memcpy(block.writable + used, code.data(), code.size());
+    auto entry = reinterpret_cast<JitEntry>(block.executable + used);
+    used += (code.size() + 15) / 16 * 16;
+    return entry;
+}
+
+size_t jitArguments(const Node& body) {
+    std::vector<size_t> placeholders;
+    collectPlaceholders(body, placeholders);
+    size_t count = 0;
+    for (size_t placeholder : placeholders) {
+        count = std::max(count, placeholder + 1);
+    }
+    return count;
+}
+
+#if defined(__x86_64__)
+
+namespace {
+
+enum class Scalar { Add, Sub, Mul, Div, Pow, Sqrt, Sin, Cos, Eq, Le };
+
+struct ScalarBuiltin {
+    Scalar op;
+    size_t argc;
+};
+
+const std::unordered_map<std::string, ScalarBuiltin> scalarBuiltins = {
+    {"add", {Scalar::Add, 2}}, {"sub", {Scalar::Sub, 2}}, {"mul", {Scalar::Mul, 2}},
+    {"div", {Scalar::Div, 2}}, {"pow", {Scalar::Pow, 2}}, {"sqrt", {Scalar::Sqrt, 1}},
+    {"sin", {Scalar::Sin, 1}}, {"cos", {Scalar::Cos, 1}}, {"eq", {Scalar::Eq, 2}},
+    {"le", {Scalar::Le, 2}}
+};
+
+constexpr size_t maxArguments = 256;
+constexpr uint8_t callsLeftOffset = offsetof(JitContext, callsLeft);
+constexpr uint8_t stackLimitOffset = offsetof(JitContext, stackLimit);
+constexpr uint8_t stepsLeftOffset = offsetof(JitContext, stepsLeft);
+constexpr uint8_t resumeOffset = offsetof(JitContext, resume);
+static_assert(offsetof(JitContext, error) == 0, "errors are stored through [rbx]");
+
+double (*const powFunction)(double, double) = std::pow;
+double (*const sinFunction)(double) = std::sin;
+double (*const cosFunction)(double) = std::cos;
+
+// Emits a function with the System V calling convention: args in rdi, the
+// context in rsi, the result in xmm0. The context stays in rbx and args in
+// r12; values are computed into xmm0 and kept in rbp-relative slots while
+// another operand is computed, so nothing lives in registers across calls.
+class Compiler {
+public:
+    Compiler(size_t symbol, size_t builtinCount, size_t arguments,
+             const std::function<const JitEntry*(size_t, size_t)>& calleeEntry)
+        : symbol(symbol), builtinCount(builtinCount), arguments(arguments), calleeEntry(calleeEntry) {}
+
+    bool compileFunction(const Node& body) {
+        bind(entry);
+        emit({0x55});                         // push rbp
+        emit({0x48, 0x89, 0xE5});             // mov rbp, rsp
+        emit({0x53});                         // push rbx
+        emit({0x41, 0x54});                   // push r12
+        emit({0x48, 0x81, 0xEC});             // sub rsp, frame size
+        size_t frameSize = code.size();
+        emit32(0);
+        emit({0x48, 0x89, 0xF3});             // mov rbx, rsi
+        emit({0x49, 0x89, 0xFC});             // mov r12, rdi
+
+        // Out of calls or stack: the interpreter redoes the call
+        emit({0x48, 0x83, 0x7B, callsLeftOffset, 0x00}); // cmp qword [rbx + callsLeft], 0
+        jump(0x84, fallback);                             // je
+        emit({0x48, 0xFF, 0x4B, callsLeftOffset});       // dec qword [rbx + callsLeft]
+        emit({0x48, 0x3B, 0x63, stackLimitOffset});      // cmp rsp, [rbx + stackLimit]
+        jump(0x82, fallback);                             // jb
+
+        // Slots [0, arguments) receive the arguments of tail calls to itself
+        nextSlot = slotCount = arguments;
+        bind(start);
+
+        // Every call and tail call is a step; the interpreter checks the
+        // budget when they run out. Nothing is live in registers here but
+        // rbx and r12, and the stack is aligned for the call.
+        size_t counted = newLabel();
+        emit({0x48, 0xFF, 0x4B, stepsLeftOffset});       // dec qword [rbx + stepsLeft]
+        jump(0x85, counted);                              // jne
+        emit({0x48, 0x89, 0xDF});                         // mov rdi, rbx
+        emit({0xFF, 0x53, resumeOffset});                 // call [rbx + resume]
+        emit({0x84, 0xC0});                               // test al, al
+        jump(0x84, stopped);                              // je
+        bind(counted);
+
+        if (!compile(body, true)) return false;
+        emit({0x48, 0xFF, 0x43, callsLeftOffset});       // inc qword [rbx + callsLeft]
+
+        bind(leave);
+        emit({0x48, 0x8D, 0x65, 0xF0});       // lea rsp, [rbp - 16]
+        emit({0x41, 0x5C});                   // pop r12
+        emit({0x5B});                         // pop rbx
+        emit({0x5D});                         // pop rbp
+        emit({0xC3});                         // ret
+
+        raise(divisionByZero, JitError::DivisionByZero);
+        raise(negativeSqrt, JitError::NegativeSqrt);
+        raise(fallback, JitError::Fallback);
+        raise(stopped, JitError::Stopped);
+
+        int32_t frame = static_cast<int32_t>((slotCount * 8 + 15) / 16 * 16);
+        std::memcpy(&code[frameSize], &frame, sizeof(frame));
+        for (const auto& patch : patches) {
+            int32_t offset = static_cast<int32_t>(labels[patch.label] - (patch.at + 4));
+            std::memcpy(&code[patch.at], &offset, sizeof(offset));
+        }
+        return true;
+    }
+
+    const std::vector<uint8_t>& machineCode() const { return code; }
+
+private:
+    struct Patch {
+        size_t at;
+        size_t label;
+    };
+
+    size_t symbol;
+    size_t builtinCount;
+    size_t arguments;
+    const std::function<const JitEntry*(size_t, size_t)>& calleeEntry;
+    std::vector<uint8_t> code;
+    std::vector<size_t> labels;
+    std::vector<Patch> patches;
+    size_t nextSlot = 0;
+    size_t slotCount = 0;
+    size_t entry = newLabel();
+    size_t start = newLabel();
+    size_t leave = newLabel();
+    size_t divisionByZero = newLabel();
+    size_t negativeSqrt = newLabel();
+    size_t fallback = newLabel();
+    size_t stopped = newLabel();
+
+    // Leaves the value of node in xmm0; false when node cannot be compiled
+    bool compile(const Node& node, bool tail) {
+        switch (node.kind) {
+        case Node::Kind::Number:
+            loadConstant(node.number);
+            return true;
+
+        case Node::Kind::Placeholder:
+            emit({0xF2, 0x41, 0x0F, 0x10, 0x84, 0x24}); // movsd xmm0, [r12 + disp32]
+            emit32(static_cast<int32_t>(node.index * 8));
+            return true;
+
+        case Node::Kind::Name:
+            return false;
+
+        case Node::Kind::Call:
+            break;
+        }
+
+        if (node.symbol >= builtinCount) return compileUserCall(node, tail);
+
+        if (node.name == "if" && node.args.size() == 3) {
+            size_t otherwise = newLabel();
+            size_t end = newLabel();
+            if (!compile(*node.args[0], false)) return false;
+            branchIfFalse(otherwise);
+            if (!compile(*node.args[1], tail)) return false;
+            jump(0, end);
+            bind(otherwise);
+            if (!compile(*node.args[2], tail)) return false;
+            bind(end);
+            return true;
+        }
+
+        if (node.name == "nand" && node.args.size() == 2) {
+            // nand(a, b) is 1 when a is false, otherwise b == 0
+            size_t one = newLabel();
+            size_t end = newLabel();
+            if (!compile(*node.args[0], false)) return false;
+            branchIfFalse(one);
+            if (!compile(*node.args[1], false)) return false;
+            emit({0x66, 0x0F, 0x57, 0xC9});       // xorpd xmm1, xmm1
+            compareAndMask(0);
+            jump(0, end);
+            bind(one);
+            loadConstant(1.0);
+            bind(end);
+            return true;
+        }
+
+        auto scalar = scalarBuiltins.find(node.name);
+        if (scalar == scalarBuiltins.end() || scalar->second.argc != node.args.size()) return false;
+
+        if (node.args.size() == 1) {
+            if (!compile(*node.args[0], false)) return false;
+            switch (scalar->second.op) {
+            case Scalar::Sqrt:
+                emit({0x66, 0x0F, 0x57, 0xC9});   // xorpd xmm1, xmm1
+                emit({0x66, 0x0F, 0x2E, 0xC8});   // ucomisd xmm1, xmm0
+                jump(0x87, negativeSqrt);         // ja: x < 0, NaN passes
+                emit({0xF2, 0x0F, 0x51, 0xC0});   // sqrtsd xmm0, xmm0
+                return true;
+            case Scalar::Sin:
+                callAddress(reinterpret_cast<uint64_t>(sinFunction));
+                return true;
+            default:
+                callAddress(reinterpret_cast<uint64_t>(cosFunction));
+                return true;
+            }
+        }
+
+        // Left operand in a slot while the right one is computed, then a in
+        // xmm0 and b in xmm1
+        if (!compile(*node.args[0], false)) return false;
+        size_t left = takeSlots(1);
+        storeSlot(left);
+        if (!compile(*node.args[1], false)) return false;
+        nextSlot = left;
+        emit({0x66, 0x0F, 0x28, 0xC8});           // movapd xmm1, xmm0
+        emit({0xF2, 0x0F, 0x10, 0x85});           // movsd xmm0, [rbp + slot]
+        emit32(slotOffset(left));
+
+        switch (scalar->second.op) {
+        case Scalar::Add: emit({0xF2, 0x0F, 0x58, 0xC1}); break; // addsd xmm0, xmm1
+        case Scalar::Sub: emit({0xF2, 0x0F, 0x5C, 0xC1}); break; // subsd xmm0, xmm1
+        case Scalar::Mul: emit({0xF2, 0x0F, 0x59, 0xC1}); break; // mulsd xmm0, xmm1
+        case Scalar::Div: {
+            size_t nonZero = newLabel();
+            emit({0x66, 0x0F, 0x57, 0xD2});       // xorpd xmm2, xmm2
+            emit({0x66, 0x0F, 0x2E, 0xCA});       // ucomisd xmm1, xmm2
+            jump(0x8A, nonZero);                  // jp: NaN is not zero
+            jump(0x84, divisionByZero);           // je
+            bind(nonZero);
+            emit({0xF2, 0x0F, 0x5E, 0xC1});       // divsd xmm0, xmm1
+            break;
+        }
+        case Scalar::Pow: callAddress(reinterpret_cast<uint64_t>(powFunction)); break;
+        case Scalar::Eq: compareAndMask(0); break;
+        case Scalar::Le: compareAndMask(2); break;
+        default: return false;
+        }
+        return true;
+    }
+
+    // Arguments go into consecutive slots, the first at the lowest address,
+    // which is what the callee gets as its args pointer
+    bool compileUserCall(const Node& node, bool tail) {
+        size_t argc = node.args.size();
+        bool self = node.symbol == symbol;
+        const JitEntry* target = nullptr;
+        if (self) {
+            if (argc < arguments) return false;
+        } else if (!(target = calleeEntry(node.symbol, argc))) {
+            return false;
+        }
+
+        size_t base = takeSlots(argc);
+        for (size_t i = 0; i < argc; ++i) {
+            if (!compile(*node.args[i], false)) return false;
+            storeSlot(base + argc - 1 - i);
+        }
+
+        if (self && tail) {
+            // Start over with the new arguments in the slots kept for them
+            for (size_t i = 0; i < arguments; ++i) {
+                emit({0xF2, 0x0F, 0x10, 0x85});   // movsd xmm0, [rbp + slot]
+                emit32(slotOffset(base + argc - 1 - i));
+                storeSlot(arguments - 1 - i);
+            }
+            if (arguments > 0) {
+                emit({0x4C, 0x8D, 0xA5});         // lea r12, [rbp + slot]
+                emit32(slotOffset(arguments - 1));
+            }
+            nextSlot = base;
+            jump(0, start);
+            return true;
+        }
+
+        if (argc > 0) {
+            emit({0x48, 0x8D, 0xBD});             // lea rdi, [rbp + slot]
+            emit32(slotOffset(base + argc - 1));
+        } else {
+            emit({0x4C, 0x89, 0xE7});             // mov rdi, r12
+        }
+        emit({0x48, 0x89, 0xDE});                 // mov rsi, rbx
+        if (self) {
+            jump(0xE8, entry);                    // call rel32
+        } else {
+            emit({0x48, 0xB8});                   // mov rax, imm64
+            emit64(reinterpret_cast<uint64_t>(target));
+            emit({0xFF, 0x10});                   // call [rax]
+        }
+        emit({0x83, 0x3B, 0x00});                 // cmp dword [rbx], 0
+        jump(0x85, leave);                        // jne: the callee failed
+        nextSlot = base;
+        return true;
+    }
+
+    // Jumps to label when xmm0 == 0; NaN counts as true, as in the interpreter
+    void branchIfFalse(size_t label) {
+        size_t isTrue = newLabel();
+        emit({0x66, 0x0F, 0x57, 0xC9});           // xorpd xmm1, xmm1
+        emit({0x66, 0x0F, 0x2E, 0xC1});           // ucomisd xmm0, xmm1
+        jump(0x8A, isTrue);                       // jp
+        jump(0x84, label);                        // je
+        bind(isTrue);
+    }
+
+    // xmm0 = (xmm0 <predicate> xmm1) ? 1.0 : 0.0
+    void compareAndMask(uint8_t predicate) {
+        emit({0xF2, 0x0F, 0xC2, 0xC1, predicate}); // cmpsd xmm0, xmm1, predicate
+        emit({0x48, 0xB8});                        // mov rax, 1.0
+        emit64(bitsOf(1.0));
+        emit({0x66, 0x48, 0x0F, 0x6E, 0xC8});      // movq xmm1, rax
+        emit({0x66, 0x0F, 0x54, 0xC1});            // andpd xmm0, xmm1
+    }
+
+    void loadConstant(double value) {
+        emit({0x48, 0xB8});                       // mov rax, imm64
+        emit64(bitsOf(value));
+        emit({0x66, 0x48, 0x0F, 0x6E, 0xC0});     // movq xmm0, rax
+    }
+
+    void callAddress(uint64_t address) {
+        emit({0x48, 0xB8});                       // mov rax, imm64
+        emit64(address);
+        emit({0xFF, 0xD0});                       // call rax
+    }
+
+    void raise(size_t label, JitError error) {
+        bind(label);
+        emit({0xC7, 0x03});                       // mov dword [rbx], error
+        emit32(static_cast<int32_t>(error));
+        jump(0, leave);
+    }
+
+    size_t takeSlots(size_t count) {
+        size_t first = nextSlot;
+        nextSlot += count;
+        slotCount = std::max(slotCount, nextSlot);
+        return first;
+    }
+
+    void storeSlot(size_t slot) {
+        emit({0xF2, 0x0F, 0x11, 0x85});           // movsd [rbp + slot], xmm0
+        emit32(slotOffset(slot));
+    }
+
+    // Slots lie below the saved rbx and r12
+    static int32_t slotOffset(size_t slot) {
+        return -24 - static_cast<int32_t>(slot * 8);
+    }
+
+    static uint64_t bitsOf(double value) {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+
+    size_t newLabel() {
+        labels.push_back(0);
+        return labels.size() - 1;
+    }
+
+    void bind(size_t label) {
+        labels[label] = code.size();
+    }
+
+    // opcode 0 is jmp, 0xE8 call, anything else the second byte of a jcc
+    void jump(uint8_t opcode, size_t label) {
+        if (opcode == 0) {
+            emit({0xE9});
+        } else if (opcode == 0xE8) {
+            emit({0xE8});
+        } else {
+            emit({0x0F, opcode});
+        }
+        patches.push_back({code.size(), label});
+        emit32(0);
+    }
+
+    void emit(std::initializer_list<uint8_t> bytes) {
+        code.insert(code.end(), bytes);
+    }
+
+    void emit32(int32_t value) {
+        uint8_t bytes[4];
+        std::memcpy(bytes, &value, sizeof(bytes));
+        code.insert(code.end(), bytes, bytes + 4);
+    }
+
+    void emit64(uint64_t value) {
+        uint8_t bytes[8];
+        std::memcpy(bytes, &value, sizeof(bytes));
+        code.insert(code.end(), bytes, bytes + 8);
+    }
+};
+
+} // namespace
+
+JitEntry compileJit(const Node& body, size_t symbol, size_t builtinCount,
+                    const std::function<const JitEntry*(size_t symbol, size_t argc)>& calleeEntry,
+                    JitArena& arena) {
+    // Each argument index the body reads takes a slot in every frame
+    size_t arguments = jitArguments(body);
+    if (arguments > maxArguments) return nullptr;
+    Compiler compiler(symbol, builtinCount, arguments, calleeEntry);
+    if (!compiler.compileFunction(body)) return nullptr;
+    return arena.install(compiler.machineCode());
+}
+
+#else
+
+JitEntry compileJit(const Node&, size_t, size_t, const std::function<const JitEntry*(size_t, size_t)>&, JitArena&) {
+    return nullptr;
+}
+
+#endif
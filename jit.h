@@ -0,0 +1,78 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <vector>
+#include "parser.h"
+
+// Native x86-64 code for user functions that only compute with scalars
+// (--jit). Arguments and intermediate values stay unboxed doubles; calls go
+// straight to the callee's code, and a call of the function itself in tail
+// position becomes a jump. Native code cannot throw, so errors are reported
+// through the context and each call returns early once one is set.
+
+// What stopped native code; Fallback means the call has to be redone by the
+// interpreter, which then reports the stack overflow or gets further, and
+// Stopped that the statement's budget (budget.h) ran out.
+enum class JitError : int32_t {
+    None,
+    DivisionByZero,
+    NegativeSqrt,
+    Fallback,
+    Stopped
+};
+
+// State shared by the native calls of one entry from the interpreter
+struct JitContext {
+    JitError error = JitError::None;
+    uint64_t callsLeft = 0;  // Nested calls allowed before falling back
+    uintptr_t stackLimit = 0; // Falls back when the stack grows below this
+    uint64_t stepsLeft = 0;  // Counted down by every call and tail call
+    bool (*resume)(JitContext* context) = nullptr; // Called when stepsLeft hits zero; false stops
+};
+
+using JitEntry = double (*)(const double* args, JitContext* context);
+
+// Executable memory for compiled functions, and the slots through which
+// native code calls other functions. Only one thread at a time adds to it,
+// and what other threads may be running is never written again: slots are
+// filled before the functions they belong to can be called. Everything is
+// freed with the arena, never piecemeal.
+class JitArena {
+public:
+    JitArena() = default;
+    ~JitArena();
+    JitArena(const JitArena&) = delete;
+    JitArena& operator=(const JitArena&) = delete;
+
+    JitEntry install(const std::vector<uint8_t>& code);
+    JitEntry* slot() { return &slots.emplace_back(nullptr); }
+
+private:
+    std::deque<JitEntry> slots;
+    struct Block {
+        uint8_t* writable;
+        const uint8_t* executable; // The same memory
+        size_t size;
+    };
+    static constexpr size_t blockSize = 1 << 16;
+    std::vector<Block> blocks;
+    size_t used = 0; // Bytes taken in the last block
+};
+
+// Number of arguments a body reads: its highest placeholder plus one
+size_t jitArguments(const Node& body);
+
+// Compiles the body of user function symbol. calleeEntry(symbol, argc) gives
+// the address the entry of another user function will be kept at, or null
+// when it cannot be called natively with argc arguments. Returns null when
+// the body uses anything but numbers, placeholders, the scalar builtins, if,
+// nand and such calls, or on targets other than x86-64.
+JitEntry compileJit(const Node& body, size_t symbol, size_t builtinCount,
+                    const std::function<const JitEntry*(size_t symbol, size_t argc)>& calleeEntry,
+                    JitArena& arena);
+
+#endif // JIT_H
@@ -0,0 +1,183 @@
+#include "kernel.h"
+#include "kernel_simd.h"
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+// AVX2 back end, compiled for that target in kernel_avx2.cpp
+bool runKernelBlockAvx2(const KernelInstruction* code, size_t length, double* regs,
+                        const double* input, size_t count, double* out);
+#endif
+
+namespace {
+
+struct ScalarTraits {
+    using V = double;
+    static constexpr size_t width = 1;
+    static V load(const double* p) { return *p; }
+    static void store(double* p, V v) { *p = v; }
+    static V add(V a, V b) { return a + b; }
+    static V sub(V a, V b) { return a - b; }
+    static V mul(V a, V b) { return a * b; }
+    static V div(V a, V b) { return a / b; }
+    static V sqrt(V a) { return std::sqrt(a); }
+    static V eq(V a, V b) { return a == b ? 1.0 : 0.0; }
+    static V le(V a, V b) { return a <= b ? 1.0 : 0.0; }
+    static V nand(V a, V b) { return (a == 0 || b == 0) ? 1.0 : 0.0; }
+    static V select(V c, V a, V b) { return c != 0 ? a : b; }
+};
+
+#if defined(__SSE2__)
+struct Sse2Traits {
+    using V = __m128d;
+    static constexpr size_t width = 2;
+    static V load(const double* p) { return _mm_loadu_pd(p); }
+    static void store(double* p, V v) { _mm_storeu_pd(p, v); }
+    static V add(V a, V b) { return _mm_add_pd(a, b); }
+    static V sub(V a, V b) { return _mm_sub_pd(a, b); }
+    static V mul(V a, V b) { return _mm_mul_pd(a, b); }
+    static V div(V a, V b) { return _mm_div_pd(a, b); }
+    static V sqrt(V a) { return _mm_sqrt_pd(a); }
+    // Comparisons yield all-ones lanes; masking 1.0 with them gives 1.0 / 0.0
+    static V eq(V a, V b) { return _mm_and_pd(_mm_cmpeq_pd(a, b), _mm_set1_pd(1.0)); }
+    static V le(V a, V b) { return _mm_and_pd(_mm_cmple_pd(a, b), _mm_set1_pd(1.0)); }
+    static V nand(V a, V b) {
+        V zero = _mm_setzero_pd();
+        return _mm_and_pd(_mm_or_pd(_mm_cmpeq_pd(a, zero), _mm_cmpeq_pd(b, zero)), _mm_set1_pd(1.0));
+    }
+    static V select(V c, V a, V b) {
+        V mask = _mm_cmpneq_pd(c, _mm_setzero_pd()); // NaN counts as true, like c != 0
+        return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b));
+    }
+};
+#endif
+
+using BlockRunner = bool (*)(const KernelInstruction*, size_t, double*, const double*, size_t, double*);
+
+// Picks the widest back end the CPU supports
+BlockRunner selectBlockRunner() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return runKernelBlockAvx2;
+#endif
+#if defined(__SSE2__)
+    return kernel_simd::runBlock<Sse2Traits>;
+#else
+    return kernel_simd::runBlock<ScalarTraits>;
+#endif
+}
+
+const BlockRunner blockRunner = selectBlockRunner();
+
+struct KernelBuiltin {
+    KernelOp op;
+    size_t argc;
+};
+
+const std::unordered_map<std::string, KernelBuiltin> kernelBuiltins = {
+    {"add", {KernelOp::Add, 2}}, {"sub", {KernelOp::Sub, 2}}, {"mul", {KernelOp::Mul, 2}},
+    {"div", {KernelOp::Div, 2}}, {"pow", {KernelOp::Pow, 2}}, {"sqrt", {KernelOp::Sqrt, 1}},
+    {"sin", {KernelOp::Sin, 1}}, {"cos", {KernelOp::Cos, 1}}, {"eq", {KernelOp::Eq, 2}},
+    {"le", {KernelOp::Le, 2}}, {"nand", {KernelOp::Nand, 2}}, {"if", {KernelOp::Select, 3}}
+};
+
+// Whether evaluating node can raise an error. The kernel evaluates every
+// argument, so lazily evaluated ones (if branches, the second argument of
+// nand) must not be able to fail.
+bool canFail(const Node& node) {
+    if (node.kind == Node::Kind::Call && (node.name == "div" || node.name == "sqrt")) return true;
+    for (const auto& arg : node.args) {
+        if (canFail(*arg)) return true;
+    }
+    return false;
+}
+
+class KernelCompiler {
+public:
+    explicit KernelCompiler(std::vector<KernelInstruction>& code) : code(code) {}
+
+    // Returns the register holding the node's value, or -1 if unsupported
+    int compile(const Node& node) {
+        switch (node.kind) {
+        case Node::Kind::Number:
+            return emit({KernelOp::Const, 0, 0, 0, 0, node.number});
+
+        case Node::Kind::Placeholder:
+            if (node.index != 0) return -1;
+            return emit({KernelOp::Arg, 0});
+
+        case Node::Kind::Name:
+            return -1;
+
+        case Node::Kind::Call:
+            break;
+        }
+
+        auto builtin = kernelBuiltins.find(node.name);
+        if (builtin == kernelBuiltins.end() || builtin->second.argc != node.args.size()) return -1;
+        if (builtin->second.op == KernelOp::Nand && canFail(*node.args[1])) return -1;
+        if (builtin->second.op == KernelOp::Select && (canFail(*node.args[1]) || canFail(*node.args[2]))) return -1;
+
+        int operands[3] = {0, 0, 0};
+        for (size_t i = 0; i < node.args.size(); ++i) {
+            operands[i] = compile(*node.args[i]);
+            if (operands[i] < 0) return -1;
+        }
+        return emit({builtin->second.op, 0, static_cast<uint8_t>(operands[0]),
+                     static_cast<uint8_t>(operands[1]), static_cast<uint8_t>(operands[2]), 0});
+    }
+
+private:
+    std::vector<KernelInstruction>& code;
+
+    // Every instruction gets its own register
+    int emit(KernelInstruction instruction) {
+        if (code.size() >= Kernel::maxRegisters) return -1;
+        instruction.dst = static_cast<uint8_t>(code.size());
+        code.push_back(instruction);
+        return instruction.dst;
+    }
+};
+
+} // namespace
+
+std::shared_ptr<const Kernel> Kernel::compile(const Node& body) {
+    auto kernel = std::make_shared<Kernel>();
+    KernelCompiler compiler(kernel->code);
+    if (compiler.compile(body) < 0) {
+        return nullptr;
+    }
+    kernel->registers = kernel->code.size();
+    return kernel;
+}
+
+size_t Kernel::map(const double* input, size_t count, double* output) const {
+    std::vector<double> regs(registers * blockSize);
+    for (size_t start = 0; start < count; start += blockSize) {
+        size_t length = std::min(blockSize, count - start);
+        if (!blockRunner(code.data(), code.size(), regs.data(), input + start, length, output + start)) {
+            return start;
+        }
+    }
+    return count;
+}
+
+size_t Kernel::filter(const double* input, size_t count, std::vector<double>& output) const {
+    std::vector<double> regs(registers * blockSize);
+    const double* predicate = regs.data() + code.back().dst * blockSize;
+    for (size_t start = 0; start < count; start += blockSize) {
+        size_t length = std::min(blockSize, count - start);
+        if (!blockRunner(code.data(), code.size(), regs.data(), input + start, length, nullptr)) {
+            return start;
+        }
+        for (size_t k = 0; k < length; ++k) {
+            if (predicate[k] != 0) output.push_back(input[start + k]);
+        }
+    }
+    return count;
+}
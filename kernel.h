@@ -0,0 +1,46 @@
+#ifndef KERNEL_H
+#define KERNEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "parser.h"
+
+// Straight-line arithmetic over a single argument (#0), compiled from a
+// function body so map/filter can evaluate it over whole blocks of a list
+// with SIMD instructions instead of calling the function once per element.
+enum class KernelOp : uint8_t {
+    Const, Arg, Add, Sub, Mul, Div, Pow, Sqrt, Sin, Cos, Eq, Le, Nand, Select
+};
+
+struct KernelInstruction {
+    KernelOp op;
+    uint8_t dst;
+    uint8_t a = 0;
+    uint8_t b = 0;
+    uint8_t c = 0;
+    double constant = 0;
+};
+
+class Kernel {
+public:
+    static constexpr size_t blockSize = 512;
+    static constexpr size_t maxRegisters = 32;
+
+    // Returns nullptr when the body uses anything but #0, numbers and the
+    // scalar builtins, or when a lazily evaluated argument could raise an error
+    static std::shared_ptr<const Kernel> compile(const Node& body);
+
+    // Both return how many leading elements were processed. Processing stops
+    // at the first block in which some element raises an error, so the caller
+    // can redo the rest element by element and report the exact error.
+    size_t map(const double* input, size_t count, double* output) const;
+    size_t filter(const double* input, size_t count, std::vector<double>& output) const;
+
+private:
+    std::vector<KernelInstruction> code;
+    size_t registers = 0;
+};
+
+#endif // KERNEL_H
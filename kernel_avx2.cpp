@@ -0,0 +1,56 @@
+// AVX2 back end for map/filter kernels. Standard headers are included before
+// switching the target so that no inline library code is compiled for AVX2;
+// only code reached through runKernelBlockAvx2 uses AVX instructions, and it
+// is only selected when the CPU supports them.
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+// Vector values only cross function boundaries inside this file, never
+// between code compiled for different targets
+#pragma GCC diagnostic ignored "-Wpsabi"
+#include <immintrin.h>
+#include "kernel_simd.h"
+
+namespace {
+
+struct Avx2Traits {
+    using V = __m256d;
+    static constexpr size_t width = 4;
+    static V load(const double* p) { return _mm256_loadu_pd(p); }
+    static void store(double* p, V v) { _mm256_storeu_pd(p, v); }
+    static V add(V a, V b) { return _mm256_add_pd(a, b); }
+    static V sub(V a, V b) { return _mm256_sub_pd(a, b); }
+    static V mul(V a, V b) { return _mm256_mul_pd(a, b); }
+    static V div(V a, V b) { return _mm256_div_pd(a, b); }
+    static V sqrt(V a) { return _mm256_sqrt_pd(a); }
+    // Comparisons yield all-ones lanes; masking 1.0 with them gives 1.0 / 0.0
+    static V eq(V a, V b) { return _mm256_and_pd(_mm256_cmp_pd(a, b, _CMP_EQ_OQ), _mm256_set1_pd(1.0)); }
+    static V le(V a, V b) { return _mm256_and_pd(_mm256_cmp_pd(a, b, _CMP_LE_OQ), _mm256_set1_pd(1.0)); }
+    static V nand(V a, V b) {
+        V zero = _mm256_setzero_pd();
+        V either = _mm256_or_pd(_mm256_cmp_pd(a, zero, _CMP_EQ_OQ), _mm256_cmp_pd(b, zero, _CMP_EQ_OQ));
+        return _mm256_and_pd(either, _mm256_set1_pd(1.0));
+    }
+    static V select(V c, V a, V b) {
+        V mask = _mm256_cmp_pd(c, _mm256_setzero_pd(), _CMP_NEQ_UQ); // NaN counts as true, like c != 0
+        return _mm256_blendv_pd(b, a, mask);
+    }
+};
+
+} // namespace
+
+bool runKernelBlockAvx2(const KernelInstruction* code, size_t length, double* regs,
+                        const double* input, size_t count, double* out) {
+    return kernel_simd::runBlock<Avx2Traits>(code, length, regs, input, count, out);
+}
+
+#pragma GCC pop_options
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef KERNEL_SIMD_H
+#define KERNEL_SIMD_H
+
+// Block evaluator shared by the kernel back ends. Each translation unit
+// instantiates runBlock with its own vector traits (see kernel.cpp and
+// kernel_avx2.cpp); traits provide a vector type V of width lanes.
+
+#include <cmath>
+#include <cstring>
+#include "kernel.h"
+
+namespace kernel_simd {
+
+// dst[k] = op(a[k], b[k], c[k]) for k < limit: whole vectors first, then
+// the lanes that do not fill a vector
+template <class T, class VectorOp, class ScalarOp>
+inline void apply(double* dst, const double* a, const double* b, const double* c, size_t limit,
+                  VectorOp vectorOp, ScalarOp scalarOp) {
+    const size_t vectorEnd = limit / T::width * T::width;
+    size_t k = 0;
+    for (; k < vectorEnd; k += T::width) {
+        T::store(dst + k, vectorOp(T::load(a + k), T::load(b + k), T::load(c + k)));
+    }
+    for (; k < limit; ++k) {
+        dst[k] = scalarOp(a[k], b[k], c[k]);
+    }
+}
+
+// Evaluates code over count elements. Registers are blockSize-long arrays in
+// regs; the last instruction writes into out when it is not null. Lanes past
+// count hold padding and never cause errors. Returns false if an element
+// divides by zero or takes the square root of a negative number.
+template <class T>
+bool runBlock(const KernelInstruction* code, size_t length, double* regs,
+              const double* input, size_t count, double* out) {
+    using V = typename T::V;
+    const size_t lanes = (count + T::width - 1) / T::width * T::width;
+
+    for (size_t i = 0; i < length; ++i) {
+        const KernelInstruction& ins = code[i];
+        double* dst = (i + 1 == length && out) ? out : regs + ins.dst * Kernel::blockSize;
+        const double* a = regs + ins.a * Kernel::blockSize;
+        const double* b = regs + ins.b * Kernel::blockSize;
+        const double* c = regs + ins.c * Kernel::blockSize;
+
+        // The output buffer only has room for count elements
+        const size_t limit = dst == out ? count : lanes;
+
+        switch (ins.op) {
+        case KernelOp::Const:
+            for (size_t k = 0; k < limit; ++k) dst[k] = ins.constant;
+            break;
+
+        case KernelOp::Arg:
+            std::memcpy(dst, input, count * sizeof(double));
+            for (size_t k = count; k < limit; ++k) dst[k] = 1.0; // Padding
+            break;
+
+        case KernelOp::Add:
+            apply<T>(dst, a, b, c, limit, [](V x, V y, V) { return T::add(x, y); },
+                     [](double x, double y, double) { return x + y; });
+            break;
+
+        case KernelOp::Sub:
+            apply<T>(dst, a, b, c, limit, [](V x, V y, V) { return T::sub(x, y); },
+                     [](double x, double y, double) { return x - y; });
+            break;
+
+        case KernelOp::Mul:
+            apply<T>(dst, a, b, c, limit, [](V x, V y, V) { return T::mul(x, y); },
+                     [](double x, double y, double) { return x * y; });
+            break;
+
+        case KernelOp::Div:
+            for (size_t k = 0; k < count; ++k) {
+                if (b[k] == 0) return false;
+            }
+            apply<T>(dst, a, b, c, limit, [](V x, V y, V) { return T::div(x, y); },
+                     [](double x, double y, double) { return x / y; });
+            break;
+
+        case KernelOp::Sqrt:
+            for (size_t k = 0; k < count; ++k) {
+                if (a[k] < 0) return false;
+            }
+            apply<T>(dst, a, b, c, limit, [](V x, V, V) { return T::sqrt(x); },
+                     [](double x, double, double) { return std::sqrt(x); });
+            break;
+
+        case KernelOp::Eq:
+            apply<T>(dst, a, b, c, limit, [](V x, V y, V) { return T::eq(x, y); },
+                     [](double x, double y, double) { return x == y ? 1.0 : 0.0; });
+            break;
+
+        case KernelOp::Le:
+            apply<T>(dst, a, b, c, limit, [](V x, V y, V) { return T::le(x, y); },
+                     [](double x, double y, double) { return x <= y ? 1.0 : 0.0; });
+            break;
+
+        case KernelOp::Nand:
+            apply<T>(dst, a, b, c, limit, [](V x, V y, V) { return T::nand(x, y); },
+                     [](double x, double y, double) { return (x == 0 || y == 0) ? 1.0 : 0.0; });
+            break;
+
+        case KernelOp::Select:
+            apply<T>(dst, a, b, c, limit, [](V x, V y, V z) { return T::select(x, y, z); },
+                     [](double x, double y, double z) { return x != 0 ? y : z; });
+            break;
+
+        // No vector instructions for these; still cheaper than a call per element
+        case KernelOp::Pow:
+            for (size_t k = 0; k < limit; ++k) dst[k] = std::pow(a[k], b[k]);
+            break;
+
+        case KernelOp::Sin:
+            for (size_t k = 0; k < limit; ++k) dst[k] = std::sin(a[k]);
+            break;
+
+        case KernelOp::Cos:
+            for (size_t k = 0; k < limit; ++k) dst[k] = std::cos(a[k]);
+            break;
+        }
+    }
+    return true;
+}
+
+} // namespace kernel_simd
+
+#endif // KERNEL_SIMD_H
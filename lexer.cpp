@@ -1,4 +1,116 @@
 #include "lexer.h"
+#include <cctype>
+#include <cstdlib>
+#include <stdexcept>
+
+static bool isNameStart(char c) {
+    return std::isalpha(static_cast<unsigned char>(c)) || c == '_';
+}
+
+static bool isNameChar(char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+static bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// Characters strtod may consume as part of a number (signs, exponents, hex
+// digits, inf and nan)
+static bool isNumberChar(char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '.' || c == '+' || c == '-';
+}
+
+// Parses the number at the start of text like strtod, without reading past
+// the end of text, which need not be null-terminated. Returns the length used.
+static size_t parseNumber(std::string_view text, double& number) {
+    size_t length = 1;
+    while (length < text.size() && isNumberChar(text[length])) ++length;
+    char* stop = nullptr;
+    if (length < text.size()) {
+        // strtod stops at the character ending the run, which is inside text
+        number = std::strtod(text.data(), &stop);
+        return static_cast<size_t>(stop - text.data());
+    }
+    std::string copy(text);
+    number = std::strtod(copy.c_str(), &stop);
+    return static_cast<size_t>(stop - copy.c_str());
+}
+
+std::vector<Token> tokenize(std::string_view source, size_t offset) {
+    std::vector<Token> tokens;
+    size_t i = 0;
+
+    while (i < source.size()) {
+        char c = source[i];
+
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            ++i;
+            continue;
+        }
+
+        Token token{TokenType::End, "", 0, 0, offset + i};
+
+        if (c == '(') {
+            token.type = TokenType::LeftParen;
+            token.text = "(";
+            ++i;
+        } else if (c == ')') {
+            token.type = TokenType::RightParen;
+            token.text = ")";
+            ++i;
+        } else if (c == ',') {
+            token.type = TokenType::Comma;
+            token.text = ",";
+            ++i;
+        } else if (c == '<' && i + 1 < source.size() && source[i + 1] == '-') {
+            token.type = TokenType::Arrow;
+            token.text = "<-";
+            i += 2;
+        } else if (c == '#') {
+            // Placeholder: '#' followed by the argument index
+            size_t j = i + 1;
+            while (j < source.size() && isDigit(source[j])) ++j;
+            if (j == i + 1) {
+                throw std::runtime_error("Expected an argument index after '#' at position " + std::to_string(offset + i));
+            }
+            token.type = TokenType::Placeholder;
+            token.text = std::string(source.substr(i, j - i));
+            token.index = std::stoul(token.text.substr(1));
+            i = j;
+        } else if (isDigit(c) || ((c == '-' || c == '.') && i + 1 < source.size() && (isDigit(source[i + 1]) || source[i + 1] == '.'))) {
+            // Number literal; strtod reports how much of the input it consumed
+            size_t consumed = parseNumber(source.substr(i), token.number);
+            if (consumed == 0) {
+                throw std::runtime_error("Invalid number at position " + std::to_string(offset + i));
+            }
+            token.type = TokenType::Number;
+            token.text = std::string(source.substr(i, consumed));
+            i += consumed;
+        } else if (isNameStart(c)) {
+            size_t j = i + 1;
+            while (j < source.size() && isNameChar(source[j])) ++j;
+            token.type = TokenType::Identifier;
+            token.text = std::string(source.substr(i, j - i));
+            i = j;
+        } else {
+            throw std::runtime_error(std::string("Invalid character '") + c + "' at position " + std::to_string(offset + i));
+        }
+
+        tokens.push_back(token);
+    }
+
+    tokens.push_back({TokenType::End, "", 0, 0, offset + source.size()});
+    return tokens;
+}
+
+bool isValidName(const std::string& name) {
+    if (name.empty() || !isNameStart(name[0])) return false;
+    for (char c : name) {
+        if (!isNameChar(c)) return false;
+    }
+    return true;
+}
 
 std::vector<int> extractPlaceholders(const std::string& expression) {
     std::vector<int> placeholders;
@@ -22,4 +134,4 @@ std::vector<int> extractPlaceholders(const std::string& expression) {
     }
 
     return placeholders;
-}
\ No newline at end of file
+}
@@ -2,9 +2,36 @@
 #define LEXER_H
 
 #include <string>
+#include <string_view>
 #include <vector>
 
+enum class TokenType {
+    Number,      // 3, -5, 2.5, 1e9
+    Identifier,  // add, myList, fact
+    Placeholder, // #0, #1, ...
+    LeftParen,
+    RightParen,
+    Comma,
+    Arrow,       // <-
+    End
+};
+
+struct Token {
+    TokenType type;
+    std::string text;
+    double number = 0;   // Value of a Number token
+    size_t index = 0;    // Index of a Placeholder token
+    size_t position = 0; // Offset in the source, used for error messages
+};
+
+// Splits source text into tokens; throws on invalid characters. Positions are
+// reported relative to offset, the start of source within its line.
+std::vector<Token> tokenize(std::string_view source, size_t offset = 0);
+
+// Checks whether a name can be used as a function name
+bool isValidName(const std::string& name);
+
 // Extracts placeholders (e.g., #0, #1) from an expression
 std::vector<int> extractPlaceholders(const std::string& expression);
 
-#endif // LEXER_H
\ No newline at end of file
+#endif // LEXER_H
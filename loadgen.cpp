@@ -0,0 +1,199 @@
+// Load generator for `thisFuncInterpreter --serve`. Opens a number of
+// connections, each on its own thread, keeps a number of requests in flight
+// on each (pipelining) and prints the latencies and throughput it saw as one
+// JSON object, like thisFuncBench.
+//
+// Usage: thisFuncLoad [--connections=N] [--depth=N] [--requests=N] socket [expression...]
+// Requests cycle through the expressions, "1 + 1" without any. --requests is
+// the total over all connections.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Settings {
+    std::string socketPath;
+    size_t connections = 4;
+    size_t depth = 16;
+    size_t requests = 100000;
+    std::vector<std::string> expressions;
+};
+
+// What one connection measured
+struct Result {
+    std::vector<uint64_t> latenciesNs;
+    size_t errors = 0; // Replies starting with "Error"
+    bool failed = false;
+};
+
+void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [--connections=N] [--depth=N] [--requests=N] socket [expression...]\n";
+}
+
+bool parseCount(const std::string& text, size_t& count) {
+    try {
+        size_t consumed = 0;
+        count = std::stoul(text, &consumed);
+        return consumed == text.size() && count > 0;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+int connectTo(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) return -1;
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool sendAll(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t count = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        sent += static_cast<size_t>(count);
+    }
+    return true;
+}
+
+// Sends requests, topping up to depth in flight whenever replies arrive, and
+// times each from when it was sent to when its reply line was read
+void runConnection(const Settings& settings, size_t requests, size_t first, Result& result) {
+    int fd = connectTo(settings.socketPath);
+    if (fd < 0) {
+        result.failed = true;
+        return;
+    }
+    result.latenciesNs.reserve(requests);
+    std::deque<Clock::time_point> inFlight;
+    std::string batch;
+    std::string received;
+    char chunk[1 << 16];
+    size_t sent = 0;
+    size_t next = first;
+
+    while (result.latenciesNs.size() < requests) {
+        batch.clear();
+        while (sent < requests && inFlight.size() < settings.depth) {
+            batch += settings.expressions[next++ % settings.expressions.size()];
+            batch += '\n';
+            ++sent;
+            inFlight.push_back(Clock::now());
+        }
+        if (!batch.empty() && !sendAll(fd, batch)) {
+            result.failed = true;
+            break;
+        }
+
+        ssize_t count = read(fd, chunk, sizeof(chunk));
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) {
+            result.failed = true;
+            break;
+        }
+        Clock::time_point now = Clock::now();
+        received.append(chunk, static_cast<size_t>(count));
+        size_t start = 0;
+        size_t end;
+        while ((end = received.find('\n', start)) != std::string::npos) {
+            if (received.compare(start, 5, "Error") == 0) ++result.errors;
+            result.latenciesNs.push_back(
+                static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - inFlight.front()).count()));
+            inFlight.pop_front();
+            start = end + 1;
+        }
+        received.erase(0, start);
+    }
+    close(fd);
+}
+
+double percentileUs(const std::vector<uint64_t>& sorted, double fraction) {
+    if (sorted.empty()) return 0;
+    size_t index = std::min(sorted.size() - 1, static_cast<size_t>(fraction * static_cast<double>(sorted.size())));
+    return static_cast<double>(sorted[index]) / 1e3;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Settings settings;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool valid = true;
+        if (arg.rfind("--connections=", 0) == 0) {
+            valid = parseCount(arg.substr(14), settings.connections);
+        } else if (arg.rfind("--depth=", 0) == 0) {
+            valid = parseCount(arg.substr(8), settings.depth);
+        } else if (arg.rfind("--requests=", 0) == 0) {
+            valid = parseCount(arg.substr(11), settings.requests);
+        } else if (arg.rfind("--", 0) == 0) {
+            valid = false;
+        } else if (settings.socketPath.empty()) {
+            settings.socketPath = arg;
+        } else {
+            settings.expressions.push_back(arg);
+        }
+        if (!valid) {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (settings.socketPath.empty()) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    if (settings.expressions.empty()) settings.expressions.push_back("1 + 1");
+
+    std::vector<Result> results(settings.connections);
+    std::vector<std::thread> threads;
+    auto start = Clock::now();
+    for (size_t i = 0; i < settings.connections; ++i) {
+        size_t share = settings.requests / settings.connections + (i < settings.requests % settings.connections);
+        threads.emplace_back(runConnection, std::cref(settings), share, i, std::ref(results[i]));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<uint64_t> latencies;
+    size_t errors = 0;
+    size_t failed = 0;
+    for (const auto& result : results) {
+        latencies.insert(latencies.end(), result.latenciesNs.begin(), result.latenciesNs.end());
+        errors += result.errors;
+        failed += result.failed;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    std::cout << "{\"connections\": " << settings.connections << ", \"depth\": " << settings.depth
+              << ", \"requests\": " << latencies.size() << ", \"errors\": " << errors
+              << ", \"failed_connections\": " << failed << ", \"seconds\": " << seconds
+              << ", \"requests_per_second\": " << static_cast<uint64_t>(static_cast<double>(latencies.size()) / seconds)
+              << ", \"p50_us\": " << percentileUs(latencies, 0.50) << ", \"p99_us\": " << percentileUs(latencies, 0.99)
+              << ", \"max_us\": " << percentileUs(latencies, 1.0) << "}\n";
+    return failed > 0 ? 1 : 0;
+}
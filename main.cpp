@@ -2,14 +2,124 @@
 #include <iostream>
 #include <string>
 
+static void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [--engine=vm|tree] [--stack-size=N] [--memo] [--memo-size=N]\n"
+              << "       [--max-steps=N] [--time-limit=MS] [--max-list-bytes=N]\n"
+              << "       [--threads=N] [--parallel-threshold=N] [--fork-depth=N] [--jit]\n"
+              << "       [--dump-optimized] [--profile] [--profile-stacks=FILE] [--flush=line|batch]\n"
+              << "       [--cache] [--parallel-statements] [--serve=SOCKET] [file]\n"
+              << "--stack-size bounds the non-tail calls of both engines. --serve takes no\n"
+              << "--profile or --profile-stacks.\n";
+}
+
+static bool parseCount(const std::string& text, size_t& count) {
+    try {
+        size_t consumed = 0;
+        count = std::stoul(text, &consumed);
+        return consumed == text.size();
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
 int main(int argc, char* argv[]) {
-    if (argc == 2) {
+    RunOptions options;
+    std::string filename;
+    std::string socketPath;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--engine=tree") {
+            options.engine = Engine::Tree;
+        } else if (arg == "--engine=vm") {
+            options.engine = Engine::VM;
+        } else if (arg.rfind("--stack-size=", 0) == 0) {
+            if (!parseCount(arg.substr(13), options.stackSize)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg.rfind("--max-steps=", 0) == 0) {
+            if (!parseCount(arg.substr(12), options.limits.steps)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg.rfind("--time-limit=", 0) == 0) {
+            if (!parseCount(arg.substr(13), options.limits.milliseconds)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg.rfind("--max-list-bytes=", 0) == 0) {
+            if (!parseCount(arg.substr(17), options.limits.listBytes)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--memo") {
+            options.memoizeAll = true;
+        } else if (arg.rfind("--memo-size=", 0) == 0) {
+            if (!parseCount(arg.substr(12), options.memoCapacity)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            if (!parseCount(arg.substr(10), options.threads)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg.rfind("--parallel-threshold=", 0) == 0) {
+            if (!parseCount(arg.substr(21), options.parallelThreshold)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg.rfind("--fork-depth=", 0) == 0) {
+            if (!parseCount(arg.substr(13), options.forkDepth)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--jit") {
+            options.jit = true;
+        } else if (arg == "--profile") {
+            options.profile = true;
+        } else if (arg.rfind("--profile-stacks=", 0) == 0) {
+            options.profile = true;
+            options.profileStacks = arg.substr(17);
+        } else if (arg == "--flush=line") {
+            options.flush = FlushMode::Line;
+        } else if (arg == "--flush=batch") {
+            options.flush = FlushMode::Batch;
+        } else if (arg == "--parallel-statements") {
+            options.parallelStatements = true;
+        } else if (arg == "--cache") {
+            options.cache = true;
+        } else if (arg == "--dump-optimized") {
+            options.dumpOptimized = true;
+        } else if (arg.rfind("--serve=", 0) == 0 && arg.size() > 8) {
+            socketPath = arg.substr(8);
+        } else if (arg.rfind("--", 0) == 0 || !filename.empty()) {
+            printUsage(argv[0]);
+            return 1;
+        } else {
+            filename = arg;
+        }
+    }
+
+    // A server never finishes a run to print the profile of, and its workers
+    // would all enter and leave the one call stack the profiler keeps
+    if (!socketPath.empty() && options.profile) {
+        std::cerr << "Error: --profile cannot be used with --serve\n";
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    if (!socketPath.empty()) {
+        // Serve requests, after loading the file's declarations if one is given
+        runServer(socketPath, filename, options);
+    } else if (!filename.empty()) {
         // If a filename is provided, execute commands from the file
-        executeFile(argv[1]);
+        executeFile(filename, options);
     } else {
         // Otherwise, start the interactive REPL
-        runRepl();
+        runRepl(options);
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,132 @@
+#include "memo.h"
+#include <cstring>
+#include <functional>
+#include <iterator>
+
+namespace {
+
+// Doubles are compared and hashed by bit pattern so that 0 and -0 stay distinct
+uint64_t bitsOf(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof bits);
+    return bits;
+}
+
+void combine(size_t& seed, uint64_t value) {
+    seed ^= std::hash<uint64_t>()(value) + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2);
+}
+
+bool sameDoubles(const List& a, const List& b) {
+    return a.size() == b.size() && (a.empty() || a.data() == b.data() || std::memcmp(a.data(), b.data(), a.size() * sizeof(double)) == 0);
+}
+
+} // namespace
+
+MemoCache::MemoCache(size_t capacity) : capacity(capacity) {}
+
+bool MemoCache::cacheable(Arguments args) {
+    for (const auto& arg : args) {
+        if (arg.isFunction() || arg.isLazy()) return false;
+    }
+    return true;
+}
+
+size_t MemoCache::hash(Arguments key) {
+    size_t seed = key.size();
+    for (const auto& value : key) {
+        if (value.isNumber()) {
+            combine(seed, bitsOf(value.number()));
+        } else {
+            const auto& list = value.list();
+            combine(seed, list.size());
+            for (double element : list) combine(seed, bitsOf(element));
+        }
+    }
+    return seed;
+}
+
+bool MemoCache::equal(Arguments a, Arguments b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (a[i].isNumber() != b[i].isNumber()) return false;
+        if (a[i].isNumber()) {
+            if (bitsOf(a[i].number()) != bitsOf(b[i].number())) return false;
+        } else if (!sameDoubles(a[i].list(), b[i].list())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The index slot of the entry for key, null when there is none
+MemoCache::Position* MemoCache::lookup(size_t keyHash, Arguments key) {
+    auto range = index.equal_range(keyHash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (equal(it->second->first, key)) return &it->second;
+    }
+    return nullptr;
+}
+
+bool MemoCache::find(Arguments args, Value& result) {
+    size_t keyHash = hash(args);
+    std::lock_guard<std::mutex> lock(mutex);
+    Position* position = lookup(keyHash, args);
+    if (!position) {
+        ++missCount;
+        return false;
+    }
+    ++hitCount;
+    entries.splice(entries.begin(), entries, *position); // Mark as most recently used
+    result = (*position)->second;
+    return true;
+}
+
+void MemoCache::insert(Arguments args, const Value& result) {
+    size_t keyHash = hash(args);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (capacity == 0 || lookup(keyHash, args)) return;
+
+    if (entries.size() >= capacity) {
+        Position last = std::prev(entries.end());
+        auto range = index.equal_range(hash(last->first));
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == last) {
+                index.erase(it);
+                break;
+            }
+        }
+        entries.pop_back();
+        ++evictionCount;
+    }
+    entries.emplace_front(std::vector<Value>(args.begin(), args.end()), result);
+    index.emplace(keyHash, entries.begin());
+}
+
+std::shared_ptr<MemoCache> MemoCache::emptied() const {
+    auto cache = std::make_shared<MemoCache>(capacity);
+    std::lock_guard<std::mutex> lock(mutex);
+    cache->hitCount = hitCount;
+    cache->missCount = missCount;
+    cache->evictionCount = evictionCount;
+    return cache;
+}
+
+size_t MemoCache::size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
+}
+
+size_t MemoCache::hits() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return hitCount;
+}
+
+size_t MemoCache::misses() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return missCount;
+}
+
+size_t MemoCache::evictions() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return evictionCount;
+}
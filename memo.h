@@ -0,0 +1,56 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "value.h"
+
+// Bounded least-recently-used cache from argument tuples to results of a
+// pure user function. Safe to use from several evaluating threads.
+class MemoCache {
+public:
+    explicit MemoCache(size_t capacity);
+
+    // Calls with function references as arguments are never cached, since the
+    // referenced function may be redeclared, nor calls with lazy lists, which
+    // would have to be run through to be compared
+    static bool cacheable(Arguments args);
+
+    // Copies the cached result into result; returns false on a miss
+    bool find(Arguments args, Value& result);
+    void insert(Arguments args, const Value& result);
+
+    // A cache to replace this one once its results went stale: no entries,
+    // the same capacity and counters. Evaluations that still hold this one,
+    // e.g. against an older version of a shared table, keep using it.
+    std::shared_ptr<MemoCache> emptied() const;
+
+    size_t size() const;
+    size_t hits() const;
+    size_t misses() const;
+    size_t evictions() const;
+
+private:
+    using Entry = std::pair<std::vector<Value>, Value>;
+    using Position = std::list<Entry>::iterator;
+
+    static size_t hash(Arguments key);
+    static bool equal(Arguments a, Arguments b);
+    Position* lookup(size_t keyHash, Arguments key);
+
+    size_t capacity;
+    mutable std::mutex mutex;
+    std::list<Entry> entries; // Most recently used first
+    // Entries by the hash of their arguments, so that looking up a call's
+    // arguments does not have to copy them into a key first
+    std::unordered_multimap<size_t, Position> index;
+    size_t hitCount = 0;
+    size_t missCount = 0;
+    size_t evictionCount = 0;
+};
+
+#endif // MEMO_H
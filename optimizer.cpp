@@ -0,0 +1,272 @@
+#include "interpreter.h"
+
+// Optimization pass over user function bodies, run when they are declared.
+// It folds builtin calls on constants, drops the branch of if that a constant
+// condition never takes, and inlines small non-recursive user functions.
+// Every rewrite keeps the order in which evaluation could fail, so a program
+// reports the same error before and after optimization: calls that fail on
+// their constants are left in place, and calls are only inlined when the
+// callee reads the caller's arguments before it can fail.
+
+namespace {
+
+NodePtr numberNode(double value) {
+    auto node = std::make_shared<Node>();
+    node->kind = Node::Kind::Number;
+    node->number = value;
+    return node;
+}
+
+size_t nodeCount(const Node& node) {
+    size_t count = 1;
+    for (const auto& arg : node.args) {
+        count += nodeCount(*arg);
+    }
+    return count;
+}
+
+// Appends the placeholders evaluated before the first step that can fail.
+// Returns false once such a step is reached.
+bool collectLeadingPlaceholders(const Node& node, size_t ifSymbol, size_t nandSymbol,
+                                size_t builtinCount, std::vector<size_t>& placeholders) {
+    switch (node.kind) {
+    case Node::Kind::Number:
+        return true;
+    case Node::Kind::Placeholder:
+        placeholders.push_back(node.index);
+        return true;
+    case Node::Kind::Name:
+        return false; // May name an unknown function
+    case Node::Kind::Call:
+        break;
+    }
+
+    if (node.symbol == ifSymbol || node.symbol == nandSymbol) {
+        // Only the first argument is always evaluated
+        size_t arity = node.symbol == ifSymbol ? 3 : 2;
+        if (node.args.size() == arity) {
+            collectLeadingPlaceholders(*node.args[0], ifSymbol, nandSymbol, builtinCount, placeholders);
+        }
+        return false;
+    }
+    if (node.symbol >= builtinCount) {
+        return false; // Unknown user functions fail before their arguments are evaluated
+    }
+    for (const auto& arg : node.args) {
+        if (!collectLeadingPlaceholders(*arg, ifSymbol, nandSymbol, builtinCount, placeholders)) {
+            return false;
+        }
+    }
+    return false;
+}
+
+// Keeps the first occurrence of every index
+std::vector<size_t> firstOccurrences(const std::vector<size_t>& indices) {
+    std::vector<size_t> result;
+    for (size_t index : indices) {
+        if (std::find(result.begin(), result.end(), index) == result.end()) {
+            result.push_back(index);
+        }
+    }
+    return result;
+}
+
+NodePtr substitute(const NodePtr& node, const std::vector<NodePtr>& args) {
+    if (node->kind == Node::Kind::Placeholder) {
+        return args[node->index];
+    }
+    if (node->args.empty()) {
+        return node;
+    }
+    auto copy = std::make_shared<Node>(*node);
+    for (auto& arg : copy->args) {
+        arg = substitute(arg, args);
+    }
+    return copy;
+}
+
+} // namespace
+
+NodePtr ThisFuncInterpreter::optimize(const NodePtr& node) {
+    if (node->kind != Node::Kind::Call) {
+        return node;
+    }
+
+    std::vector<NodePtr> args;
+    args.reserve(node->args.size());
+    bool changed = false;
+    bool constantArgs = true;
+    for (const auto& arg : node->args) {
+        args.push_back(optimize(arg));
+        changed = changed || args.back() != arg;
+        constantArgs = constantArgs && args.back()->kind == Node::Kind::Number;
+    }
+
+    if (node->symbol == ifSymbol && args.size() == 3) {
+        if (args[0]->kind == Node::Kind::Number) {
+            return args[args[0]->number != 0 ? 1 : 2];
+        }
+    } else if (node->symbol == nandSymbol && args.size() == 2) {
+        if (args[0]->kind == Node::Kind::Number && args[0]->number == 0) {
+            return numberNode(1.0);
+        }
+        if (constantArgs) {
+            return numberNode(args[1]->number == 0 ? 1.0 : 0.0);
+        }
+    } else if (node->symbol < builtinCount) {
+        const Function& builtin = functions[node->symbol];
+        if (constantArgs && args.size() == builtin.argCount) {
+            std::vector<Value> values(args.size());
+            for (size_t i = 0; i < args.size(); ++i) {
+                values[i] = Value(args[i]->number);
+            }
+            // Calls that fail (e.g. div(1, 0)) stay and fail when evaluated
+            try {
+                Value result = builtin.implementation(*this, values);
+                if (result.isNumber()) {
+                    return numberNode(result.number());
+                }
+            } catch (const std::exception&) {
+            }
+        }
+    } else if (NodePtr inlined = inlineCall(node->symbol, args)) {
+        return inlined;
+    }
+
+    if (!changed) {
+        return node;
+    }
+    auto copy = std::make_shared<Node>(*node);
+    copy->args = std::move(args);
+    return copy;
+}
+
+// Returns the body of symbol with args in place of its placeholders, or null
+// when the call has to stay
+NodePtr ThisFuncInterpreter::inlineCall(size_t symbol, const std::vector<NodePtr>& args) {
+    const Function& callee = functions[symbol];
+    if (!callee.source || callee.memo || callee.recursive) {
+        return nullptr;
+    }
+    const NodePtr& body = callee.body;
+    if (nodeCount(*body) > inlineLimit) {
+        return nullptr;
+    }
+
+    // Arguments are substituted where they are used, so they must be free to
+    // evaluate any number of times, or not at all
+    std::vector<size_t> callerPlaceholders;
+    for (const auto& arg : args) {
+        if (arg->kind == Node::Kind::Placeholder) {
+            callerPlaceholders.push_back(arg->index);
+        } else if (arg->kind != Node::Kind::Number) {
+            return nullptr;
+        }
+    }
+
+    std::vector<size_t> used;
+    collectPlaceholders(*body, used);
+    for (size_t index : used) {
+        if (index >= args.size()) return nullptr; // Missing arguments fail inside the callee
+    }
+
+    // A missing caller argument fails while the call's arguments are
+    // evaluated. Inlined, it must still be the first thing that fails, so the
+    // body has to read them all, in the same order, before any step that can fail.
+    std::vector<size_t> leading;
+    collectLeadingPlaceholders(*body, ifSymbol, nandSymbol, builtinCount, leading);
+    std::vector<size_t> bodyOrder;
+    for (size_t index : firstOccurrences(leading)) {
+        if (args[index]->kind == Node::Kind::Placeholder) {
+            bodyOrder.push_back(args[index]->index);
+        }
+    }
+    if (firstOccurrences(bodyOrder) != firstOccurrences(callerPlaceholders)) {
+        return nullptr;
+    }
+
+    // Constant arguments may enable more folding in the substituted body
+    return optimize(substitute(body, args));
+}
+
+// Whether symbol can call itself, directly or through other functions
+bool ThisFuncInterpreter::reachesItself(size_t symbol) const {
+    std::vector<bool> visited(functions.size(), false);
+    std::vector<size_t> pending(functions[symbol].callees);
+    while (!pending.empty()) {
+        size_t current = pending.back();
+        pending.pop_back();
+        if (current == symbol) return true;
+        if (visited[current]) continue;
+        visited[current] = true;
+        const auto& callees = functions[current].callees;
+        pending.insert(pending.end(), callees.begin(), callees.end());
+    }
+    return false;
+}
+
+// Rebuilds the bodies of every user function that reaches symbol, since they
+// may have inlined its old definition or can inline the new one
+void ThisFuncInterpreter::optimizeDependents(size_t symbol) {
+    std::vector<size_t> dependents = dependentsOf(symbol);
+    for (size_t dependent : dependents) {
+        materialize(dependent);
+    }
+    rebuildFunctions(dependents);
+}
+
+// Recomputes everything the table derives from the source of each of
+// symbols: whether it recurses, its signature, its optimized body and code.
+// Callees are rebuilt before their callers, which inline the callees'
+// optimized bodies.
+void ThisFuncInterpreter::rebuildFunctions(const std::vector<size_t>& symbols) {
+    std::vector<bool> pending(functions.size(), false);
+    for (size_t symbol : symbols) {
+        pending[symbol] = true;
+        functions.edit(symbol).recursive = reachesItself(symbol);
+    }
+    inferSignatures(symbols);
+    renewSlots(symbols);
+
+    // Depth-first over the calls, optimizing each function after its callees
+    std::vector<std::pair<size_t, size_t>> stack; // Function, next callee to visit
+    for (size_t symbol : symbols) {
+        if (!pending[symbol]) continue;
+        pending[symbol] = false;
+        stack.push_back({symbol, 0});
+        while (!stack.empty()) {
+            auto& [current, next] = stack.back();
+            const auto& callees = functions[current].callees;
+            if (next < callees.size()) {
+                size_t callee = callees[next++];
+                if (pending[callee]) {
+                    pending[callee] = false;
+                    stack.push_back({callee, 0});
+                }
+                continue;
+            }
+            Function& function = functions.edit(current);
+            if (function.source) {
+                function.body = optimize(function.source);
+                // Other versions of a shared table may be running the nodes
+                // the optimizer kept, so the calls are marked in a copy
+                if (versioned) function.body = cloneTree(*function.body);
+                markParallelCalls(*function.body);
+                compileFunction(function);
+            }
+            stack.pop_back();
+        }
+    }
+    settleScalar(symbols);
+    settleNative(symbols);
+}
+
+std::string ThisFuncInterpreter::optimizedBody(const std::string& name) {
+    const Function* function = findFunction(name);
+    if (!function) {
+        throw std::runtime_error("Unknown function: " + name);
+    }
+    size_t symbol = function->symbol;
+    materialize(symbol); // Decoding rebuilds the entry
+    return functions[symbol].body ? formatNode(*functions[symbol].body) : functions[symbol].expression;
+}
@@ -1,4 +1,157 @@
 #include "parser.h"
+#include <stdexcept>
+#include <charconv>
+
+namespace {
+
+// Recursive descent parser over the token stream
+class Parser {
+public:
+    explicit Parser(const std::vector<Token>& tokens) : tokens(tokens) {}
+
+    NodePtr parseExpression() {
+        const Token& token = next();
+        auto node = std::make_shared<Node>();
+
+        switch (token.type) {
+        case TokenType::Number:
+            node->kind = Node::Kind::Number;
+            node->number = token.number;
+            return node;
+
+        case TokenType::Placeholder:
+            node->kind = Node::Kind::Placeholder;
+            node->index = token.index;
+            return node;
+
+        case TokenType::Identifier:
+            node->name = token.text;
+            if (peek().type != TokenType::LeftParen) {
+                node->kind = Node::Kind::Name;
+                return node;
+            }
+            next(); // '('
+            node->kind = Node::Kind::Call;
+            if (peek().type != TokenType::RightParen) {
+                node->args.push_back(parseExpression());
+                while (peek().type == TokenType::Comma) {
+                    next();
+                    node->args.push_back(parseExpression());
+                }
+            }
+            expect(TokenType::RightParen, "')'");
+            return node;
+
+        default:
+            throw unexpected(token);
+        }
+    }
+
+    void expectEnd() {
+        if (peek().type != TokenType::End) throw unexpected(peek());
+    }
+
+private:
+    const std::vector<Token>& tokens;
+    size_t current = 0;
+
+    const Token& peek() const { return tokens[current]; }
+
+    const Token& next() {
+        const Token& token = tokens[current];
+        if (token.type != TokenType::End) ++current;
+        return token;
+    }
+
+    void expect(TokenType type, const std::string& what) {
+        if (peek().type != type) {
+            throw std::runtime_error("Expected " + what + " at position " + std::to_string(peek().position));
+        }
+        next();
+    }
+
+    static std::runtime_error unexpected(const Token& token) {
+        if (token.type == TokenType::End) return std::runtime_error("Unexpected end of expression");
+        return std::runtime_error("Unexpected '" + token.text + "' at position " + std::to_string(token.position));
+    }
+};
+
+} // namespace
+
+NodePtr parseExpression(std::string_view source, size_t offset) {
+    std::vector<Token> tokens = tokenize(source, offset);
+    Parser parser(tokens);
+    NodePtr node = parser.parseExpression();
+    parser.expectEnd();
+    return node;
+}
+
+Statement parseDeclaration(std::string_view source) {
+    size_t arrowPos = source.find("<-");
+    if (arrowPos == std::string_view::npos) {
+        throw std::runtime_error("Invalid function declaration syntax");
+    }
+
+    Statement statement;
+    statement.isDeclaration = true;
+    statement.name = trim(source.substr(0, arrowPos));
+    if (!isValidName(statement.name)) {
+        throw std::runtime_error("Invalid function name: " + statement.name);
+    }
+    // Offset the body so error positions refer to the whole line
+    statement.expression = parseExpression(source.substr(arrowPos + 2), arrowPos + 2);
+    return statement;
+}
+
+void collectPlaceholders(const Node& node, std::vector<size_t>& placeholders) {
+    if (node.kind == Node::Kind::Placeholder) {
+        placeholders.push_back(node.index);
+    }
+    for (const auto& arg : node.args) {
+        collectPlaceholders(*arg, placeholders);
+    }
+}
+
+void collectSymbols(const Node& node, std::vector<size_t>& symbols) {
+    if (node.kind == Node::Kind::Call || node.kind == Node::Kind::Name) {
+        symbols.push_back(node.symbol);
+    }
+    for (const auto& arg : node.args) {
+        collectSymbols(*arg, symbols);
+    }
+}
+
+NodePtr cloneTree(const Node& node) {
+    auto copy = std::make_shared<Node>(node);
+    for (auto& arg : copy->args) {
+        arg = cloneTree(*arg);
+    }
+    return copy;
+}
+
+std::string formatNode(const Node& node) {
+    switch (node.kind) {
+    case Node::Kind::Number: {
+        // Shortest form that reads back as the same number
+        char buffer[32];
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), node.number);
+        return std::string(buffer, result.ptr);
+    }
+    case Node::Kind::Placeholder:
+        return "#" + std::to_string(node.index);
+    case Node::Kind::Name:
+        return node.name;
+    case Node::Kind::Call:
+        break;
+    }
+
+    std::string text = node.name + "(";
+    for (size_t i = 0; i < node.args.size(); ++i) {
+        if (i > 0) text += ", ";
+        text += formatNode(*node.args[i]);
+    }
+    return text + ")";
+}
 
 // Splits arguments within parentheses
 std::vector<std::string> splitArguments(const std::string& args) {
@@ -20,8 +173,8 @@ std::vector<std::string> splitArguments(const std::string& args) {
 }
 
 // Trims whitespace
-std::string trim(const std::string& str) {
+std::string trim(std::string_view str) {
     size_t start = str.find_first_not_of(" \t\n\r");
     size_t end = str.find_last_not_of(" \t\n\r");
-    return (start == std::string::npos) ? "" : str.substr(start, end - start + 1);
-}
\ No newline at end of file
+    return (start == std::string_view::npos) ? "" : std::string(str.substr(start, end - start + 1));
+}
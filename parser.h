@@ -2,12 +2,61 @@
 #define PARSER_H
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <memory>
+#include "lexer.h"
+
+// Abstract syntax tree of a ThisFunc expression
+struct Node {
+    enum class Kind {
+        Number,      // Real number literal
+        Placeholder, // #N, bound to the N-th argument of the enclosing function
+        Call,        // name(args...)
+        Name         // Bare name, e.g. a function passed to map/filter
+    };
+
+    Kind kind;
+    double number = 0;                  // Number
+    size_t index = 0;                   // Placeholder
+    std::string name;                   // Call, Name
+    size_t symbol = 0;                  // Call, Name: interned name, set by the interpreter
+    bool parallelArgs = false;          // Call: arguments worth evaluating at once, set by the interpreter
+    std::vector<std::shared_ptr<Node>> args; // Call
+};
+
+using NodePtr = std::shared_ptr<Node>;
+
+// A parsed line: either a declaration (name <- expression) or an expression
+struct Statement {
+    bool isDeclaration = false;
+    std::string name;
+    NodePtr expression;
+};
+
+// Parses a single expression; throws on syntax errors. Error positions are
+// reported relative to offset.
+NodePtr parseExpression(std::string_view source, size_t offset = 0);
+
+// Parses "name <- expression"; throws on syntax errors or invalid names
+Statement parseDeclaration(std::string_view source);
+
+// Collects the placeholder indices used in a tree
+void collectPlaceholders(const Node& node, std::vector<size_t>& placeholders);
+
+// Collects the symbols of functions and lists referenced in a tree
+void collectSymbols(const Node& node, std::vector<size_t>& symbols);
+
+// Copies a tree node by node, so marks set on the copy leave the original alone
+NodePtr cloneTree(const Node& node);
+
+// Formats a tree back into source form
+std::string formatNode(const Node& node);
 
 // Splits arguments within parentheses
 std::vector<std::string> splitArguments(const std::string& args);
 
 // Trims whitespace
-std::string trim(const std::string& str);
+std::string trim(std::string_view str);
 
-#endif // PARSER_H
\ No newline at end of file
+#endif // PARSER_H
@@ -0,0 +1,206 @@
+#include "interpreter.h"
+
+// Lazy lists. map, filter and range return pipelines instead of lists, and
+// tail of a lazy list only moves its offset; elements are produced a block
+// at a time when head, the folds or printing read them. Blocks start small,
+// so that reading the first elements stops early, and double up to
+// largestBlock, so that long lists still run on the kernels and the pool.
+
+// list followed by another stage, in a new pipeline that starts from list's
+// source again. The elements a lazy list is past are dropped by a stage.
+Value ThisFuncInterpreter::pipe(const Value& list, Pipeline::Stage stage) const {
+    Pipeline::Definition definition;
+    if (list.isLazy()) {
+        definition = list.pipeline()->definition;
+        if (list.offset() > 0) {
+            auto& stages = definition.stages;
+            if (!stages.empty() && stages.back().kind == Pipeline::Stage::Kind::Drop) {
+                stages.back().count += list.offset();
+            } else {
+                stages.push_back({Pipeline::Stage::Kind::Drop, 0, list.offset()});
+            }
+        }
+    } else {
+        definition.list = toList(list);
+    }
+    definition.stages.push_back(stage);
+    return Value(std::make_shared<Pipeline>(std::move(definition)), 0);
+}
+
+// Reads the next block of at most limit source elements and runs it through
+// the stages, leaving what comes out in block
+void ThisFuncInterpreter::runBlock(const Pipeline::Definition& definition, Pipeline::Progress& progress,
+                                   std::vector<double>& block, size_t limit) {
+    size_t size = progress.block == 0 ? firstBlock : std::min(progress.block * 2, largestBlock);
+    size = std::min({size, limit, definition.size() - progress.consumed});
+    block.resize(size);
+    if (definition.range) {
+        for (size_t i = 0; i < size; ++i) {
+            block[i] = definition.start + static_cast<double>(progress.consumed + i) * definition.step;
+        }
+    } else {
+        std::copy(definition.list.begin() + progress.consumed, definition.list.begin() + progress.consumed + size,
+                  block.begin());
+    }
+    progress.consumed += size;
+    progress.block = size;
+    Budget::step(size);
+
+    for (size_t i = 0; i < definition.stages.size() && !block.empty(); ++i) {
+        const Pipeline::Stage& stage = definition.stages[i];
+        switch (stage.kind) {
+        case Pipeline::Stage::Kind::Map:
+            mapElements(functions[stage.symbol], block);
+            break;
+        case Pipeline::Stage::Kind::Filter:
+            filterElements(functions[stage.symbol], block);
+            break;
+        case Pipeline::Stage::Kind::Drop: {
+            size_t drop = std::min(stage.count - progress.dropped[i], block.size());
+            block.erase(block.begin(), block.begin() + drop);
+            progress.dropped[i] += drop;
+            break;
+        }
+        }
+    }
+}
+
+// Replaces each element with function's result for it. Simple arithmetic
+// bodies run as a vectorized kernel; the rest (everything, or the block
+// where the kernel hit an error) runs in parallel chunks that each fill
+// their own slice of the result.
+void ThisFuncInterpreter::mapElements(const Function& function, std::vector<double>& block) {
+    std::vector<double> result(block.size());
+    size_t done = 0;
+    if (const Kernel* kernel = kernelFor(function)) {
+        done = kernel->map(block.data(), block.size(), result.data());
+    }
+    runChunks(done, block.size(), chunkCount(block.size() - done), [&](size_t, size_t from, size_t to) {
+        for (size_t i = from; i < to; ++i) {
+            Value element(block[i]);
+            Value transformedValue = callFunction(function, Arguments(&element, 1));
+            result[i] = toDouble(transformedValue);
+        }
+    });
+    block.swap(result);
+}
+
+// Keeps the elements function returns non-zero for. Each chunk keeps its
+// matches; joining them in order keeps the list order.
+void ThisFuncInterpreter::filterElements(const Function& function, std::vector<double>& block) {
+    std::vector<double> result;
+    size_t done = 0;
+    if (const Kernel* kernel = kernelFor(function)) {
+        done = kernel->filter(block.data(), block.size(), result);
+    }
+    size_t chunks = chunkCount(block.size() - done);
+    std::vector<std::vector<double>> parts(chunks);
+    runChunks(done, block.size(), chunks, [&](size_t chunk, size_t from, size_t to) {
+        for (size_t i = from; i < to; ++i) {
+            double elem = block[i];
+            Value element(elem);
+            Value predicateResult = callFunction(function, Arguments(&element, 1));
+            if (toDouble(predicateResult) != 0) { // Non-zero is treated as true
+                parts[chunk].push_back(elem);
+            }
+        }
+    });
+    for (const auto& part : parts) {
+        result.insert(result.end(), part.begin(), part.end());
+    }
+    block.swap(result);
+}
+
+// Runs blocks of the pipeline until it produced more than position elements
+// or its source ran out; returns whether it did. A block that fails is run
+// again an element at a time, so that an error only surfaces once what
+// fails is read. Blocks run without holding the lock, so a thread that helps
+// the pool while a stage waits may read the same pipeline; a block another
+// thread finished first is dropped.
+bool ThisFuncInterpreter::produce(Pipeline& pipeline, size_t position) {
+    std::vector<double> block;
+    size_t limit = largestBlock;
+    while (true) {
+        Pipeline::Progress progress;
+        {
+            std::lock_guard<std::mutex> lock(pipeline.mutex);
+            if (position < pipeline.produced->size()) return true;
+            if (pipeline.finished) return false;
+            progress = pipeline.progress;
+        }
+        size_t from = progress.consumed;
+        try {
+            runBlock(pipeline.definition, progress, block, limit);
+        } catch (...) {
+            if (progress.block == 1) throw;
+            limit = 1;
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(pipeline.mutex);
+        if (pipeline.progress.consumed != from) continue;
+        Budget::allocate(block.size() * sizeof(double));
+        pipeline.produced->insert(pipeline.produced->end(), block.begin(), block.end());
+        pipeline.progress = std::move(progress);
+        pipeline.finished = pipeline.progress.consumed == pipeline.definition.size();
+        if (profiler) profiler->allocate(block.size() * sizeof(double));
+    }
+}
+
+// Element index of a lazy list; false when it has no more elements
+bool ThisFuncInterpreter::lazyElement(const Value& list, size_t index, double& element) {
+    Pipeline& pipeline = *list.pipeline();
+    size_t position = list.offset() + index;
+    if (!produce(pipeline, position)) return false;
+    std::lock_guard<std::mutex> lock(pipeline.mutex);
+    element = (*pipeline.produced)[position];
+    return true;
+}
+
+// Passes the elements of list to visit a block at a time until it returns
+// false. A lazy list is read from what reading by position produced and
+// run on from there, without keeping anything. Its offset is never past
+// what was produced, since tail checks that the element it skips exists.
+void ThisFuncInterpreter::forEachBlock(const Value& list,
+                                       const std::function<bool(const double* elements, size_t count)>& visit) {
+    if (!list.isLazy()) {
+        const List& elements = toList(list);
+        visit(elements.data(), elements.size());
+        return;
+    }
+
+    Pipeline& pipeline = *list.pipeline();
+    std::shared_ptr<const std::vector<double>> produced;
+    std::vector<double> block;
+    Pipeline::Progress progress;
+    {
+        std::lock_guard<std::mutex> lock(pipeline.mutex);
+        if (pipeline.finished) {
+            produced = pipeline.produced;
+        } else {
+            block.assign(pipeline.produced->begin() + list.offset(), pipeline.produced->end());
+            progress = pipeline.progress;
+        }
+    }
+    if (produced) {
+        visit(produced->data() + list.offset(), produced->size() - list.offset());
+        return;
+    }
+
+    size_t size = pipeline.definition.size();
+    while (true) {
+        if (!block.empty() && !visit(block.data(), block.size())) return;
+        if (progress.consumed == size) return;
+        runBlock(pipeline.definition, progress, block);
+    }
+}
+
+// The elements of a lazy list as a List, e.g. to print them; other values
+// as they are. The list shares the elements the pipeline keeps.
+Value ThisFuncInterpreter::force(Value value) {
+    if (!value.isLazy()) return value;
+    Pipeline& pipeline = *value.pipeline();
+    produce(pipeline, SIZE_MAX);
+    std::lock_guard<std::mutex> lock(pipeline.mutex);
+    return Value(List(pipeline.produced, value.offset()));
+}
@@ -0,0 +1,62 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "value.h"
+
+// A lazy list: the elements of a source, a range or a list, passed through
+// map, filter and tail stages in order. The stages run when elements are
+// read, on a block of source elements at a time, so a chain of them never
+// builds the lists in between. Reading by position (head, tail) keeps what
+// was produced, so walking a lazy list computes each element once; reading
+// it through (sum, reduce) does not, and needs no more than a block.
+struct Pipeline {
+    struct Stage {
+        enum class Kind {
+            Map,
+            Filter,
+            Drop  // Drops the first count elements the stages before produce
+        };
+        Kind kind;
+        size_t symbol = 0; // Function called by Map and Filter
+        size_t count = 0;
+    };
+
+    // What the stages run on and the stages; copied into the pipelines that
+    // add stages to this one
+    struct Definition {
+        List list;          // Source elements, unless the source is a range
+        bool range = false;
+        double start = 0;   // Element i of a range is start + i * step
+        double step = 0;
+        size_t count = 0;   // Elements of a range
+        std::vector<Stage> stages;
+
+        size_t size() const { return range ? count : list.size(); }
+    };
+
+    // How far running the stages got
+    struct Progress {
+        size_t consumed = 0;         // Source elements read
+        std::vector<size_t> dropped; // Elements dropped so far, per stage
+        size_t block = 0;            // Source elements read by the last block
+    };
+
+    explicit Pipeline(Definition definition) : definition(std::move(definition)) {
+        progress.dropped.assign(this->definition.stages.size(), 0);
+    }
+
+    const Definition definition;
+
+    // Elements produced so far. Once finished nothing is added to them, so
+    // lists forced from the pipeline can share them.
+    std::mutex mutex;
+    std::shared_ptr<std::vector<double>> produced = std::make_shared<std::vector<double>>();
+    Progress progress;
+    bool finished = false;
+};
+
+#endif // PIPELINE_H
@@ -0,0 +1,88 @@
+#include "profiler.h"
+#include <algorithm>
+
+Profiler::Profiler() {
+    paths.push_back({0, 0, 0, {}});
+}
+
+void Profiler::enter(size_t symbol) {
+    if (symbol >= stats.size()) {
+        stats.resize(symbol + 1);
+        active.resize(symbol + 1, 0);
+    }
+
+    size_t parent = stack.empty() ? 0 : stack.back().path;
+    auto child = paths[parent].children.find(symbol);
+    size_t path;
+    if (child != paths[parent].children.end()) {
+        path = child->second;
+    } else {
+        path = paths.size();
+        paths[parent].children.emplace(symbol, path);
+        paths.push_back({parent, symbol, 0, {}});
+    }
+
+    FunctionStats& function = stats[symbol];
+    function.symbol = symbol;
+    ++function.calls;
+    function.maxDepth = std::max(function.maxDepth, ++active[symbol]);
+    stack.push_back({symbol, path, Clock::now(), 0});
+}
+
+void Profiler::exit() {
+    Activation activation = stack.back();
+    stack.pop_back();
+
+    uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - activation.start).count();
+    uint64_t self = elapsed > activation.calleeNs ? elapsed - activation.calleeNs : 0;
+    paths[activation.path].selfNs += self;
+
+    FunctionStats& function = stats[activation.symbol];
+    function.exclusiveNs += self;
+    // Recursive activations are already covered by the outermost one
+    if (--active[activation.symbol] == 0) {
+        function.inclusiveNs += elapsed;
+    }
+    if (!stack.empty()) {
+        stack.back().calleeNs += elapsed;
+    }
+}
+
+void Profiler::unwindTo(size_t depth) {
+    while (stack.size() > depth) {
+        exit();
+    }
+}
+
+void Profiler::allocate(size_t bytes) {
+    if (!stack.empty()) {
+        stats[stack.back().symbol].listBytes += bytes;
+    }
+}
+
+std::vector<Profiler::FunctionStats> Profiler::functionStats() const {
+    std::vector<FunctionStats> called;
+    for (const auto& function : stats) {
+        if (function.calls > 0) called.push_back(function);
+    }
+    std::sort(called.begin(), called.end(), [](const FunctionStats& a, const FunctionStats& b) {
+        if (a.inclusiveNs != b.inclusiveNs) return a.inclusiveNs > b.inclusiveNs;
+        return a.symbol < b.symbol;
+    });
+    return called;
+}
+
+void Profiler::writeCollapsedStacks(std::ostream& out, const std::vector<std::string>& names) const {
+    for (size_t i = 1; i < paths.size(); ++i) {
+        if (paths[i].selfNs == 0) continue;
+
+        std::vector<size_t> frames;
+        for (size_t path = i; path != 0; path = paths[path].parent) {
+            frames.push_back(paths[path].symbol);
+        }
+        for (size_t frame = frames.size(); frame-- > 0;) {
+            out << names[frames[frame]] << (frame > 0 ? ";" : "");
+        }
+        out << " " << paths[i].selfNs << "\n";
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Call profiler for --profile. The engines report every function they enter
+// and leave; the profiler keeps per-function totals and the time spent in
+// each distinct call stack. Functions are identified by their symbol.
+class Profiler {
+public:
+    struct FunctionStats {
+        size_t symbol = 0;
+        uint64_t calls = 0;
+        uint64_t inclusiveNs = 0; // Including callees, outermost activation only
+        uint64_t exclusiveNs = 0; // Excluding callees
+        size_t maxDepth = 0;      // Most activations on the stack at once
+        uint64_t listBytes = 0;   // Bytes of list elements allocated by the function itself
+    };
+
+    Profiler();
+
+    void enter(size_t symbol);
+    void exit();
+    size_t depth() const { return stack.size(); }
+    void unwindTo(size_t depth); // Leaves the calls abandoned by an error
+    void allocate(size_t bytes); // Charged to the function on top of the stack
+
+    // Called functions, most inclusive time first
+    std::vector<FunctionStats> functionStats() const;
+
+    // One "outer;inner;leaf nanoseconds" line per call stack, the format read
+    // by flamegraph tools; names maps symbols to function names
+    void writeCollapsedStacks(std::ostream& out, const std::vector<std::string>& names) const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // Call stacks form a tree; paths[0] is the (empty) root stack
+    struct Path {
+        size_t parent;
+        size_t symbol;
+        uint64_t selfNs;
+        std::unordered_map<size_t, size_t> children;
+    };
+
+    struct Activation {
+        size_t symbol;
+        size_t path;
+        Clock::time_point start;
+        uint64_t calleeNs;
+    };
+
+    std::vector<Path> paths;
+    std::vector<Activation> stack;
+    std::vector<FunctionStats> stats; // Indexed by symbol
+    std::vector<size_t> active;       // Activations of each symbol on the stack
+};
+
+// Brings the profiler's stack back to its depth at construction when it goes
+// out of scope, leaving the calls that an error abandoned
+class ProfileScope {
+public:
+    explicit ProfileScope(Profiler* profiler) : profiler(profiler), depth(profiler ? profiler->depth() : 0) {}
+    ~ProfileScope() {
+        if (profiler) profiler->unwindTo(depth);
+    }
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+    Profiler* profiler;
+    size_t depth;
+};
+
+#endif // PROFILER_H
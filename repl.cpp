@@ -1,76 +1,365 @@
 #include "repl.h"
 #include "interpreter.h"
+#include "io.h"
 #include <iostream>
 #include <fstream>
+#include <iomanip>
 #include <string>
+#include <cstdio>
+#include <csignal>
+#include <cstring>
+#include <unistd.h>
 
-void runRepl() {
+void configure(ThisFuncInterpreter& interpreter, const RunOptions& options) {
+    interpreter.setEngine(options.engine);
+    interpreter.setStackSize(options.stackSize);
+    interpreter.setLimits(options.limits);
+    interpreter.setMemoizeAll(options.memoizeAll);
+    interpreter.setMemoCapacity(options.memoCapacity);
+    interpreter.setThreads(options.threads);
+    interpreter.setParallelThreshold(options.parallelThreshold);
+    interpreter.setForkDepth(options.forkDepth);
+    interpreter.setProfiling(options.profile);
+    interpreter.setJit(options.jit);
+}
+
+// Prints the --profile table to stderr and writes the collapsed stacks
+static void reportProfile(const ThisFuncInterpreter& interpreter, const RunOptions& options) {
+    if (!options.profile) return;
+
+    std::cerr << std::left << std::setw(20) << "function" << std::right << std::setw(12) << "calls"
+              << std::setw(14) << "incl ms" << std::setw(14) << "excl ms" << std::setw(11) << "max depth"
+              << std::setw(14) << "list bytes" << "\n";
+    std::cerr << std::fixed << std::setprecision(3);
+    for (const auto& stats : interpreter.profileStatistics()) {
+        std::cerr << std::left << std::setw(20) << stats.name << std::right << std::setw(12) << stats.calls
+                  << std::setw(14) << stats.inclusiveNs / 1e6 << std::setw(14) << stats.exclusiveNs / 1e6
+                  << std::setw(11) << stats.maxDepth << std::setw(14) << stats.listBytes << "\n";
+    }
+
+    if (!options.profileStacks.empty()) {
+        std::ofstream stacks(options.profileStacks);
+        if (!stacks.is_open()) {
+            std::cerr << "Error: Unable to write " << options.profileStacks << "\n";
+            return;
+        }
+        interpreter.writeCollapsedStacks(stacks);
+    }
+}
+
+// Handles interpreter directives (lines starting with ':'):
+//   :memo <name>   memoize a user-defined function
+//   :memo-stats    print memo cache hit/miss counters
+//   :type <name>   print what the checker inferred a function takes and returns
+static void runDirective(ThisFuncInterpreter& interpreter, const std::string& directive, Output& out) {
+    if (directive.rfind(":memo ", 0) == 0) {
+        interpreter.memoize(trim(std::string_view(directive).substr(6)));
+    } else if (directive.rfind(":type ", 0) == 0) {
+        std::string name = trim(std::string_view(directive).substr(6));
+        out << "> " << name << ": " << interpreter.signature(name) << '\n';
+    } else if (directive == ":memo-stats") {
+        for (const auto& stats : interpreter.memoStatistics()) {
+            out << "> " << stats.name << ": " << stats.hits << " hits, " << stats.misses << " misses, "
+                << stats.evictions << " evictions, " << stats.entries << " entries\n";
+        }
+    } else {
+        throw std::runtime_error("Unknown directive: " + directive);
+    }
+}
+
+// Prints the body a declaration was optimized to (--dump-optimized)
+static void dumpOptimized(ThisFuncInterpreter& interpreter, std::string_view declaration, Output& out) {
+    std::string name = trim(declaration.substr(0, declaration.find("<-")));
+    out << "optimized: " << name << " <- " << interpreter.optimizedBody(name) << '\n';
+}
+
+// Directives answered with output of their own instead of an echo
+static bool printsOutput(const std::string& directive) {
+    return directive == ":memo-stats" || directive.rfind(":type ", 0) == 0;
+}
+
+static bool isDirective(std::string_view line) {
+    size_t start = line.find_first_not_of(" \t\n\r");
+    return start != std::string_view::npos && line[start] == ':';
+}
+
+static void writeError(Output& out, const std::exception& error, std::string_view line, bool script) {
+    out << "Error: " << error.what();
+    if (script) out << " (line: " << line << ')';
+    out << '\n';
+}
+
+// Runs one line and writes its result. Scripts echo declarations and
+// directives and name the failing line in errors; the REPL answers them with
+// a bare prompt.
+static void runLine(ThisFuncInterpreter& interpreter, std::string_view line, const RunOptions& options,
+                    Output& out, bool script) {
+    try {
+        if (isDirective(line)) {
+            std::string directive = trim(line);
+            runDirective(interpreter, directive, out);
+            if (!printsOutput(directive)) {
+                if (script) {
+                    out << "> " << line << '\n';
+                } else {
+                    out << ">\n";
+                }
+            }
+        } else if (line.find("<-") != std::string_view::npos) {
+            interpreter.declareFunction(line);
+            if (script) out << "> " << line << '\n';
+            if (options.dumpOptimized) dumpOptimized(interpreter, line, out);
+            if (!script) out << ">\n";
+        } else {
+            out.writeResult(interpreter.evaluate(line));
+        }
+    } catch (const std::exception& e) {
+        writeError(out, e, line, script);
+    }
+    out.endStatement();
+}
+
+// Ctrl-C in the REPL cancels the statement running, which then fails like
+// any other; at the prompt it quits as usual
+static ThisFuncInterpreter* interruptible = nullptr;
+static volatile std::sig_atomic_t evaluating = 0;
+
+static void interrupt(int) {
+    if (evaluating) {
+        interruptible->cancel();
+    } else {
+        std::signal(SIGINT, SIG_DFL);
+        std::raise(SIGINT);
+    }
+}
+
+void runRepl(const RunOptions& options) {
     ThisFuncInterpreter interpreter;
+    configure(interpreter, options);
+    Output out(options.flush);
     std::string input;
 
-    std::cout << "Welcome to thisFunc interpreter. Type 'exit' to quit.\n";
+    interruptible = &interpreter;
+    std::signal(SIGINT, interrupt);
+    out << "Welcome to thisFunc interpreter. Type 'exit' to quit.\n";
+    out.endStatement();
     while (true) {
-        std::getline(std::cin, input);
+        if (!std::getline(std::cin, input) || input == "exit") break;
+        evaluating = 1;
+        runLine(interpreter, input, options, out, false);
+        evaluating = 0;
+    }
+    std::signal(SIGINT, SIG_DFL);
+    out.flush();
+    reportProfile(interpreter, options);
+}
 
-        if (input == "exit") break;
+static bool isEvaluation(std::string_view line) {
+    return !isDirective(line) && line.find("<-") == std::string_view::npos;
+}
 
+// Evaluates lines together (--parallel-statements) and writes their results
+// in line order
+static void runBatch(ThisFuncInterpreter& interpreter, std::vector<std::string_view>& lines, Output& out) {
+    if (lines.empty()) return;
+    std::vector<ThisFuncInterpreter::Evaluation> results = interpreter.evaluateAll(lines);
+    for (size_t i = 0; i < lines.size(); ++i) {
         try {
-            if (input.find("<-") != std::string::npos) {
-                interpreter.declareFunction(input);
-                std::cout << ">\n";
-            } else {
-                Value result = interpreter.evaluate(input);
-                if (std::holds_alternative<double>(result)) {
-                    std::cout << "> " << std::get<double>(result) << "\n";
-                } else {
-                    const auto& list = std::get<std::vector<double>>(result);
-                    std::cout << "> [";
-                    for (size_t i = 0; i < list.size(); ++i) {
-                        std::cout << list[i];
-                        if (i < list.size() - 1) std::cout << ", ";
-                    }
-                    std::cout << "]\n";
-                }
-            }
+            if (results[i].error) std::rethrow_exception(results[i].error);
+            out.writeResult(results[i].value);
         } catch (const std::exception& e) {
-            std::cout << "Error: " << e.what() << "\n";
+            writeError(out, e, lines[i], true);
         }
+        out.endStatement();
     }
+    lines.clear();
 }
 
-void executeFile(const std::string& filename) {
+// Runs every line of text, which is parsed straight out of the mapped file.
+// With --parallel-statements, runs of evaluations between declarations and
+// directives are evaluated concurrently, up to statementBatch lines at a time.
+static void runLines(ThisFuncInterpreter& interpreter, std::string_view text, const RunOptions& options,
+                     Output& out) {
+    constexpr size_t statementBatch = 1024;
+    std::vector<std::string_view> batch;
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t end = text.find('\n', start);
+        if (end == std::string_view::npos) end = text.size();
+        std::string_view line = text.substr(start, end - start);
+        start = end + 1;
+
+        if (options.parallelStatements && isEvaluation(line)) {
+            batch.push_back(line);
+            if (batch.size() == statementBatch) runBatch(interpreter, batch, out);
+        } else {
+            // Declarations and directives change the function table, so
+            // the evaluations before them finish first
+            runBatch(interpreter, batch, out);
+            runLine(interpreter, line, options, out, true);
+        }
+    }
+    runBatch(interpreter, batch, out);
+}
+
+// Compiled script cache (--cache). The declarations a script starts with are
+// saved to <script>.tfc as an interpreter image, together with the output
+// they printed, and later runs load them from there instead of declaring
+// them again. The cache is keyed on a hash of those lines, so changing any of
+// them rebuilds it. A checksum of the rest of the file catches caches
+// damaged after they were written.
+struct CacheHeader {
+    char magic[8];
+    uint64_t key;
+    uint64_t checksum;   // Of everything after the header
+    uint64_t outputSize; // Printed output, followed by the image
+};
+
+static constexpr char cacheMagic[8] = {'T', 'F', 'C', 'A', 'C', 'H', 'E', '2'};
+
+// Length of the declarations at the start of a script, up to the first line
+// that is anything else
+static size_t declarationPrefix(std::string_view contents) {
+    size_t start = 0;
+    while (start < contents.size()) {
+        size_t end = contents.find('\n', start);
+        if (end == std::string_view::npos) end = contents.size();
+        std::string_view line = contents.substr(start, end - start);
+        if (isDirective(line) || line.find("<-") == std::string_view::npos) break;
+        start = std::min(end + 1, contents.size());
+    }
+    return start;
+}
+
+// FNV-1a over the declarations and the options that change what they
+// produce: a limit or stack size can make a declaration fail
+static uint64_t cacheKey(std::string_view declarations, const RunOptions& options) {
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](unsigned char byte) {
+        hash ^= byte;
+        hash *= 1099511628211ull;
+    };
+    auto mixWord = [&mix](uint64_t word) {
+        for (int shift = 0; shift < 64; shift += 8) {
+            mix(static_cast<unsigned char>(word >> shift));
+        }
+    };
+    for (char c : declarations) {
+        mix(static_cast<unsigned char>(c));
+    }
+    mix(options.memoizeAll);
+    mix(options.dumpOptimized);
+    mixWord(options.stackSize);
+    mixWord(options.limits.steps);
+    mixWord(options.limits.milliseconds);
+    mixWord(options.limits.listBytes);
+    return hash;
+}
+
+// FNV-1a a word at a time, folding the high bits back down after each
+// multiply so every bit of the input reaches every bit of the hash
+static uint64_t cacheChecksum(std::string_view bytes) {
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](uint64_t word) {
+        hash = (hash ^ word) * 1099511628211ull;
+        hash ^= hash >> 32;
+    };
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= bytes.size(); i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, bytes.data() + i, sizeof(word));
+        mix(word);
+    }
+    for (; i < bytes.size(); ++i) {
+        mix(static_cast<unsigned char>(bytes[i]));
+    }
+    mix(bytes.size());
+    return hash;
+}
+
+static bool loadCache(ThisFuncInterpreter& interpreter, const std::string& path, uint64_t key, Output& out) {
+    auto cache = std::make_shared<MappedFile>();
+    if (!cache->open(path)) return false;
+    std::string_view contents = cache->contents();
+
+    CacheHeader header;
+    if (contents.size() < sizeof(header)) return false;
+    std::memcpy(&header, contents.data(), sizeof(header));
+    if (std::memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0 || header.key != key ||
+        header.outputSize > contents.size() - sizeof(header) ||
+        header.checksum != cacheChecksum(contents.substr(sizeof(header)))) {
+        return false;
+    }
+    try {
+        // The interpreter decodes functions from the mapping as they are used
+        interpreter.loadImage(contents.substr(sizeof(header) + header.outputSize), cache);
+    } catch (const std::exception&) {
+        return false; // Stale or damaged; the declarations run again and replace it
+    }
+    out << contents.substr(sizeof(header), header.outputSize);
+    return true;
+}
+
+// Writes the cache under a temporary name first, so concurrent runs never
+// load a partly written file. A cache that cannot be written is skipped.
+static void saveCache(const ThisFuncInterpreter& interpreter, const std::string& path, uint64_t key,
+                      const std::string& output) {
+    CacheHeader header;
+    std::memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+    header.key = key;
+    header.outputSize = output.size();
+    std::string image = interpreter.saveImage();
+    header.checksum = cacheChecksum(output + image);
+
+    std::string temporary = path + ".tmp" + std::to_string(getpid());
+    std::ofstream cache(temporary, std::ios::binary);
+    cache.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    cache << output << image;
+    cache.close();
+    if (!cache || std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+    }
+}
+
+// Declares the script's leading declarations from its cache, or runs them and
+// caches the result
+static void runCachedDeclarations(ThisFuncInterpreter& interpreter, std::string_view declarations,
+                                  const std::string& path, const RunOptions& options, Output& out) {
+    uint64_t key = cacheKey(declarations, options);
+    if (loadCache(interpreter, path, key, out)) return;
+
+    std::string printed;
+    {
+        Output capture(printed);
+        runLines(interpreter, declarations, options, capture);
+    }
+    out << printed;
+    saveCache(interpreter, path, key, printed);
+}
+
+void executeFile(const std::string& filename, const RunOptions& options) {
     ThisFuncInterpreter interpreter;
-    std::ifstream file(filename);
+    configure(interpreter, options);
+    MappedFile file;
 
-    if (!file.is_open()) {
+    if (!file.open(filename)) {
         std::cerr << "Error: Unable to open file " << filename << "\n";
         return;
     }
 
-    std::string line;
-    while (std::getline(file, line)) {
-        try {
-            if (line.find("<-") != std::string::npos) {
-                interpreter.declareFunction(line);
-                std::cout << "> " << line << "\n";
-            } else {
-                Value result = interpreter.evaluate(line);
-                if (std::holds_alternative<double>(result)) {
-                    std::cout << "> " << std::get<double>(result) << "\n";
-                } else {
-                    const auto& list = std::get<std::vector<double>>(result);
-                    std::cout << "> [";
-                    for (size_t i = 0; i < list.size(); ++i) {
-                        std::cout << list[i];
-                        if (i < list.size() - 1) std::cout << ", ";
-                    }
-                    std::cout << "]\n";
-                }
-            }
-        } catch (const std::exception& e) {
-            std::cout << "Error: " << e.what() << " (line: " << line << ")\n";
+    Output out(options.flush);
+    std::string_view contents = file.contents();
+    size_t start = 0;
+    // Profiles cover declaring the functions too, so they never use the cache
+    if (options.cache && !options.profile) {
+        start = declarationPrefix(contents);
+        if (start > 0) {
+            runCachedDeclarations(interpreter, contents.substr(0, start), filename + ".tfc", options, out);
+            out.endStatement();
         }
     }
+    runLines(interpreter, contents.substr(start), options, out);
 
-    file.close();
-}
\ No newline at end of file
+    out.flush();
+    reportProfile(interpreter, options);
+}
@@ -1,8 +1,35 @@
 #ifndef REPL_H
 #define REPL_H
 #include <string>
+#include <thread>
+#include "interpreter.h"
+#include "io.h"
 
-void runRepl();               // Runs the interactive REPL
-void executeFile(const std::string& filename); // Executes commands from a file
+// Settings chosen on the command line
+struct RunOptions {
+    Engine engine = Engine::VM;
+    size_t stackSize = 1000000; // Maximum nesting of non-tail calls
+    Limits limits;              // Steps, time and list memory each statement may use
+    bool memoizeAll = false;    // Memoize every user-defined function
+    size_t memoCapacity = 10000; // Entries kept per memoized function
+    size_t threads = std::thread::hardware_concurrency(); // Workers for large map/filter calls
+    size_t parallelThreshold = 10000; // Smallest list split across threads
+    size_t forkDepth = 0;       // Calls this deep or deeper evaluate their arguments in order
+    bool jit = false;           // Compile scalar functions to native code
+    bool dumpOptimized = false; // Print each declared body after optimization
+    bool profile = false;       // Report per-function call statistics at exit
+    std::string profileStacks;  // File receiving collapsed call stacks, if any
+    FlushMode flush = FlushMode::Auto; // When results are written to stdout
+    bool cache = false;         // Keep the script's compiled declarations in <script>.tfc
+    bool parallelStatements = false; // Evaluate consecutive independent lines of a script concurrently
+};
 
-#endif // REPL_H
\ No newline at end of file
+void configure(ThisFuncInterpreter& interpreter, const RunOptions& options); // Applies the settings
+void runRepl(const RunOptions& options = {});               // Runs the interactive REPL
+void executeFile(const std::string& filename, const RunOptions& options = {}); // Executes commands from a file
+
+// Answers requests on a Unix socket until interrupted (server.cpp). The
+// declarations in script, if one is given, are loaded first.
+void runServer(const std::string& socketPath, const std::string& script, const RunOptions& options = {});
+
+#endif // REPL_H
@@ -0,0 +1,521 @@
+#include "repl.h"
+#include "shared.h"
+#include "io.h"
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Server mode (--serve). One interpreter stays loaded and answers any number
+// of local clients over a Unix socket. A request is one line, answered with
+// one line: "> result" or "Error: message" for an expression, ">" for a
+// declaration or directive. Clients may send requests without waiting for
+// the replies (pipelining); each connection's replies come back in the order
+// of its requests.
+//
+// One thread runs an epoll loop that accepts connections, splits what they
+// send into lines and writes the replies. Expressions are evaluated by a
+// fixed set of workers against the SharedInterpreter snapshot of every
+// declaration read before them, so a client's expressions see exactly its
+// earlier declarations. Declarations and :memo publish new versions on a
+// writer thread of their own, one at a time in the order they were read, so
+// the loop keeps serving while a large library is rebuilt; expressions read
+// while some are queued take their snapshot from the writer's queue too.
+
+namespace {
+
+// Requests a connection may have unanswered before the loop stops reading
+// from it, so a client that never reads cannot make the server buffer
+// without bound
+constexpr size_t maxPending = 1024;
+
+struct Reply {
+    std::string text;
+    std::atomic<bool> ready{false}; // Set by the worker once text is complete
+};
+
+struct Connection {
+    int fd;
+    uint32_t events = 0;   // What the loop currently waits for
+    std::string input;     // Received, not yet split into requests
+    std::string output;    // Replies not yet written
+    std::deque<std::shared_ptr<Reply>> replies; // Unwritten, in request order
+    bool closing = false;  // Close once the replies are written
+};
+
+// Connections with replies that became ready, passed from the workers to the
+// loop. The eventfd wakes the loop when the list stops being empty.
+class Completions {
+public:
+    explicit Completions(int wake) : wake(wake) {}
+
+    void add(int fd) {
+        bool first;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            first = fds.empty();
+            fds.push_back(fd);
+        }
+        if (first) {
+            uint64_t one = 1;
+            while (write(wake, &one, sizeof(one)) < 0 && errno == EINTR) {}
+        }
+    }
+
+    std::vector<int> take() {
+        uint64_t count;
+        while (read(wake, &count, sizeof(count)) < 0 && errno == EINTR) {}
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::exchange(fds, {});
+    }
+
+private:
+    int wake;
+    std::mutex mutex;
+    std::vector<int> fds;
+};
+
+// Worker threads taking evaluations from one queue. Stopping waits for the
+// evaluations already running and drops the rest.
+class Workers {
+public:
+    explicit Workers(size_t count) {
+        for (size_t i = 0; i < std::max<size_t>(count, 1); ++i) {
+            threads.emplace_back([this] { run(); });
+        }
+    }
+
+    ~Workers() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            tasks.clear();
+        }
+        wake.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        wake.notify_one();
+    }
+
+private:
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::function<void()>> tasks;
+    bool stopping = false;
+
+    void run() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+};
+
+// Formats a result into text, through one buffer per worker thread
+void writeReply(std::string& text, const std::function<void(Output&)>& write) {
+    thread_local std::string formatted;
+    thread_local Output out(formatted);
+    try {
+        write(out);
+    } catch (const std::exception& e) {
+        out << "Error: " << e.what() << '\n';
+    }
+    out.flush();
+    text.swap(formatted);
+    formatted.clear();
+}
+
+class Server {
+public:
+    Server(SharedInterpreter& shared, size_t threads, int listener, int epoll, int wake)
+        : shared(shared), listener(listener), epoll(epoll), completions(wake), workers(threads) {}
+
+    ~Server() {
+        for (auto& entry : connections) {
+            close(entry.first);
+        }
+    }
+
+    void accept() {
+        while (true) {
+            int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                return; // EAGAIN, or out of descriptors until a client leaves
+            }
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+                close(fd); // Out of memory for the watch; the client sees the connection closed
+                continue;
+            }
+            Connection& connection = connections[fd];
+            connection.fd = fd;
+            connection.events = event.events;
+        }
+    }
+
+    void delivered() {
+        for (int fd : completions.take()) {
+            auto it = connections.find(fd);
+            // A connection closed since, or a later one reusing its descriptor,
+            // only has its ready replies looked at
+            if (it != connections.end()) flush(it->second);
+        }
+    }
+
+    void ready(int fd, uint32_t events) {
+        auto it = connections.find(fd);
+        if (it == connections.end()) return;
+        Connection& connection = it->second;
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            drop(connection);
+            return;
+        }
+        if (events & EPOLLIN) {
+            receive(connection); // Which writes what it can too
+        } else if (events & EPOLLOUT) {
+            flush(connection);
+        }
+    }
+
+private:
+    SharedInterpreter& shared;
+    int listener;
+    int epoll;
+    Completions completions;
+    Workers workers;
+    // Publishes declarations and :memo. Declared after workers, so it stops
+    // first: what it runs may hand evaluations to the workers.
+    Workers writer{1};
+    std::atomic<size_t> queuedUpdates{0}; // Given to the writer, not yet published
+    std::unordered_map<int, Connection> connections;
+
+    void receive(Connection& connection) {
+        char chunk[1 << 16];
+        while (true) {
+            ssize_t count = read(connection.fd, chunk, sizeof(chunk));
+            if (count < 0 && errno == EINTR) continue;
+            if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (count <= 0) {
+                // The client finished sending; a last line without a newline
+                // still counts
+                if (!connection.input.empty() && connection.input.back() != '\n') connection.input.push_back('\n');
+                connection.closing = true;
+                break;
+            }
+            connection.input.append(chunk, static_cast<size_t>(count));
+        }
+        dispatch(connection);
+        flush(connection);
+    }
+
+    // Starts a request for each complete line received, as long as the
+    // connection is under maxPending
+    void dispatch(Connection& connection) {
+        size_t start = 0;
+        while (connection.replies.size() < maxPending) {
+            size_t end = connection.input.find('\n', start);
+            if (end == std::string::npos) break;
+            std::string_view line(connection.input.data() + start, end - start);
+            start = end + 1;
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            if (line == "exit") {
+                connection.closing = true;
+                connection.input.clear();
+                return;
+            }
+            connection.replies.push_back(request(connection.fd, line));
+        }
+        connection.input.erase(0, start);
+    }
+
+    using Version = std::shared_ptr<const SharedInterpreter::Snapshot>;
+    using Answer = std::function<void(const Version& snapshot, Output& out)>;
+
+    // The REPL's directives, but for :memo-stats: every version has its own
+    // caches, so their counters say little about the server as a whole
+    std::shared_ptr<Reply> request(int fd, std::string_view line) {
+        auto reply = std::make_shared<Reply>();
+        size_t first = line.find_first_not_of(" \t");
+        std::string statement = trim(line);
+        if (first != std::string_view::npos && line[first] == ':') {
+            if (statement.rfind(":memo ", 0) == 0) {
+                std::string name = trim(std::string_view(statement).substr(6));
+                update(fd, reply, [this, name] {
+                    shared.update([&](ThisFuncInterpreter& interpreter) { interpreter.memoize(name); });
+                });
+            } else if (statement.rfind(":type ", 0) == 0) {
+                std::string name = trim(std::string_view(statement).substr(6));
+                evaluate(fd, reply, [name](const Version& snapshot, Output& out) {
+                    out << "> " << name << ": " << snapshot->signature(name) << '\n';
+                });
+            } else {
+                writeReply(reply->text, [&](Output&) { throw std::runtime_error("Unknown directive: " + statement); });
+                reply->ready.store(true, std::memory_order_relaxed);
+            }
+        } else if (line.find("<-") != std::string_view::npos) {
+            update(fd, reply, [this, declaration = std::string(line)] { shared.declare({declaration}); });
+        } else {
+            evaluate(fd, reply, [expression = std::string(line)](const Version& snapshot, Output& out) {
+                out.writeResult(snapshot->evaluate(expression));
+            });
+        }
+        return reply;
+    }
+
+    // Publishes a change on the writer and answers ">" once it is
+    void update(int fd, const std::shared_ptr<Reply>& reply, std::function<void()> publish) {
+        queuedUpdates.fetch_add(1, std::memory_order_relaxed);
+        writer.submit([this, fd, reply, publish = std::move(publish)] {
+            writeReply(reply->text, [&](Output& out) {
+                publish();
+                out << ">\n";
+            });
+            queuedUpdates.fetch_sub(1, std::memory_order_release);
+            complete(fd, *reply);
+        });
+    }
+
+    // Answers on a worker, against the version with every change read so
+    // far. While changes are queued, that version does not exist yet, so the
+    // snapshot is taken on the writer once the changes before are published.
+    void evaluate(int fd, const std::shared_ptr<Reply>& reply, Answer answer) {
+        auto run = [this, fd, reply, answer = std::move(answer)](Version snapshot) {
+            workers.submit([this, fd, reply, answer, snapshot = std::move(snapshot)] {
+                writeReply(reply->text, [&](Output& out) { answer(snapshot, out); });
+                complete(fd, *reply);
+            });
+        };
+        if (queuedUpdates.load(std::memory_order_acquire) == 0) {
+            run(shared.snapshot());
+        } else {
+            writer.submit([this, run = std::move(run)] { run(shared.snapshot()); });
+        }
+    }
+
+    void complete(int fd, Reply& reply) {
+        reply.ready.store(true, std::memory_order_release);
+        completions.add(fd);
+    }
+
+    // Moves the replies that are ready, up to the first that is not, to the
+    // output and writes as much of it as the socket takes
+    void flush(Connection& connection) {
+        while (!connection.replies.empty() && connection.replies.front()->ready.load(std::memory_order_acquire)) {
+            connection.output += connection.replies.front()->text;
+            connection.replies.pop_front();
+            // Lines left waiting while the connection was at maxPending
+            if (connection.replies.size() == maxPending - 1) dispatch(connection);
+        }
+
+        size_t written = 0;
+        while (written < connection.output.size()) {
+            ssize_t count = send(connection.fd, connection.output.data() + written,
+                                 connection.output.size() - written, MSG_NOSIGNAL);
+            if (count < 0 && errno == EINTR) continue;
+            if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (count < 0) {
+                drop(connection);
+                return;
+            }
+            written += static_cast<size_t>(count);
+        }
+        connection.output.erase(0, written);
+
+        if (connection.closing && connection.replies.empty() && connection.output.empty()) {
+            drop(connection);
+            return;
+        }
+        watch(connection);
+    }
+
+    // Waits for input while there is room for more requests, and for the
+    // socket to take more while output is left
+    void watch(Connection& connection) {
+        uint32_t events = 0;
+        if (!connection.closing && connection.replies.size() < maxPending) events |= EPOLLIN;
+        if (!connection.output.empty()) events |= EPOLLOUT;
+        if (events == connection.events) return;
+        connection.events = events;
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = connection.fd;
+        if (epoll_ctl(epoll, EPOLL_CTL_MOD, connection.fd, &event) != 0) drop(connection);
+    }
+
+    // Evaluations still running finish into replies nobody reads
+    void drop(Connection& connection) {
+        int fd = connection.fd;
+        epoll_ctl(epoll, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        connections.erase(fd);
+    }
+};
+
+// Declares the script's declarations and runs its directives, as one version
+bool loadScript(SharedInterpreter& shared, const std::string& script) {
+    MappedFile file;
+    if (!file.open(script)) {
+        std::cerr << "Error: Unable to open file " << script << "\n";
+        return false;
+    }
+    std::string_view contents = file.contents();
+    std::string_view failed;
+    try {
+        shared.update([&](ThisFuncInterpreter& interpreter) {
+            size_t start = 0;
+            while (start < contents.size()) {
+                size_t end = contents.find('\n', start);
+                if (end == std::string_view::npos) end = contents.size();
+                std::string_view line = contents.substr(start, end - start);
+                start = end + 1;
+                failed = line;
+
+                std::string statement = trim(line);
+                if (statement.empty()) continue;
+                if (statement.rfind(":memo ", 0) == 0) {
+                    interpreter.memoize(trim(std::string_view(statement).substr(6)));
+                } else if (statement.find("<-") != std::string::npos) {
+                    interpreter.declareFunction(line);
+                } else {
+                    throw std::runtime_error("Only declarations and :memo are loaded before serving");
+                }
+            }
+        });
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << " (line: " << failed << ")\n";
+        return false;
+    }
+    return true;
+}
+
+int openSocket(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Error: Socket path too long: " << path << "\n";
+        return -1;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    // A socket left behind by an earlier server is replaced; anything else
+    // at the path is not
+    struct stat info;
+    if (lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) unlink(path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        ::listen(fd, SOMAXCONN) != 0) {
+        std::cerr << "Error: Unable to listen on " << path << ": " << std::strerror(errno) << "\n";
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+} // namespace
+
+void runServer(const std::string& socketPath, const std::string& script, const RunOptions& options) {
+    // SIGINT and SIGTERM stop the loop through a signalfd, so the socket
+    // file is removed on the way out. They are blocked before any thread
+    // starts (the interpreter's pool too), so every thread inherits that.
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+
+    SharedInterpreter shared;
+    shared.update([&](ThisFuncInterpreter& interpreter) { configure(interpreter, options); });
+    if (!script.empty() && !loadScript(shared, script)) return;
+
+    int listener = openSocket(socketPath);
+    if (listener < 0) return;
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    int wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int stop = signalfd(-1, &stopSignals, SFD_NONBLOCK | SFD_CLOEXEC);
+    bool watching = epoll >= 0 && wake >= 0 && stop >= 0;
+    for (int fd : {listener, wake, stop}) {
+        if (!watching) break;
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        watching = epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) == 0;
+    }
+    auto closeAll = [&] {
+        for (int fd : {stop, wake, epoll, listener}) {
+            if (fd >= 0) close(fd);
+        }
+        unlink(socketPath.c_str());
+    };
+    if (!watching) {
+        std::cerr << "Error: Unable to serve on " << socketPath << ": " << std::strerror(errno) << "\n";
+        closeAll();
+        return;
+    }
+    std::cerr << "Serving on " << socketPath << "\n";
+
+    {
+        Server server(shared, options.threads, listener, epoll, wake);
+        epoll_event events[64];
+        bool running = true;
+        while (running) {
+            int count = epoll_wait(epoll, events, 64, -1);
+            if (count < 0 && errno == EINTR) continue;
+            if (count < 0) {
+                std::cerr << "Error: Unable to wait for connections: " << std::strerror(errno) << "\n";
+                break;
+            }
+            for (int i = 0; i < count; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == stop) {
+                    running = false;
+                } else if (fd == listener) {
+                    server.accept();
+                } else if (fd == wake) {
+                    server.delivered();
+                } else {
+                    server.ready(fd, events[i].events);
+                }
+            }
+        }
+    }
+
+    closeAll();
+}
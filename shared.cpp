@@ -0,0 +1,117 @@
+#include "shared.h"
+#include <algorithm>
+
+namespace {
+
+// Hazard pointers (Michael, 2004): a reader announces the version it is
+// about to take in a record of its own, and a writer frees a replaced
+// version only when no record announces it. Records are never freed; a
+// thread takes one that is not in use, or adds one, and gives it back when
+// it ends.
+struct HazardRecord {
+    std::atomic<const void*> pointer{nullptr};
+    std::atomic<bool> active{true};
+    HazardRecord* next = nullptr;
+};
+
+std::atomic<HazardRecord*> hazardRecords{nullptr};
+
+HazardRecord* acquireRecord() {
+    for (HazardRecord* record = hazardRecords.load(); record; record = record->next) {
+        bool active = false;
+        if (record->active.compare_exchange_strong(active, true)) return record;
+    }
+    HazardRecord* record = new HazardRecord;
+    HazardRecord* head = hazardRecords.load();
+    do {
+        record->next = head;
+    } while (!hazardRecords.compare_exchange_weak(head, record));
+    return record;
+}
+
+struct ThreadHazard {
+    HazardRecord* record = acquireRecord();
+    ~ThreadHazard() {
+        record->pointer.store(nullptr);
+        record->active.store(false);
+    }
+};
+
+thread_local ThreadHazard threadHazard;
+
+} // namespace
+
+Value SharedInterpreter::Snapshot::evaluate(std::string_view expression) const {
+    return interpreter->evaluatePublished(expression);
+}
+
+SharedInterpreter::SharedInterpreter()
+    : current(new Published(new Snapshot(std::make_shared<ThisFuncInterpreter>(), 0))) {}
+
+SharedInterpreter::~SharedInterpreter() {
+    delete current.load();
+    for (const Published* published : retired) {
+        delete published;
+    }
+}
+
+// The version stays announced until the reference to it is taken, and is
+// only taken if it was still current once announced, so the writer that
+// replaces it either sees the announcement or published before it was made
+std::shared_ptr<const SharedInterpreter::Snapshot> SharedInterpreter::snapshot() const {
+    std::atomic<const void*>& hazard = threadHazard.record->pointer;
+    const Published* published = current.load();
+    while (true) {
+        hazard.store(published);
+        const Published* again = current.load();
+        if (again == published) break;
+        published = again;
+    }
+    Published snapshot = *published;
+    hazard.store(nullptr);
+    return snapshot;
+}
+
+uint64_t SharedInterpreter::update(const std::function<void(ThisFuncInterpreter&)>& change) {
+    std::lock_guard<std::mutex> lock(writer);
+    const Snapshot& last = **current.load();
+    std::shared_ptr<ThisFuncInterpreter> next(new ThisFuncInterpreter(*last.interpreter));
+    change(*next);
+    // Functions still in a loaded image are decoded on first use, which
+    // would change the table while it is read. Published versions have
+    // none, so only the entries the change copied or added can; decoding
+    // adds the ones it edits to the same list.
+    const std::vector<size_t>& changed = next->functions.changed();
+    for (size_t i = 0; i < changed.size(); ++i) {
+        next->materialize(changed[i]);
+    }
+    uint64_t version = last.version() + 1;
+    retired.push_back(current.exchange(new Published(new Snapshot(std::move(next), version))));
+
+    // Frees the replaced versions no reader announces
+    std::vector<const void*> announced;
+    for (HazardRecord* record = hazardRecords.load(); record; record = record->next) {
+        if (const void* pointer = record->pointer.load()) announced.push_back(pointer);
+    }
+    auto free = std::remove_if(retired.begin(), retired.end(), [&](const Published* published) {
+        if (std::find(announced.begin(), announced.end(), published) != announced.end()) return false;
+        delete published;
+        return true;
+    });
+    retired.erase(free, retired.end());
+    return version;
+}
+
+uint64_t SharedInterpreter::declare(const std::vector<std::string>& declarations) {
+    return update([&](ThisFuncInterpreter& interpreter) {
+        for (const auto& declaration : declarations) {
+            interpreter.declareFunction(declaration);
+        }
+    });
+}
+
+uint64_t SharedInterpreter::declareList(const std::string& name, std::vector<double> elements) {
+    return update([&](ThisFuncInterpreter& interpreter) {
+        interpreter.declareList(name, std::move(elements));
+    });
+}
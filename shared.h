@@ -0,0 +1,75 @@
+#ifndef SHARED_H
+#define SHARED_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "interpreter.h"
+
+// ThisFunc for programs that evaluate on many threads at once. The function
+// table is published in versions: a change is made to a copy of the current
+// version, which replaces it once complete (read-copy-update). The copy
+// shares every entry of the table until the change edits it, so a change
+// costs what it declares and rebuilds, plus copying the names and a pointer
+// per entry. With --jit, the native code of every version stays in one
+// arena until the last version is gone, so it grows with each function that
+// is rebuilt.
+//
+// Evaluations use the version current when they start and never see a
+// half-made change. Neither getting that version nor evaluating against it
+// takes a lock: the current version is an atomic pointer, and a replaced one
+// is only freed once no reader is still taking it (hazard pointers). Changes
+// wait for each other.
+class SharedInterpreter {
+public:
+    // One published version of the table. It never changes, stays usable
+    // after later versions are published, and can be evaluated against from
+    // any number of threads.
+    class Snapshot {
+    public:
+        uint64_t version() const { return number; }
+
+        // Names declared in later versions are unknown here
+        Value evaluate(std::string_view expression) const;
+        std::string signature(const std::string& name) const { return interpreter->signature(name); }
+
+    private:
+        friend class SharedInterpreter;
+        Snapshot(std::shared_ptr<ThisFuncInterpreter> interpreter, uint64_t number)
+            : interpreter(std::move(interpreter)), number(number) {}
+
+        std::shared_ptr<ThisFuncInterpreter> interpreter;
+        uint64_t number;
+    };
+
+    SharedInterpreter();
+    ~SharedInterpreter();
+    SharedInterpreter(const SharedInterpreter&) = delete;
+    SharedInterpreter& operator=(const SharedInterpreter&) = delete;
+
+    std::shared_ptr<const Snapshot> snapshot() const;
+    Value evaluate(std::string_view expression) const { return snapshot()->evaluate(expression); }
+
+    // Applies change to a copy of the current version and publishes it,
+    // returning its version number. If change throws, nothing is published.
+    // Settings (engine, threads, memoization, ...) are changed this way too.
+    uint64_t update(const std::function<void(ThisFuncInterpreter&)>& change);
+
+    // The declarations are published together, or none of them if one fails
+    uint64_t declare(const std::vector<std::string>& declarations);
+    uint64_t declareList(const std::string& name, std::vector<double> elements);
+
+private:
+    using Published = std::shared_ptr<const Snapshot>;
+
+    std::mutex writer; // Held while a change is made
+    std::atomic<const Published*> current;
+    std::vector<const Published*> retired; // Replaced, but maybe still being taken by a reader
+};
+
+#endif // SHARED_H
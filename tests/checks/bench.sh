@@ -0,0 +1,12 @@
+# thisFuncBench runs the workloads it is given on both engines and reports
+# each as one entry of its JSON
+if "$bin/thisFuncBench" fib_20 tail_walk_1e5 factorial_2000 > "$work/bench" 2>&1; then
+    for workload in fib_20 tail_walk_1e5 factorial_2000; do
+        for engine in vm tree; do
+            grep -q "\"name\": \"$workload\", \"engine\": \"$engine\"" "$work/bench" ||
+                fail "bench: no $workload on $engine"
+        done
+    done
+else
+    fail "bench: $(cat "$work/bench")"
+fi
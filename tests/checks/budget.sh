@@ -0,0 +1,11 @@
+# Each limit stops the statements that exceed it and no others, the same
+# way on every engine. --memo is left out: cached calls take fewer steps,
+# and memoized tail calls use the stack.
+for mode in --engine=tree --engine=vm --jit --threads=4 "--parallel-statements --threads=4"; do
+    # shellcheck disable=SC2086 # mode holds several flags
+    expect budget/steps.out "budget/steps.txt $mode" $mode --max-steps=100000 budget/steps.txt
+    # shellcheck disable=SC2086
+    expect budget/list-bytes.out "budget/list-bytes.txt $mode" $mode --max-list-bytes=100000 budget/list-bytes.txt
+    # shellcheck disable=SC2086
+    expect budget/time.out "budget/time.txt $mode" $mode --time-limit=200 budget/time.txt
+done
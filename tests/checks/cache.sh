@@ -0,0 +1,27 @@
+# --cache writes library.txt.tfc on the first run and loads it on the next.
+# A cache damaged anywhere is rebuilt rather than trusted.
+cp cache/library.txt "$work/library.txt"
+cache="$work/library.txt.tfc"
+for mode in --engine=tree --engine=vm --jit; do
+    rm -f "$cache"
+    expect cache/library.out "cache $mode: first run" --cache $mode "$work/library.txt"
+    [ -f "$cache" ] || fail "cache $mode: no cache written"
+    expect cache/library.out "cache $mode: cached run" --cache $mode "$work/library.txt"
+    size=$(wc -c < "$cache")
+    for offset in 0 9 17 24 40 $((size / 2)) $((size - 1)); do
+        cp "$cache" "$work/saved.tfc"
+        printf '\377' | dd of="$cache" bs=1 seek="$offset" conv=notrunc 2> /dev/null
+        expect cache/library.out "cache $mode: byte $offset corrupted" --cache $mode "$work/library.txt"
+        cmp -s "$cache" "$work/saved.tfc" || fail "cache $mode: not rebuilt after byte $offset was corrupted"
+    done
+    head -c $((size / 3)) "$work/saved.tfc" > "$cache"
+    expect cache/library.out "cache $mode: truncated" --cache $mode "$work/library.txt"
+done
+
+# Limits and the stack size change what declarations produce, so a cache
+# written without them is not used with them
+cp cache/limits.txt "$work/limits.txt"
+rm -f "$work/limits.txt.tfc"
+expect cache/limits.out "cache limits: uncached" --max-list-bytes=16 "$work/limits.txt"
+"$interpreter" --cache "$work/limits.txt" > /dev/null 2>&1
+expect cache/limits.out "cache limits: cached without them" --cache --max-list-bytes=16 "$work/limits.txt"
@@ -0,0 +1,8 @@
+# User functions called by builtins (map, reduce, ...) recurse through them
+# on the native stack. Running out of it is an error like any other, at a
+# depth that depends on the engine, so the depth is left out.
+for mode in --engine=tree --engine=vm --jit --memo "--threads=4 --parallel-threshold=1"; do
+    # shellcheck disable=SC2086 # mode holds several flags
+    "$interpreter" $mode recursion/builtins.txt 2>&1 | sed 's/deeper than [0-9]* calls/deeper than N calls/' > "$work/actual"
+    cmp -s "$work/actual" recursion/builtins.out || fail "recursion/builtins.txt $mode"
+done
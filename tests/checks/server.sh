@@ -0,0 +1,39 @@
+# --serve answers pipelined requests from several connections, in order on
+# each, and removes its socket when stopped
+socket="$work/server.sock"
+"$interpreter" --serve="$socket" --threads=4 server/library.txt 2> "$work/server.log" &
+server=$!
+tries=0
+while [ ! -S "$socket" ] && [ $tries -lt 100 ]; do
+    sleep 0.1
+    tries=$((tries + 1))
+done
+
+# serve <description> <errors expected> <thisFuncLoad arguments...>
+serve() {
+    description=$1
+    errors=$2
+    shift 2
+    result=$("$bin/thisFuncLoad" "$@")
+    case $result in
+    *"\"errors\": $errors, \"failed_connections\": 0"*) ;;
+    *) fail "server: $description: $result" ;;
+    esac
+}
+serve "expressions" 0 --connections=4 --requests=4000 "$socket" "fib(15)" "head(tail(map(sq, list(1, 2, 3))))" "add(1, 2)"
+serve "declarations between expressions" 0 --connections=1 --requests=1000 "$socket" "g <- add(#0, 1)" "g(fib(10))" ":memo g"
+serve "errors" 500 --connections=2 --requests=500 "$socket" "div(1, 0)"
+
+kill -TERM "$server"
+wait "$server"
+[ -S "$socket" ] && fail "server: socket left behind"
+grep -q "^Serving on " "$work/server.log" || fail "server: did not start: $(cat "$work/server.log")"
+
+# --profile keeps one call stack, which the server's workers cannot share
+for flag in --profile --profile-stacks="$work/stacks"; do
+    if "$interpreter" --serve="$socket" "$flag" server/library.txt > /dev/null 2> "$work/server.log"; then
+        fail "server: accepted $flag"
+    fi
+    grep -q "^Error: --profile cannot be used with --serve" "$work/server.log" || fail "server: $flag: $(cat "$work/server.log")"
+    [ -S "$socket" ] && fail "server: $flag opened the socket"
+done
@@ -0,0 +1,2 @@
+# The embedding API: snapshots, failed changes and readers racing a writer
+"$bin/tests/sharedCheck" > "$work/shared" 2>&1 || fail "shared: $(cat "$work/shared")"
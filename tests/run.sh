@@ -0,0 +1,51 @@
+#!/bin/sh
+# Runs the interpreter's checks (make check). Each script in scripts/ must
+# print its .out file, run as is and with each line of flags in modes. The
+# files in checks/ then cover what has no single expected output that way.
+#
+# Usage: tests/run.sh [directory with the built programs]
+
+cd "$(dirname "$0")" || exit 1
+bin=${1:-..}
+interpreter=$bin/thisFuncInterpreter
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+failures=0
+
+fail() {
+    echo "FAIL: $*"
+    failures=$((failures + 1))
+}
+
+# expect <expected output> <description> <interpreter arguments...>
+expect() {
+    expected=$1
+    description=$2
+    shift 2
+    "$interpreter" "$@" > "$work/actual" 2>&1
+    if ! cmp -s "$work/actual" "$expected"; then
+        fail "$description"
+        diff "$expected" "$work/actual" | head -20
+    fi
+}
+
+for script in scripts/*.txt; do
+    expect "${script%.txt}.out" "$script" "$script"
+    while IFS= read -r mode; do
+        case $mode in '#'* | '') continue ;; esac
+        # shellcheck disable=SC2086 # mode holds several flags
+        expect "${script%.txt}.out" "$script $mode" $mode "$script"
+    done < modes
+done
+
+for check in checks/*.sh; do
+    [ -f "$check" ] || continue
+    # shellcheck source=/dev/null
+    . "./$check"
+done
+
+if [ $failures -gt 0 ]; then
+    echo "$failures checks failed"
+    exit 1
+fi
+echo "All checks passed"
@@ -0,0 +1,130 @@
+// Checks of SharedInterpreter (shared.h), run by tests/checks/shared.sh.
+// Prints what failed and exits with 1 if anything did.
+
+#include "../shared.h"
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const std::string& what) {
+    if (!condition) {
+        std::cout << "FAIL: " << what << "\n";
+        ++failures;
+    }
+}
+
+// What evaluating expression against snapshot gives, or the error
+std::string result(const SharedInterpreter::Snapshot& snapshot, const std::string& expression) {
+    try {
+        return std::to_string(snapshot.evaluate(expression).number());
+    } catch (const std::exception& e) {
+        return e.what();
+    }
+}
+
+// A snapshot keeps the table it was taken with
+void checkIsolation() {
+    SharedInterpreter shared;
+    shared.declare({"f <- 1"});
+    auto before = shared.snapshot();
+    uint64_t version = shared.declare({"f <- 2", "g <- add(f(), 1)"});
+    auto after = shared.snapshot();
+
+    check(after->version() == version && version == before->version() + 1, "versions are numbered in order");
+    check(result(*before, "f()") == "1.000000", "an old snapshot sees the old f");
+    check(result(*before, "g()") == "Unknown function: g", "an old snapshot does not see later names");
+    check(result(*after, "g()") == "3.000000", "a new snapshot sees the whole change");
+}
+
+// A change that fails publishes none of it
+void checkFailedChange() {
+    SharedInterpreter shared;
+    shared.declare({"f <- 1"});
+    uint64_t version = shared.snapshot()->version();
+    try {
+        shared.declare({"f <- 2", "g <- add("});
+        check(false, "a broken declaration is rejected");
+    } catch (const std::exception&) {
+    }
+    check(shared.snapshot()->version() == version, "a failed change publishes no version");
+    check(shared.evaluate("f()").number() == 1, "a failed change leaves f as it was");
+}
+
+// Readers evaluating while versions are published never see half of one:
+// v and w are always declared together
+void checkConcurrentReaders(bool jit) {
+    SharedInterpreter shared;
+    shared.update([&](ThisFuncInterpreter& interpreter) {
+        interpreter.setThreads(4);
+        interpreter.setJit(jit);
+    });
+    shared.declare({"v <- 0", "w <- 0", "fib <- if(le(#0, 1), #0, add(fib(sub(#0, 1)), fib(sub(#0, 2))))",
+                    "g <- add(fib(#0), v())"});
+    std::atomic<bool> stop{false};
+    std::atomic<int> wrong{0};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t) {
+        readers.emplace_back([&] {
+            while (!stop.load()) {
+                auto snapshot = shared.snapshot();
+                if (snapshot->evaluate("sub(v(), w())").number() != 0) ++wrong;
+                if (snapshot->evaluate("sub(g(15), v())").number() != 610) ++wrong;
+            }
+        });
+    }
+    for (int k = 1; k <= 200; ++k) {
+        shared.declare({"v <- " + std::to_string(k), "w <- " + std::to_string(k)});
+        if (k == 100) shared.update([](ThisFuncInterpreter& interpreter) { interpreter.memoize("fib"); });
+    }
+    stop = true;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    check(wrong.load() == 0, std::string("readers see whole versions") + (jit ? " with --jit" : ""));
+    check(shared.evaluate("v()").number() == 200, "the last version is current");
+}
+
+// A change that loads a compiled image publishes its functions decoded, so
+// readers evaluating them at once never decode them themselves
+void checkImage() {
+    ThisFuncInterpreter source;
+    source.declareFunction("sq <- mul(#0, #0)");
+    source.declareFunction("quad <- sq(sq(#0))");
+    std::string image = source.saveImage();
+
+    SharedInterpreter shared;
+    shared.update([&](ThisFuncInterpreter& interpreter) { interpreter.loadImage(image); });
+    std::atomic<int> wrong{0};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t) {
+        readers.emplace_back([&] {
+            auto snapshot = shared.snapshot();
+            for (int i = 0; i < 100; ++i) {
+                if (result(*snapshot, "quad(3)") != "81.000000") ++wrong;
+            }
+        });
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    check(wrong.load() == 0, "readers evaluate the functions of a loaded image");
+    shared.declare({"g <- add(quad(2), 1)"});
+    check(result(*shared.snapshot(), "g()") == "17.000000", "later changes call the functions of a loaded image");
+}
+
+} // namespace
+
+int main() {
+    checkIsolation();
+    checkFailedChange();
+    checkConcurrentReaders(false);
+    checkConcurrentReaders(true);
+    checkImage();
+    return failures > 0 ? 1 : 0;
+}
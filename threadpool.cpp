@@ -0,0 +1,107 @@
+#include "threadpool.h"
+
+namespace {
+
+// Index of the pool queue owned by the current thread, or npos outside workers
+thread_local size_t currentWorker = static_cast<size_t>(-1);
+thread_local const ThreadPool* currentPool = nullptr;
+
+} // namespace
+
+ThreadPool::ThreadPool(size_t threads) {
+    if (threads == 0) threads = 1;
+    for (size_t i = 0; i < threads; ++i) {
+        queues.push_back(std::make_unique<Queue>());
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back([this, i] { workerLoop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::push(size_t queue, std::function<void()> task) {
+    // Count the task before it becomes visible so queued never underflows
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        ++queued;
+    }
+    {
+        std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+        queues[queue]->tasks.push_back(std::move(task));
+    }
+    wake.notify_one();
+}
+
+// Runs one task: the newest from the home queue, else the oldest from another
+bool ThreadPool::runOne(size_t home) {
+    std::function<void()> task;
+    for (size_t offset = 0; offset < queues.size() && !task; ++offset) {
+        Queue& queue = *queues[(home + offset) % queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) continue;
+        if (offset == 0) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+    }
+    if (!task) return false;
+    --queued;
+    task();
+    return true;
+}
+
+void ThreadPool::workerLoop(size_t index) {
+    currentWorker = index;
+    currentPool = this;
+    while (true) {
+        if (runOne(index)) continue;
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wake.wait(lock, [this] { return queued > 0 || stopping; });
+        if (stopping && queued == 0) return;
+    }
+}
+
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)>& task) {
+    if (count == 0) return;
+
+    // The last task of the batch wakes the caller. Tasks count down under the
+    // mutex, so once the caller has seen 0 under it no task touches the batch.
+    struct Batch {
+        std::mutex mutex;
+        std::condition_variable done;
+        std::atomic<size_t> remaining;
+    } batch;
+    batch.remaining = count;
+    bool onWorker = currentPool == this;
+    size_t home = onWorker ? currentWorker : 0;
+
+    // Spread the batch over all queues; idle workers steal the rest
+    for (size_t i = 0; i < count; ++i) {
+        size_t queue = onWorker ? home : i % queues.size();
+        push(queue, [&task, &batch, i] {
+            task(i);
+            std::lock_guard<std::mutex> lock(batch.mutex);
+            if (--batch.remaining == 0) batch.done.notify_one();
+        });
+    }
+
+    // Help while there are tasks to take, then sleep until the ones other
+    // threads took are finished
+    while (batch.remaining > 0 && runOne(home)) {
+    }
+    std::unique_lock<std::mutex> lock(batch.mutex);
+    batch.done.wait(lock, [&batch] { return batch.remaining == 0; });
+}
@@ -0,0 +1,51 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads with one task deque each. A worker takes
+// tasks from the back of its own deque and, when that is empty, steals from
+// the front of the others'. Threads waiting for a batch help run tasks, so
+// nested batches (a task that starts another batch) cannot deadlock, and
+// sleep once there are none left to take.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const { return workers.size(); }
+
+    // Runs task(i) for every i in [0, count) and returns once all are done.
+    // Tasks must not throw.
+    void parallelFor(size_t count, const std::function<void(size_t)>& task);
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> queued{0};
+    std::atomic<bool> stopping{false};
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+
+    void workerLoop(size_t index);
+    bool runOne(size_t home);
+    void push(size_t queue, std::function<void()> task);
+};
+
+#endif // THREADPOOL_H
@@ -0,0 +1,154 @@
+#ifndef VALUE_H
+#define VALUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+// Immutable list of numbers. Elements live in a reference-counted buffer
+// shared by every copy; a List is a view (offset, length) into it, so
+// copying, head and tail are O(1) and never copy elements.
+class List {
+public:
+    List() = default;
+    explicit List(std::vector<double> elements)
+        : storage(std::make_shared<const std::vector<double>>(std::move(elements))),
+          offset(0), length(storage->size()) {}
+    // The elements of storage from offset on, sharing them
+    List(std::shared_ptr<const std::vector<double>> storage, size_t offset)
+        : storage(std::move(storage)), offset(offset), length(this->storage->size() - offset) {}
+
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    const double* data() const { return storage ? storage->data() + offset : nullptr; }
+    const double* begin() const { return data(); }
+    const double* end() const { return data() + length; }
+    double operator[](size_t i) const { return data()[i]; }
+
+    // The list without its first element, sharing the same buffer
+    List tail() const {
+        List rest = *this;
+        ++rest.offset;
+        --rest.length;
+        return rest;
+    }
+
+private:
+    std::shared_ptr<const std::vector<double>> storage;
+    size_t offset = 0;
+    size_t length = 0;
+};
+
+struct Pipeline; // pipeline.h
+
+// Result of evaluating an expression: a scalar, a list, or a reference to a
+// function (e.g. the first argument of map), in one 64-bit word. Scalars are
+// the bits of the double. The others are NaNs no arithmetic produces: the top
+// 16 bits tag them and the low 48 hold a pointer to the list, which is
+// reference-counted and shared by every copy, or the function's symbol.
+// A list is either a List or a lazy one, read from a pipeline at an offset.
+class Value {
+public:
+    Value() = default; // 0
+    Value(double number) {
+        std::memcpy(&bits, &number, sizeof bits);
+        if (bits >= firstTag) bits = negativeNaN; // A NaN that would read as a tag
+    }
+    Value(List list) : bits(listTag | reinterpret_cast<uintptr_t>(new Boxed(std::move(list)))) {}
+    Value(std::shared_ptr<Pipeline> pipeline, size_t offset)
+        : bits(listTag | reinterpret_cast<uintptr_t>(new Boxed(std::move(pipeline), offset))) {}
+    static Value function(size_t symbol) {
+        Value value;
+        value.bits = functionTag | symbol;
+        return value;
+    }
+
+    Value(const Value& other) : bits(other.bits) { retain(); }
+    Value(Value&& other) noexcept : bits(other.bits) { other.bits = 0; }
+    Value& operator=(const Value& other) {
+        if (this != &other) {
+            other.retain();
+            release();
+            bits = other.bits;
+        }
+        return *this;
+    }
+    Value& operator=(Value&& other) noexcept {
+        if (this != &other) {
+            release();
+            bits = other.bits;
+            other.bits = 0;
+        }
+        return *this;
+    }
+    ~Value() { release(); }
+
+    bool isNumber() const { return bits < firstTag; }
+    bool isList() const { return (bits & tagMask) == listTag; }
+    bool isFunction() const { return (bits & tagMask) == functionTag; }
+    bool isLazy() const { return isList() && boxed()->pipeline; }
+
+    double number() const {
+        double number;
+        std::memcpy(&number, &bits, sizeof number);
+        return number;
+    }
+    const List& list() const { return boxed()->list; } // Of lists that are not lazy
+    const std::shared_ptr<Pipeline>& pipeline() const { return boxed()->pipeline; }
+    size_t offset() const { return boxed()->offset; }
+    size_t symbol() const { return static_cast<size_t>(bits & payloadMask); }
+
+private:
+    struct Boxed {
+        explicit Boxed(List list) : list(std::move(list)) {}
+        Boxed(std::shared_ptr<Pipeline> pipeline, size_t offset) : pipeline(std::move(pipeline)), offset(offset) {}
+        std::atomic<size_t> references{1};
+        List list;
+        std::shared_ptr<Pipeline> pipeline; // Set for lazy lists
+        size_t offset = 0;
+    };
+
+    static constexpr uint64_t tagMask = 0xffff000000000000ULL;
+    static constexpr uint64_t payloadMask = ~tagMask;
+    static constexpr uint64_t firstTag = 0xfffc000000000000ULL;
+    static constexpr uint64_t listTag = 0xfffc000000000000ULL;
+    static constexpr uint64_t functionTag = 0xfffd000000000000ULL;
+    static constexpr uint64_t negativeNaN = 0xfff8000000000000ULL;
+
+    Boxed* boxed() const { return reinterpret_cast<Boxed*>(static_cast<uintptr_t>(bits & payloadMask)); }
+    void retain() const {
+        if (isList()) boxed()->references.fetch_add(1, std::memory_order_relaxed);
+    }
+    void release() {
+        if (isList() && boxed()->references.fetch_sub(1, std::memory_order_acq_rel) == 1) delete boxed();
+    }
+
+    uint64_t bits = 0;
+};
+
+static_assert(sizeof(Value) == 8, "Value must stay one machine word");
+
+// The arguments of a call: a view of values owned by the caller, e.g. a
+// frame of the tree walker or a slice of the VM's operand stack
+class Arguments {
+public:
+    Arguments() = default;
+    Arguments(const Value* values, size_t count) : values(values), count(count) {}
+    Arguments(const std::vector<Value>& values) : values(values.data()), count(values.size()) {}
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const Value* data() const { return values; }
+    const Value* begin() const { return values; }
+    const Value* end() const { return values + count; }
+    const Value& operator[](size_t i) const { return values[i]; }
+
+private:
+    const Value* values = nullptr;
+    size_t count = 0;
+};
+
+#endif // VALUE_H
@@ -0,0 +1,340 @@
+#include "interpreter.h"
+
+// Stack-based execution engine for compiled chunks. User function calls push
+// a frame on a heap-allocated frame stack instead of recursing through
+// callFunction, arguments stay on the operand stack and are addressed by slot.
+// Calls in tail position reuse the caller's frame, so loop-style recursion
+// runs in constant memory.
+
+namespace {
+
+struct ScalarFrame {
+    const Chunk* chunk;
+    size_t ip;
+    size_t base;
+};
+
+struct Frame {
+    const Chunk* chunk;
+    size_t ip;
+    size_t base; // Index of argument slot #0 on the operand stack
+    size_t argc;
+    MemoCache* memo; // Receives the result on return when the callee is memoized
+    bool profiled = false; // Entered in the profiler, which is told when it returns
+};
+
+// Stacks of runScalar, kept for the next call on the same thread so that
+// entering scalar code from boxed code, e.g. for every element of a map,
+// does not allocate. Scalar code never calls back into the engines, so only
+// one runScalar at a time uses them.
+thread_local std::vector<double> scalarStack;
+thread_local std::vector<ScalarFrame> scalarFrames;
+
+} // namespace
+
+const Chunk& ThisFuncInterpreter::codeFor(const Function& function) const {
+    return *function.code;
+}
+
+double ThisFuncInterpreter::popDouble(std::vector<Value>& stack) const {
+    Value& top = stack.back();
+    if (top.isNumber()) {
+        double value = top.number();
+        stack.pop_back();
+        return value;
+    }
+    return toDouble(top); // Throws the type error
+}
+
+Value ThisFuncInterpreter::runChunk(const Chunk& entry, Arguments args) {
+    std::vector<Value> stack(args.begin(), args.end());
+    std::vector<Frame> frames;
+    Frame frame{&entry, 0, 0, args.size(), nullptr};
+
+    while (true) {
+        const Instruction& instruction = frame.chunk->code[frame.ip++];
+
+        switch (instruction.op) {
+        case OpCode::PushConst:
+            stack.emplace_back(frame.chunk->constants[instruction.operand]);
+            break;
+
+        case OpCode::LoadArg:
+            if (instruction.operand >= frame.argc) {
+                throw std::runtime_error("Missing argument #" + std::to_string(instruction.operand));
+            }
+            {
+                Value arg = stack[frame.base + instruction.operand];
+                stack.push_back(std::move(arg));
+            }
+            break;
+
+        case OpCode::LoadName:
+            stack.push_back(loadName(instruction.operand));
+            break;
+
+        case OpCode::Add: { double b = popDouble(stack); double a = popDouble(stack); stack.emplace_back(a + b); break; }
+        case OpCode::Sub: { double b = popDouble(stack); double a = popDouble(stack); stack.emplace_back(a - b); break; }
+        case OpCode::Mul: { double b = popDouble(stack); double a = popDouble(stack); stack.emplace_back(a * b); break; }
+        case OpCode::Div: {
+            double b = popDouble(stack);
+            double a = popDouble(stack);
+            if (b == 0) throw std::runtime_error("Division by zero");
+            stack.emplace_back(a / b);
+            break;
+        }
+        case OpCode::Pow: { double b = popDouble(stack); double a = popDouble(stack); stack.emplace_back(std::pow(a, b)); break; }
+        case OpCode::Sqrt: {
+            double value = popDouble(stack);
+            if (value < 0) throw std::runtime_error("sqrt requires a non-negative argument");
+            stack.emplace_back(std::sqrt(value));
+            break;
+        }
+        case OpCode::Sin: stack.emplace_back(std::sin(popDouble(stack))); break;
+        case OpCode::Cos: stack.emplace_back(std::cos(popDouble(stack))); break;
+        case OpCode::Eq: { double b = popDouble(stack); double a = popDouble(stack); stack.emplace_back(a == b ? 1.0 : 0.0); break; }
+        case OpCode::Le: { double b = popDouble(stack); double a = popDouble(stack); stack.emplace_back(a <= b ? 1.0 : 0.0); break; }
+        case OpCode::Not: stack.emplace_back(popDouble(stack) == 0 ? 1.0 : 0.0); break;
+
+        case OpCode::Jump:
+            frame.ip = instruction.operand;
+            break;
+
+        case OpCode::JumpIfFalse:
+            if (popDouble(stack) == 0) frame.ip = instruction.operand;
+            break;
+
+        case OpCode::CallBuiltin:
+        case OpCode::CallUser:
+        case OpCode::TailCall: {
+            const Function* function = &functions[instruction.operand];
+            if (!function->defined()) {
+                throw std::runtime_error("Unknown function: " + function->name);
+            }
+
+            if (function->jit && !forks(callDepth + frames.size())) {
+                size_t base = stack.size() - instruction.argc;
+                Value result;
+                if (runNative(*function, stack.data() + base, instruction.argc, callDepth + frames.size(), result)) {
+                    stack.resize(base);
+                    stack.push_back(std::move(result));
+                    if (instruction.op == OpCode::TailCall) goto returnFromFrame;
+                    break;
+                }
+            }
+
+            if (function->scalar) {
+                // The callee replaces the current frame as in a tail call below
+                size_t depth = callDepth + frames.size();
+                bool replaces = instruction.op == OpCode::TailCall && !frame.memo;
+                size_t base = stack.size() - instruction.argc;
+                Value result;
+                if ((replaces || depth < maxStackDepth)
+                    && callScalar(*function, stack.data() + base, instruction.argc, replaces ? depth : depth + 1, result)) {
+                    stack.resize(base);
+                    stack.push_back(std::move(result));
+                    if (instruction.op == OpCode::TailCall) goto returnFromFrame;
+                    break;
+                }
+            }
+
+            if (function->body) {
+                Budget::step();
+                const Chunk& callee = codeFor(*function);
+                size_t base = stack.size() - instruction.argc;
+                MemoCache* memo = nullptr;
+
+                if (function->memo) {
+                    Arguments key(stack.data() + base, instruction.argc);
+                    if (MemoCache::cacheable(key)) {
+                        Value cached;
+                        if (function->memo->find(key, cached)) {
+                            if (profiler) {
+                                profiler->enter(instruction.operand);
+                                profiler->exit();
+                            }
+                            stack.resize(base);
+                            stack.push_back(std::move(cached));
+                            if (instruction.op == OpCode::TailCall) goto returnFromFrame;
+                            break;
+                        }
+                        memo = function->memo.get();
+                    }
+                }
+
+                // A memoizing frame must see its own return, so it is never replaced
+                if (instruction.op == OpCode::TailCall && !memo && !frame.memo) {
+                    // Replace the current frame: move the new arguments into its slots,
+                    // unless they already are (a call from the top level), as moving a
+                    // value onto itself empties it
+                    if (base != frame.base) {
+                        std::move(stack.begin() + base, stack.end(), stack.begin() + frame.base);
+                    }
+                    stack.resize(frame.base + instruction.argc);
+                    if (profiler) {
+                        if (frame.profiled) profiler->exit();
+                        profiler->enter(instruction.operand);
+                    }
+                    frame = {&callee, 0, frame.base, instruction.argc, nullptr, profiler != nullptr};
+                    break;
+                }
+                if (callDepth + frames.size() >= maxStackDepth) {
+                    throw std::runtime_error("Stack overflow: recursion deeper than " + std::to_string(maxStackDepth) + " calls");
+                }
+                // Enter the callee; its arguments are already in place on the stack
+                frames.push_back(frame);
+                if (profiler) profiler->enter(instruction.operand);
+                frame = {&callee, 0, base, instruction.argc, memo, profiler != nullptr};
+                break;
+            }
+
+            // Builtins read their arguments where they are on the stack. The
+            // user functions they call (e.g. map's) nest below this frame.
+            size_t base = stack.size() - instruction.argc;
+            if (profiler) profiler->enter(instruction.operand);
+            size_t savedDepth = callDepth;
+            callDepth += frames.size();
+            Value result = function->implementation(*this, Arguments(stack.data() + base, instruction.argc));
+            callDepth = savedDepth;
+            if (profiler) profiler->exit();
+            stack.resize(base);
+            stack.push_back(std::move(result));
+            if (instruction.op == OpCode::TailCall) {
+                goto returnFromFrame;
+            }
+            break;
+        }
+
+        case OpCode::Fork: {
+            // Frames nest on top of the depth a forked chunk was started at
+            size_t depth = callDepth + frames.size();
+            if (!forks(depth)) break;
+            const ForkPoint& fork = frame.chunk->forks[instruction.operand];
+            Arguments frameArgs(stack.data() + frame.base, frame.argc);
+            std::vector<Value> values = forkArguments(fork.args.size(), depth, [&](size_t i) {
+                return runChunk(*fork.args[i], frameArgs);
+            });
+            for (auto& value : values) {
+                stack.push_back(std::move(value));
+            }
+            frame.ip = fork.end;
+            break;
+        }
+
+        case OpCode::Throw:
+            throw std::runtime_error(frame.chunk->messages[instruction.operand]);
+
+        case OpCode::Return:
+        returnFromFrame: {
+            Value result = std::move(stack.back());
+            if (frame.profiled) profiler->exit();
+            if (frame.memo) {
+                frame.memo->insert(Arguments(stack.data() + frame.base, frame.argc), result);
+            }
+            stack.resize(frame.base);
+            if (frames.empty()) {
+                return result;
+            }
+            stack.push_back(std::move(result));
+            frame = frames.back();
+            frames.pop_back();
+            break;
+        }
+        }
+    }
+}
+
+// runChunk for the code of scalar functions, with a stack of unboxed numbers.
+// The checker made sure the code only loads arguments it has, computes with
+// numbers and calls scalar functions with the arguments they take. depth is
+// the call depth of the entry frame.
+double ThisFuncInterpreter::runScalar(const Chunk& entry, const double* args, size_t count, size_t depth) {
+    std::vector<double>& stack = scalarStack;
+    std::vector<ScalarFrame>& frames = scalarFrames;
+    stack.assign(args, args + count);
+    frames.clear();
+    ScalarFrame frame{&entry, 0, 0};
+
+    while (true) {
+        const Instruction& instruction = frame.chunk->code[frame.ip++];
+
+        switch (instruction.op) {
+        case OpCode::PushConst:
+            stack.push_back(frame.chunk->constants[instruction.operand]);
+            break;
+
+        case OpCode::LoadArg:
+            stack.push_back(stack[frame.base + instruction.operand]);
+            break;
+
+        case OpCode::Add: { double b = stack.back(); stack.pop_back(); stack.back() += b; break; }
+        case OpCode::Sub: { double b = stack.back(); stack.pop_back(); stack.back() -= b; break; }
+        case OpCode::Mul: { double b = stack.back(); stack.pop_back(); stack.back() *= b; break; }
+        case OpCode::Div: {
+            double b = stack.back();
+            stack.pop_back();
+            if (b == 0) throw std::runtime_error("Division by zero");
+            stack.back() /= b;
+            break;
+        }
+        case OpCode::Pow: { double b = stack.back(); stack.pop_back(); stack.back() = std::pow(stack.back(), b); break; }
+        case OpCode::Sqrt:
+            if (stack.back() < 0) throw std::runtime_error("sqrt requires a non-negative argument");
+            stack.back() = std::sqrt(stack.back());
+            break;
+        case OpCode::Sin: stack.back() = std::sin(stack.back()); break;
+        case OpCode::Cos: stack.back() = std::cos(stack.back()); break;
+        case OpCode::Eq: { double b = stack.back(); stack.pop_back(); stack.back() = stack.back() == b ? 1.0 : 0.0; break; }
+        case OpCode::Le: { double b = stack.back(); stack.pop_back(); stack.back() = stack.back() <= b ? 1.0 : 0.0; break; }
+        case OpCode::Not: stack.back() = stack.back() == 0 ? 1.0 : 0.0; break;
+
+        case OpCode::Jump:
+            frame.ip = instruction.operand;
+            break;
+
+        case OpCode::JumpIfFalse: {
+            double condition = stack.back();
+            stack.pop_back();
+            if (condition == 0) frame.ip = instruction.operand;
+            break;
+        }
+
+        case OpCode::CallUser:
+        case OpCode::TailCall: {
+            Budget::step();
+            const Chunk& callee = codeFor(functions[instruction.operand]);
+            size_t base = stack.size() - instruction.argc;
+            if (instruction.op == OpCode::TailCall) {
+                std::copy(stack.begin() + base, stack.end(), stack.begin() + frame.base);
+                stack.resize(frame.base + instruction.argc);
+                frame = {&callee, 0, frame.base};
+                break;
+            }
+            if (depth + frames.size() >= maxStackDepth) {
+                throw std::runtime_error("Stack overflow: recursion deeper than " + std::to_string(maxStackDepth) + " calls");
+            }
+            frames.push_back(frame);
+            frame = {&callee, 0, base};
+            break;
+        }
+
+        case OpCode::Fork:
+            break; // Scalar code only runs where calls no longer fork
+
+        case OpCode::Return: {
+            double result = stack.back();
+            stack.resize(frame.base);
+            if (frames.empty()) {
+                return result;
+            }
+            stack.push_back(result);
+            frame = frames.back();
+            frames.pop_back();
+            break;
+        }
+
+        default:
+            throw std::logic_error("Unexpected instruction in scalar code");
+        }
+    }
+}